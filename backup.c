@@ -0,0 +1,442 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "operations.h"
+
+// Kind of a line of a backup
+enum EntryKind { ENTRY_SKIP, ENTRY_PAIR, ENTRY_DELETED, ENTRY_MALFORMED };
+
+// Value length of the entries of deleted keys
+#define LOAD_DELETED UINT32_MAX
+
+// Entry of a backup being loaded, pointing into the mapped file. The value of
+// a pair follows its key and ", ".
+typedef struct LoadEntry {
+  const char *key;
+  uint32_t key_len;
+  uint32_t value_len; // LOAD_DELETED for deleted keys
+} LoadEntry;
+
+typedef struct EntryList {
+  LoadEntry *entries;
+  size_t len;
+  size_t capacity;
+} EntryList;
+
+// Part of a backup loaded by one thread. The thread first parses the lines of
+// its chunk, then applies the entries of every chunk that belong to its
+// buckets.
+typedef struct LoadChunk {
+  pthread_t thread;
+  int started;
+  HashTable *ht;
+  StringView lines;
+  size_t index;
+  size_t num_chunks; // Also the number of partitions, a power of two
+  struct LoadChunk *chunks;
+  EntryList *partitions; // Entries of the chunk, by thread applying them
+  int result;
+} LoadChunk;
+
+/*AUXILIARY FUNCTIONS*/
+
+/// Maps a whole backup file into memory.
+/// @param path Path of the backup file.
+/// @param file Output view of the contents, empty for empty files.
+/// @return 0 on success, 1 if the file could not be read.
+static int map_backup(const char *path, StringView *file) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open backup file: %s\n", path);
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "Failed to read backup file: %s\n", path);
+    close(fd);
+    return 1;
+  }
+  file->data = NULL;
+  file->len = (size_t)st.st_size;
+  if (file->len > 0) {
+    void *map = mmap(NULL, file->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "Failed to read backup file: %s\n", path);
+      close(fd);
+      return 1;
+    }
+    posix_madvise(map, file->len, POSIX_MADV_SEQUENTIAL);
+    file->data = map;
+  }
+  close(fd);
+  return 0;
+}
+
+static void unmap_backup(StringView file) {
+  if (file.len > 0) {
+    munmap((void *)file.data, file.len);
+  }
+}
+
+/// Finds the backup a delta backup applies to.
+/// @param file Contents of the backup.
+/// @param path Path of the backup, the base is in the same directory.
+/// @param base_path Output path of the base backup, PATH_MAX bytes long.
+/// @return 1 if the backup is a delta, 0 if it is a full backup.
+static int find_base(StringView file, const char *path, char *base_path) {
+  size_t header_len = strlen(BACKUP_DELTA_HEADER);
+  if (file.len < header_len ||
+      memcmp(file.data, BACKUP_DELTA_HEADER, header_len) != 0) {
+    return 0;
+  }
+
+  const char *name = file.data + header_len;
+  const char *end = memchr(name, '\n', file.len - header_len);
+  size_t name_len =
+      end != NULL ? (size_t)(end - name) : file.len - header_len;
+  const char *slash = strrchr(path, '/');
+  int dir_len = slash != NULL ? (int)(slash - path + 1) : 0;
+  snprintf(base_path, PATH_MAX, "%.*s%.*s", dir_len, path, (int)name_len,
+           name);
+  return 1;
+}
+
+/// Parses a line of a backup.
+/// @param line Line, without its '\n'.
+/// @param key Output key of the entry.
+/// @param value Output value of a pair.
+/// @return Kind of the line.
+static enum EntryKind parse_entry(StringView line, StringView *key,
+                                  StringView *value) {
+  if (line.len == 0 || line.data[0] == '#') {
+    return ENTRY_SKIP; // Header or empty line
+  }
+  if (line.len < 3 || line.data[0] != '(' ||
+      line.data[line.len - 1] != ')') {
+    fprintf(stderr, "Malformed backup entry: %.*s\n", (int)line.len,
+            line.data);
+    return ENTRY_MALFORMED;
+  }
+
+  // Keys never hold commas, so the first one ends the key
+  StringView entry = {line.data + 1, line.len - 2};
+  const char *comma = memchr(entry.data, ',', entry.len);
+  if (comma == NULL) {
+    *key = entry;
+    return ENTRY_DELETED;
+  }
+  *key = (StringView){entry.data, (size_t)(comma - entry.data)};
+  if (key->len + 2 > entry.len || comma[1] != ' ') {
+    fprintf(stderr, "Malformed backup entry: %.*s\n", (int)line.len,
+            line.data);
+    return ENTRY_MALFORMED;
+  }
+  *value = (StringView){comma + 2, entry.len - key->len - 2};
+  return ENTRY_PAIR;
+}
+
+/// Applies an entry to the table.
+/// @return 0 on success, 1 if the pair could not be written.
+static int apply_entry(HashTable *ht, enum EntryKind kind, StringView key,
+                       StringView value) {
+  if (kind == ENTRY_DELETED) {
+    delete_pair(ht, key); // Deleted since the base, may be missing
+    return 0;
+  }
+  if (write_pair(ht, key, value)) {
+    fprintf(stderr, "Failed to load keypair (%.*s,%.*s)\n", (int)key.len,
+            key.data, (int)value.len, value.data);
+    return 1;
+  }
+  return 0;
+}
+
+/// Number of threads a backup of the given size is loaded by, a power of two
+/// so that each one can own the buckets of a few low bits of the hash.
+static size_t load_threads(size_t len, size_t max_threads) {
+  if (max_threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    max_threads = cpus > 0 ? (size_t)cpus : 1;
+  }
+  if (max_threads > BACKUP_MAX_LOAD_THREADS) {
+    max_threads = BACKUP_MAX_LOAD_THREADS;
+  }
+  size_t num_threads = 1;
+  while (num_threads * 2 <= max_threads &&
+         len / (num_threads * 2) >= BACKUP_MIN_CHUNK) {
+    num_threads *= 2;
+  }
+  return num_threads;
+}
+
+static void append_entry(EntryList *list, LoadEntry entry) {
+  if (list->len == list->capacity) {
+    list->capacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+    LoadEntry *entries =
+        realloc(list->entries, list->capacity * sizeof(LoadEntry));
+    if (entries == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(1);
+    }
+    list->entries = entries;
+  }
+  list->entries[list->len++] = entry;
+}
+
+/// Parses the lines of a chunk into the partitions of the threads whose
+/// buckets the keys belong to.
+static void *parse_chunk(void *arg) {
+  LoadChunk *chunk = arg;
+  size_t mask = chunk->num_chunks - 1;
+  const char *pos = chunk->lines.data;
+  const char *end = chunk->lines.data + chunk->lines.len;
+
+  while (pos < end) {
+    const char *eol = memchr(pos, '\n', (size_t)(end - pos));
+    if (eol == NULL) {
+      eol = end;
+    }
+    StringView line = {pos, (size_t)(eol - pos)};
+    pos = eol < end ? eol + 1 : end;
+
+    StringView key;
+    StringView value = {NULL, 0};
+    enum EntryKind kind = parse_entry(line, &key, &value);
+    if (kind == ENTRY_SKIP) {
+      continue;
+    }
+    if (kind == ENTRY_MALFORMED || value.len >= LOAD_DELETED) {
+      chunk->result = 1;
+      return NULL;
+    }
+    LoadEntry entry = {key.data, (uint32_t)key.len,
+                       kind == ENTRY_DELETED ? LOAD_DELETED
+                                             : (uint32_t)value.len};
+    size_t partition = hash(key.data, key.len) & mask;
+    append_entry(&chunk->partitions[partition], entry);
+  }
+  return NULL;
+}
+
+/// Applies the entries of a thread's partition, chunk by chunk in file order,
+/// so every entry of a key is applied in order. No other thread touches its
+/// buckets, so they aren't locked.
+static void *insert_partition(void *arg) {
+  LoadChunk *chunk = arg;
+  for (size_t i = 0; i < chunk->num_chunks && !chunk->result; i++) {
+    EntryList *list = &chunk->chunks[i].partitions[chunk->index];
+    for (size_t j = 0; j < list->len; j++) {
+      LoadEntry *entry = &list->entries[j];
+      StringView key = {entry->key, entry->key_len};
+      StringView value = {entry->key + entry->key_len + 2, 0};
+      enum EntryKind kind = ENTRY_DELETED;
+      if (entry->value_len != LOAD_DELETED) {
+        kind = ENTRY_PAIR;
+        value.len = entry->value_len;
+      }
+      if (apply_entry(chunk->ht, kind, key, value)) {
+        chunk->result = 1;
+        break;
+      }
+    }
+  }
+  return NULL;
+}
+
+/// Runs a function over every chunk, each on its own thread. Chunks whose
+/// thread could not be started are run by the calling thread.
+static void run_chunks(LoadChunk *chunks, size_t num_chunks,
+                       void *(*fn)(void *)) {
+  for (size_t i = 0; i < num_chunks; i++) {
+    chunks[i].started =
+        pthread_create(&chunks[i].thread, NULL, fn, &chunks[i]) == 0;
+  }
+  for (size_t i = 0; i < num_chunks; i++) {
+    if (chunks[i].started) {
+      pthread_join(chunks[i].thread, NULL);
+    } else {
+      fn(&chunks[i]);
+    }
+  }
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+int apply_log(HashTable *ht, StringView file) {
+  const char *pos = file.data;
+  const char *end = file.data + file.len;
+
+  while (pos < end) {
+    const char *eol = memchr(pos, '\n', (size_t)(end - pos));
+    if (eol == NULL) {
+      eol = end;
+    }
+    StringView line = {pos, (size_t)(eol - pos)};
+    pos = eol < end ? eol + 1 : end;
+
+    StringView key;
+    StringView value;
+    enum EntryKind kind = parse_entry(line, &key, &value);
+    if (kind == ENTRY_SKIP) {
+      continue;
+    }
+    if (kind == ENTRY_MALFORMED) {
+      return 1;
+    }
+    if (hash_table_overloaded(ht) && grow_hash_table(ht)) {
+      fprintf(stderr, "Failed to grow hash table\n");
+      return 1;
+    }
+    if (apply_entry(ht, kind, key, value)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int apply_backup(HashTable *ht, StringView file, size_t max_threads) {
+  size_t num_threads = load_threads(file.len, max_threads);
+  if (num_threads == 1) {
+    // Sized for one pair per line up front, rather than grown step by step
+    size_t num_lines = 0;
+    const char *end = file.data + file.len;
+    for (const char *eol = file.data;
+         (eol = memchr(eol, '\n', (size_t)(end - eol))) != NULL; eol++) {
+      num_lines++;
+    }
+    if (reserve_hash_table(ht, atomic_load(&ht->count) + num_lines)) {
+      fprintf(stderr, "Failed to grow hash table\n");
+      return 1;
+    }
+    return apply_log(ht, file);
+  }
+
+  LoadChunk *chunks = safe_malloc(num_threads * sizeof(LoadChunk));
+  const char *start = file.data;
+  const char *end = file.data + file.len;
+  for (size_t i = 0; i < num_threads; i++) {
+    // Chunks end at the end of a line, the last one at the end of the file
+    const char *chunk_end = file.data + file.len / num_threads * (i + 1);
+    if (i == num_threads - 1 || chunk_end >= end) {
+      chunk_end = end;
+    } else {
+      const char *eol = memchr(chunk_end, '\n', (size_t)(end - chunk_end));
+      chunk_end = eol != NULL ? eol + 1 : end;
+    }
+    if (chunk_end < start) {
+      chunk_end = start;
+    }
+    chunks[i].ht = ht;
+    chunks[i].lines = (StringView){start, (size_t)(chunk_end - start)};
+    chunks[i].index = i;
+    chunks[i].num_chunks = num_threads;
+    chunks[i].chunks = chunks;
+    chunks[i].partitions = safe_malloc(num_threads * sizeof(EntryList));
+    for (size_t p = 0; p < num_threads; p++) {
+      chunks[i].partitions[p] = (EntryList){NULL, 0, 0};
+    }
+    chunks[i].result = 0;
+    start = chunk_end;
+  }
+
+  // Nothing is applied unless every entry is well formed
+  run_chunks(chunks, num_threads, parse_chunk);
+  int result = 0;
+  size_t num_entries = 0;
+  for (size_t i = 0; i < num_threads; i++) {
+    result |= chunks[i].result;
+    for (size_t p = 0; p < num_threads; p++) {
+      num_entries += chunks[i].partitions[p].len;
+    }
+  }
+  if (!result && reserve_hash_table(ht, atomic_load(&ht->count) +
+                                            num_entries)) {
+    fprintf(stderr, "Failed to grow hash table\n");
+    result = 1;
+  }
+  if (!result) {
+    run_chunks(chunks, num_threads, insert_partition);
+    for (size_t i = 0; i < num_threads; i++) {
+      result |= chunks[i].result;
+    }
+  }
+
+  for (size_t i = 0; i < num_threads; i++) {
+    for (size_t p = 0; p < num_threads; p++) {
+      free(chunks[i].partitions[p].entries);
+    }
+    free(chunks[i].partitions);
+  }
+  free(chunks);
+  return result;
+}
+
+int load_backup(HashTable *ht, const char *path, size_t max_threads) {
+  // Follow the chain of deltas down to the full backup, newest first
+  char **chain = safe_malloc(BACKUP_MAX_CHAIN * sizeof(char *));
+  size_t length = 0;
+  chain[length++] = strdup(path);
+
+  int result = 0;
+  while (1) {
+    StringView file;
+    if (map_backup(chain[length - 1], &file)) {
+      result = 1;
+      break;
+    }
+    char base_path[PATH_MAX];
+    int is_delta = find_base(file, chain[length - 1], base_path);
+    unmap_backup(file);
+    if (!is_delta) {
+      break;
+    }
+    if (length == BACKUP_MAX_CHAIN) {
+      fprintf(stderr, "Too many deltas on top of backup: %s\n", base_path);
+      result = 1;
+      break;
+    }
+    chain[length++] = strdup(base_path);
+  }
+
+  // Then apply them oldest first
+  for (size_t i = length; i > 0 && !result; i--) {
+    StringView file;
+    if (map_backup(chain[i - 1], &file)) {
+      result = 1;
+      break;
+    }
+    result = apply_backup(ht, file, max_threads);
+    unmap_backup(file);
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    free(chain[i]);
+  }
+  free(chain);
+  return result;
+}
+
+int sync_parent_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char dir_path[PATH_MAX];
+  snprintf(dir_path, sizeof(dir_path), "%.*s",
+           slash != NULL ? (int)(slash - path + 1) : 1,
+           slash != NULL ? path : ".");
+  int fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return 1;
+  }
+  int result = fsync(fd) != 0;
+  close(fd);
+  return result;
+}
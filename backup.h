@@ -0,0 +1,58 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+// First line of a delta backup, followed by the name of the backup it applies
+// to. Backups without it are full backups.
+#define BACKUP_DELTA_HEADER "#delta "
+// Maximum number of backups a delta may depend on, directly or not.
+#define BACKUP_MAX_CHAIN 4096
+// Smallest part of a backup worth loading on its own thread.
+#define BACKUP_MIN_CHUNK (1 << 20)
+// Maximum number of threads a backup is loaded by.
+#define BACKUP_MAX_LOAD_THREADS 16
+
+#include "kvs.h"
+
+// Backup files hold one entry per line:
+//   (key, value)  pair present in the table
+//   (key)         key deleted since the base backup, only in deltas
+// Deletions come before the pairs, so a key deleted and written again after
+// the base backup ends up present.
+
+/// Applies entries with the syntax of a backup to the table in order, growing
+/// it as needed and skipping the lines starting with '#'. Unlike a backup,
+/// the entries may change the same key many times. The caller must have
+/// exclusive access to the table.
+/// @param ht Hash table to be modified.
+/// @param file Entries to be applied.
+/// @return 0 on success, 1 if an entry is malformed.
+int apply_log(HashTable *ht, StringView file);
+
+/// Applies the entries of a backup to the table, skipping the lines starting
+/// with '#'. The table is first grown for one pair per entry. Big backups are
+/// split in chunks parsed by several threads, which then insert the entries,
+/// each into its own buckets. The caller must have exclusive access to the
+/// table.
+/// @param ht Hash table to be modified.
+/// @param file Contents of the backup.
+/// @param max_threads Maximum number of threads, 0 for one per CPU.
+/// @return 0 on success, 1 if an entry is malformed.
+int apply_backup(HashTable *ht, StringView file, size_t max_threads);
+
+/// Loads a backup into the table. A delta backup loads the backups it depends
+/// on first, which are looked up in the same directory. The caller must have
+/// exclusive access to the table.
+/// @param ht Hash table to be loaded.
+/// @param path Path of the backup file.
+/// @param max_threads Maximum number of threads loading each file, 0 for one
+/// per CPU.
+/// @return 0 on success, 1 if a file could not be read or is malformed.
+int load_backup(HashTable *ht, const char *path, size_t max_threads);
+
+/// Syncs the directory of a file, so that a file renamed into it stays there
+/// after a crash.
+/// @param path Path of the file.
+/// @return 0 on success, 1 if the directory could not be synced.
+int sync_parent_dir(const char *path);
+
+#endif // KVS_BACKUP_H
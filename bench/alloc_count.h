@@ -0,0 +1,59 @@
+// Counts the heap allocations made by the program it is included in. The
+// allocation functions are replaced by wrappers around the glibc ones, so
+// calls from the KVS objects linked into the benchmark are counted too.
+// Must be included by exactly one file of the program.
+
+#ifndef KVS_BENCH_ALLOC_COUNT_H
+#define KVS_BENCH_ALLOC_COUNT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_size_t alloc_count = 0;
+static atomic_size_t free_count = 0;
+
+void *malloc(size_t size) {
+  atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+  atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+  return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  if (ptr != NULL) {
+    atomic_fetch_add_explicit(&free_count, 1, memory_order_relaxed);
+  }
+  __libc_free(ptr);
+}
+
+// glibc's strdup allocates internally, without going through malloc
+char *strdup(const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = malloc(len);
+  if (copy != NULL) {
+    memcpy(copy, str, len);
+  }
+  return copy;
+}
+
+/// Number of allocations made so far.
+static inline size_t allocations(void) { return atomic_load(&alloc_count); }
+
+/// Number of non-NULL pointers freed so far.
+static inline size_t deallocations(void) { return atomic_load(&free_count); }
+
+#endif // KVS_BENCH_ALLOC_COUNT_H
@@ -0,0 +1,132 @@
+// Steady WRITE/DELETE churn: every thread keeps writing batches of pairs with
+// values of random length and deleting random keys, so nodes and values are
+// constantly created, overwritten and freed. Reports the heap allocations
+// made during the run and the peak resident set size.
+//
+// Usage: churn_bench [num_keys] [threads] [batches_per_thread] [-r]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alloc_count.h"
+#include "constants.h"
+#include "operations.h"
+
+#define WRITE_BATCH 8
+#define DELETE_BATCH 4
+
+static char (*all_keys)[MAX_STRING_SIZE];
+static size_t num_keys;
+static size_t batches_per_thread;
+static int null_fd;
+
+/// xorshift64, each thread keeps its own state.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/// Returns a view of the given string.
+static StringView view_of(const char *str) {
+  return (StringView){str, strlen(str)};
+}
+
+static void *churn(void *arg) {
+  uint64_t state = (uint64_t)(size_t)arg * 0x9e3779b97f4a7c15ULL + 1;
+  char values[WRITE_BATCH][MAX_STRING_SIZE];
+  StringView keys[WRITE_BATCH];
+  StringView value_views[WRITE_BATCH];
+  OutputBuffer out;
+  output_init(&out, null_fd);
+
+  for (size_t done = 0; done < batches_per_thread; done++) {
+    for (size_t i = 0; i < WRITE_BATCH; i++) {
+      keys[i] = view_of(all_keys[next_random(&state) % num_keys]);
+      size_t len = 1 + next_random(&state) % (MAX_STRING_SIZE - 1);
+      memset(values[i], 'a' + (int)(done % 26), len);
+      value_views[i] = (StringView){values[i], len};
+    }
+    kvs_write(WRITE_BATCH, keys, value_views);
+
+    for (size_t i = 0; i < DELETE_BATCH; i++) {
+      keys[i] = view_of(all_keys[next_random(&state) % num_keys]);
+    }
+    kvs_delete(DELETE_BATCH, keys, &out);
+    output_end_command(&out);
+  }
+  output_flush(&out);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int num_threads = 4;
+  KvsOptions options = {0};
+  num_keys = 100000;
+  batches_per_thread = 200000;
+
+  if (argc > 4 && strcmp(argv[4], "-r") == 0) {
+    options.lockfree_reads = 1;
+    argc--;
+  }
+  if ((argc > 1 && sscanf(argv[1], "%zu", &num_keys) != 1) ||
+      (argc > 2 && sscanf(argv[2], "%d", &num_threads) != 1) ||
+      (argc > 3 && sscanf(argv[3], "%zu", &batches_per_thread) != 1) ||
+      argc > 4 || num_keys == 0 || num_threads <= 0) {
+    fprintf(stderr,
+            "Usage: %s [num_keys] [threads] [batches_per_thread] [-r]\n",
+            argv[0]);
+    return 1;
+  }
+
+  all_keys = safe_malloc(num_keys * MAX_STRING_SIZE);
+  for (size_t i = 0; i < num_keys; i++) {
+    snprintf(all_keys[i], MAX_STRING_SIZE, "key%zu", i);
+  }
+  null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd == -1) {
+    fprintf(stderr, "Failed to open /dev/null\n");
+    return 1;
+  }
+  if (kvs_init(&options)) {
+    return 1;
+  }
+
+  pthread_t threads[num_threads];
+  size_t allocs_before = allocations();
+  size_t frees_before = deallocations();
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, churn, (void *)(size_t)(i + 1));
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  size_t allocs = allocations() - allocs_before;
+  size_t frees = deallocations() - frees_before;
+
+  double seconds = (double)(end.tv_sec - start.tv_sec) +
+                   (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  double batches = (double)batches_per_thread * num_threads;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("mode=%s threads=%d batches=%.0f batches_per_sec=%.0f "
+         "allocs_per_batch=%.2f frees_per_batch=%.2f max_rss_kb=%ld\n",
+         options.lockfree_reads ? "lockfree" : "rwlock", num_threads, batches,
+         batches / seconds, (double)allocs / batches, (double)frees / batches,
+         usage.ru_maxrss);
+
+  kvs_terminate();
+  close(null_fd);
+  free(all_keys);
+  return 0;
+}
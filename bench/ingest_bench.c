@@ -0,0 +1,180 @@
+// Compares the ingestion cost of the text and binary (.jobb) job formats.
+// A synthetic workload of WRITE, READ and DELETE commands is generated as
+// text, converted to the binary format, and both are then parsed from memory
+// a number of times, the way kvs parses a memory-mapped job file. Only the
+// parsing is timed, the commands aren't run.
+//
+// Usage: ingest_bench [commands] [rounds]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "constants.h"
+#include "operations.h"
+#include "parser.h"
+
+// Largest batch of the generated commands
+#define BENCH_MAX_BATCH 16
+// Longest generated text command
+#define BENCH_MAX_LINE (16 + BENCH_MAX_BATCH * 2 * (MAX_STRING_SIZE + 2))
+
+static JobReader reader;
+static CommandBatch batch;
+
+/// xorshift64.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/// Generates the text workload.
+/// @return Buffer holding the commands, *len bytes long.
+static char *generate_text(size_t num_commands, size_t *len) {
+  char *text = safe_malloc(num_commands * BENCH_MAX_LINE);
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  *len = 0;
+  for (size_t i = 0; i < num_commands; i++) {
+    uint64_t kind = next_random(&state) % 100;
+    size_t count = 1 + next_random(&state) % BENCH_MAX_BATCH;
+    char *line = text + *len;
+    int written;
+    if (kind < 50) {
+      written = sprintf(line, "WRITE [");
+      for (size_t j = 0; j < count; j++) {
+        written += sprintf(line + written, "(key%lu,value%lu)",
+                           (unsigned long)(next_random(&state) % 100000),
+                           (unsigned long)i);
+      }
+    } else {
+      written = sprintf(line, kind < 85 ? "READ [" : "DELETE [");
+      for (size_t j = 0; j < count; j++) {
+        written += sprintf(line + written, j == 0 ? "key%lu" : ",key%lu",
+                           (unsigned long)(next_random(&state) % 100000));
+      }
+    }
+    written += sprintf(line + written, "]\n");
+    *len += (size_t)written;
+  }
+  return text;
+}
+
+/// Parses every command of the reader.
+/// @return Total length of the keys and values parsed.
+static size_t parse_all(JobReader *job) {
+  size_t total = 0;
+  unsigned int delay;
+  enum Command command;
+  while ((command = get_next(job)) != EOC) {
+    switch (command) {
+    case CMD_WRITE:
+      parse_write(job, &batch, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      for (size_t i = 0; i < batch.count; i++) {
+        total += batch.keys[i].len + batch.values[i].len;
+      }
+      break;
+    case CMD_READ:
+    case CMD_DELETE:
+    case CMD_RANGE:
+    case CMD_PREFIX:
+      parse_read_delete(job, &batch, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      for (size_t i = 0; i < batch.count; i++) {
+        total += batch.keys[i].len;
+      }
+      break;
+    case CMD_WAIT:
+      parse_wait(job, &delay, NULL);
+      break;
+    case CMD_SHOW:
+    case CMD_STATS:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      break;
+    }
+  }
+  return total;
+}
+
+/// Converts the text workload to the binary format.
+/// @return Buffer holding the binary job file, *len bytes long.
+static char *convert(const char *text, size_t text_len, size_t *len) {
+  // A binary record is never longer than the text command it comes from
+  char *binary = safe_malloc(JOB_BINARY_MAGIC_SIZE + text_len);
+  memcpy(binary, JOB_BINARY_MAGIC, JOB_BINARY_MAGIC_SIZE);
+  *len = JOB_BINARY_MAGIC_SIZE;
+
+  job_reader_init_buffer(&reader, text, text_len);
+  enum Command command;
+  while ((command = get_next(&reader)) != EOC) {
+    if (command == CMD_WRITE) {
+      parse_write(&reader, &batch, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+    } else {
+      parse_read_delete(&reader, &batch, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+    }
+    *len += encode_binary_command(binary + *len, command, &batch, 0);
+  }
+  return binary;
+}
+
+/// Parses a workload a number of times and prints how fast it went.
+/// @return Total length of the keys and values parsed in one round.
+static size_t bench_format(const char *name, const char *data, size_t len,
+                           int binary, size_t num_commands, size_t rounds) {
+  size_t total = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t round = 0; round < rounds; round++) {
+    job_reader_init_buffer(&reader, data, len);
+    if (binary && job_reader_use_binary(&reader)) {
+      fprintf(stderr, "Invalid binary job file\n");
+      exit(1);
+    }
+    total = parse_all(&reader);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = (double)(end.tv_sec - start.tv_sec) +
+                   (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("format=%s bytes=%zu commands_per_sec=%.0f mb_per_sec=%.1f "
+         "ns_per_command=%.1f\n",
+         name, len, (double)(num_commands * rounds) / seconds,
+         (double)(len * rounds) / seconds / 1e6,
+         seconds * 1e9 / (double)(num_commands * rounds));
+  return total;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_commands = 200000;
+  size_t rounds = 20;
+  if ((argc > 1 && sscanf(argv[1], "%zu", &num_commands) != 1) ||
+      (argc > 2 && sscanf(argv[2], "%zu", &rounds) != 1) || argc > 3 ||
+      num_commands == 0 || rounds == 0) {
+    fprintf(stderr, "Usage: %s [commands] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  size_t text_len;
+  size_t binary_len;
+  char *text = generate_text(num_commands, &text_len);
+  char *binary = convert(text, text_len, &binary_len);
+
+  size_t text_total =
+      bench_format("text", text, text_len, 0, num_commands, rounds);
+  size_t binary_total =
+      bench_format("binary", binary, binary_len, 1, num_commands, rounds);
+
+  free(binary);
+  free(text);
+  if (text_total != binary_total) {
+    fprintf(stderr, "Formats parsed different commands\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,203 @@
+// Runs kvs over a directory of job files, such as the ones tools/job_gen
+// writes, once per thread count, and prints a line per run with the
+// throughput, the peak RSS and the p50/p99 latency of every command, taken
+// from the report of kvs -t. The .out and .bck files of the previous run are
+// removed first, so every run starts from the same files. Arguments after
+// rounds are passed on to kvs, e.g. -n 8 for the sharded mode.
+//
+// Usage: kvs_bench <kvs_path> <dir_path> [threads,threads,...] [max_backups]
+//                  [rounds] [kvs_options...]
+
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "operations.h"
+
+// Largest report of kvs -t read
+#define BENCH_REPORT_SIZE (64 << 10)
+// Most thread counts in a single invocation
+#define BENCH_MAX_RUNS 32
+// Most options passed on to kvs
+#define BENCH_MAX_OPTIONS 16
+
+// Metrics of the report that are commands, counted as operations
+static const char *command_metrics[] = {"write", "read",  "delete", "show",
+                                        "range", "prefix", "backup"};
+#define BENCH_NUM_COMMANDS (sizeof(command_metrics) / sizeof(char *))
+
+static double now_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/// Removes the .out and .bck files of a directory.
+/// @return 0 on success, 1 if the directory could not be read.
+static int remove_outputs(const char *dir_path) {
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) {
+    fprintf(stderr, "Failed to open directory: %s\n", dir_path);
+    return 1;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t len = strlen(entry->d_name);
+    if (len > 4 && (strcmp(entry->d_name + len - 4, ".out") == 0 ||
+                    strcmp(entry->d_name + len - 4, ".bck") == 0)) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+  return 0;
+}
+
+/// Runs kvs -t once, with its stdout discarded.
+/// @param report Output buffer of BENCH_REPORT_SIZE bytes for its stderr.
+/// @param seconds Output wall time of the run.
+/// @param peak_rss_kb Output peak resident set size of the run.
+/// @return 0 on success, 1 if kvs could not be run or failed.
+static int run_kvs(char *argv[], char *report, double *seconds,
+                   long *peak_rss_kb) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    fprintf(stderr, "Failed to create pipe\n");
+    return 1;
+  }
+  double start = now_seconds();
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Failed to fork\n");
+    return 1;
+  }
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[0]);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  close(fds[1]);
+  size_t len = 0;
+  ssize_t num_read;
+  while ((num_read = read(fds[0], report + len, BENCH_REPORT_SIZE - 1 - len)) >
+         0) {
+    len += (size_t)num_read;
+  }
+  report[len] = '\0';
+  close(fds[0]);
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    fprintf(stderr, "Failed to wait for kvs\n");
+    return 1;
+  }
+  *seconds = now_seconds() - start;
+  *peak_rss_kb = usage.ru_maxrss;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "kvs failed:\n%s", report);
+    return 1;
+  }
+  return 0;
+}
+
+/// Prints the result of a run from the report of kvs -t.
+static void print_run(const char *threads, double seconds, long peak_rss_kb,
+                      const char *report) {
+  unsigned long commands = 0;
+  char latencies[BENCH_NUM_COMMANDS * 64] = "";
+  size_t len = 0;
+  for (const char *line = report; *line != '\0';) {
+    char metric[32];
+    unsigned long count;
+    double mean, p50, p99;
+    if (sscanf(line, "%31s count=%lu mean_us=%lf p50_us=%lf p99_us=%lf",
+               metric, &count, &mean, &p50, &p99) == 5) {
+      for (size_t i = 0; i < BENCH_NUM_COMMANDS; i++) {
+        if (strcmp(metric, command_metrics[i]) == 0) {
+          commands += count;
+          len += (size_t)snprintf(latencies + len, sizeof(latencies) - len,
+                                  " %s_p50_us=%.1f %s_p99_us=%.1f", metric,
+                                  p50, metric, p99);
+        }
+      }
+    }
+    const char *end = strchr(line, '\n');
+    line = end != NULL ? end + 1 : line + strlen(line);
+  }
+  printf("threads=%s seconds=%.3f commands=%lu ops_per_sec=%.0f "
+         "peak_rss_kb=%ld%s\n",
+         threads, seconds, commands, (double)commands / seconds, peak_rss_kb,
+         latencies);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 6 + BENCH_MAX_OPTIONS) {
+    fprintf(stderr,
+            "Usage: %s <kvs_path> <dir_path> [threads,threads,...] "
+            "[max_backups] [rounds] [kvs_options...]\n",
+            argv[0]);
+    return 1;
+  }
+  char *thread_list = strdup(argc > 3 ? argv[3] : "1,2,4,8");
+  char *max_backups = argc > 4 ? argv[4] : "1";
+  int rounds = argc > 5 ? atoi(argv[5]) : 1;
+  if (thread_list == NULL || atoi(max_backups) <= 0 || rounds <= 0) {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  char *threads[BENCH_MAX_RUNS];
+  size_t num_runs = 0;
+  char *saveptr;
+  for (char *token = strtok_r(thread_list, ",", &saveptr);
+       token != NULL && num_runs < BENCH_MAX_RUNS;
+       token = strtok_r(NULL, ",", &saveptr)) {
+    if (atoi(token) <= 0) {
+      fprintf(stderr, "Invalid number of threads: %s\n", token);
+      return 1;
+    }
+    threads[num_runs++] = token;
+  }
+
+  char *report = safe_malloc(BENCH_REPORT_SIZE);
+  int failed = 0;
+  for (size_t i = 0; i < num_runs && !failed; i++) {
+    for (int round = 0; round < rounds && !failed; round++) {
+      char *kvs_argv[BENCH_MAX_OPTIONS + 6] = {argv[1], "-t"};
+      int kvs_argc = 2;
+      for (int j = 6; j < argc; j++) {
+        kvs_argv[kvs_argc++] = argv[j];
+      }
+      kvs_argv[kvs_argc++] = argv[2];
+      kvs_argv[kvs_argc++] = max_backups;
+      kvs_argv[kvs_argc++] = threads[i];
+      kvs_argv[kvs_argc] = NULL;
+      double seconds;
+      long peak_rss_kb;
+      failed = remove_outputs(argv[2]) ||
+               run_kvs(kvs_argv, report, &seconds, &peak_rss_kb);
+      if (!failed) {
+        print_run(threads[i], seconds, peak_rss_kb, report);
+      }
+    }
+  }
+  remove_outputs(argv[2]);
+  free(report);
+  free(thread_list);
+  return failed;
+}
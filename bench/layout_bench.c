@@ -0,0 +1,217 @@
+// Compares the linked-list buckets of kvs.c with the open-addressed layout of
+// flat_table.c. The pairs written by a .job file are loaded into both tables
+// and the keys of its READ commands are then looked up a number of times.
+// Both lookups return a pointer into the table, and the value is copied out
+// to the same buffer, so only the layouts differ.
+//
+// Usage: layout_bench <file.job> [rounds]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "flat_table.h"
+#include "kvs.h"
+#include "operations.h"
+#include "parser.h"
+
+typedef struct {
+  char (*keys)[MAX_STRING_SIZE];
+  char (*values)[MAX_STRING_SIZE];
+  size_t count;
+  size_t capacity;
+} PairArray;
+
+/// Copies a view into a MAX_STRING_SIZE array entry.
+static void copy_view(char *dest, StringView view) {
+  memcpy(dest, view.data, view.len);
+  dest[view.len] = '\0';
+}
+
+/// Appends num entries to the array, growing it when needed.
+static void append_pairs(PairArray *array, const StringView *keys,
+                         const StringView *values, size_t num) {
+  if (array->count + num > array->capacity) {
+    array->capacity = (array->capacity + num) * 2;
+    array->keys = realloc(array->keys, array->capacity * MAX_STRING_SIZE);
+    array->values = realloc(array->values, array->capacity * MAX_STRING_SIZE);
+    if (!array->keys || !array->values) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(1);
+    }
+  }
+  for (size_t i = 0; i < num; i++) {
+    copy_view(array->keys[array->count + i], keys[i]);
+    if (values != NULL) {
+      copy_view(array->values[array->count + i], values[i]);
+    }
+  }
+  array->count += num;
+}
+
+/// Splits a job file into the pairs it writes and the keys it reads.
+static void load_job(JobReader *reader, PairArray *writes,
+                     PairArray *reads) {
+  CommandBatch batch;
+  unsigned int delay;
+
+  while (1) {
+    switch (get_next(reader)) {
+    case CMD_WRITE:
+      parse_write(reader, &batch, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      append_pairs(writes, batch.keys, batch.values, batch.count);
+      break;
+    case CMD_READ:
+      parse_read_delete(reader, &batch, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      append_pairs(reads, batch.keys, NULL, batch.count);
+      break;
+    case CMD_DELETE:
+    case CMD_RANGE:
+    case CMD_PREFIX:
+      parse_read_delete(reader, &batch, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      break;
+    case CMD_WAIT:
+      parse_wait(reader, &delay, NULL);
+      break;
+    case CMD_SHOW:
+    case CMD_STATS:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+      break;
+    case EOC:
+      return;
+    }
+  }
+}
+
+static double elapsed_ns(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) * 1e9 +
+         (double)(end.tv_nsec - start->tv_nsec);
+}
+
+static void bench_list(const PairArray *writes, const PairArray *reads,
+                       int rounds) {
+  HashTable *ht = create_hash_table(0);
+  if (!ht) {
+    exit(1);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < writes->count; i++) {
+    if (hash_table_overloaded(ht)) {
+      grow_hash_table(ht);
+    }
+    StringView key = {writes->keys[i], strlen(writes->keys[i])};
+    StringView value = {writes->values[i], strlen(writes->values[i])};
+    write_pair(ht, key, value);
+  }
+  double load_ns = elapsed_ns(&start);
+
+  size_t hits = 0;
+  char buf[MAX_STRING_SIZE];
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < reads->count; i++) {
+      // The only thread using the table, it needs no lock
+      StringView key = {reads->keys[i], strlen(reads->keys[i])};
+      const char *value = lookup_pair(ht, key);
+      if (value != NULL) {
+        hits++;
+        strcpy(buf, value);
+      }
+    }
+  }
+  double read_ns = elapsed_ns(&start);
+
+  printf("layout=list pairs=%zu load_ms=%.2f lookups=%zu hits=%zu "
+         "ns_per_lookup=%.1f\n",
+         atomic_load(&ht->count), load_ns / 1e6, reads->count * (size_t)rounds,
+         hits, read_ns / (double)(reads->count * (size_t)rounds));
+  free_table(ht);
+}
+
+static void bench_flat(const PairArray *writes, const PairArray *reads,
+                       int rounds) {
+  FlatTable *ft = create_flat_table(FLAT_INITIAL_CAPACITY);
+  if (!ft) {
+    exit(1);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < writes->count; i++) {
+    flat_write_pair(ft, writes->keys[i], writes->values[i]);
+  }
+  double load_ns = elapsed_ns(&start);
+
+  size_t hits = 0;
+  char buf[MAX_STRING_SIZE];
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < reads->count; i++) {
+      const char *value = flat_read_pair(ft, reads->keys[i]);
+      if (value != NULL) {
+        hits++;
+        strcpy(buf, value);
+      }
+    }
+  }
+  double read_ns = elapsed_ns(&start);
+
+  printf("layout=flat pairs=%zu load_ms=%.2f lookups=%zu hits=%zu "
+         "ns_per_lookup=%.1f\n",
+         ft->count, load_ns / 1e6, reads->count * (size_t)rounds, hits,
+         read_ns / (double)(reads->count * (size_t)rounds));
+  free_flat_table(ft);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s <file.job> [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  int rounds = 10;
+  if (argc == 3 && (sscanf(argv[2], "%d", &rounds) != 1 || rounds <= 0)) {
+    fprintf(stderr, "Invalid number of rounds\n");
+    return 1;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open .job file\n");
+    return 1;
+  }
+
+  PairArray writes = {0};
+  PairArray reads = {0};
+  JobReader *reader = safe_malloc(sizeof(JobReader));
+  job_reader_init(reader, fd);
+  load_job(reader, &writes, &reads);
+  job_reader_close(reader);
+  free(reader);
+  close(fd);
+
+  if (reads.count == 0) {
+    fprintf(stderr, "Job file has no READ commands\n");
+    return 1;
+  }
+
+  bench_list(&writes, &reads, rounds);
+  bench_flat(&writes, &reads, rounds);
+
+  free(writes.keys);
+  free(writes.values);
+  free(reads.keys);
+  free(reads.values);
+  return 0;
+}
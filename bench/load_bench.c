@@ -0,0 +1,120 @@
+// Startup time of a KVS loaded from a full backup. Writes a backup of the
+// given number of pairs, then times kvs_init and kvs_restore of it with a
+// single thread and with the given number of threads, and checks a sample of
+// the pairs made it into the table.
+//
+// Usage: load_bench <backup_path> [pairs] [threads]
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "operations.h"
+
+// Pairs checked after every load
+#define BENCH_SAMPLES 1000
+
+static double now_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/// Writes a full backup of pairs (key<i>, value<i>).
+/// @return Size of the backup in bytes, 0 if it could not be written.
+static size_t write_backup_file(const char *path, size_t num_pairs) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return 0;
+  }
+  OutputBuffer *out = safe_malloc(sizeof(OutputBuffer));
+  output_init(out, fd);
+  size_t size = 0;
+  int failed = 0;
+  for (size_t i = 0; i < num_pairs && !failed; i++) {
+    char line[2 * MAX_STRING_SIZE + 8];
+    int len = snprintf(line, sizeof(line), "(key%zu, value%zu)\n", i, i);
+    failed = output_write(out, line, (size_t)len);
+    size += (size_t)len;
+  }
+  failed |= output_flush(out);
+  free(out);
+  close(fd);
+  return failed ? 0 : size;
+}
+
+/// Checks a sample of the pairs of the backup.
+/// @return 0 if they were all loaded, 1 otherwise.
+static int check_sample(size_t num_pairs) {
+  OutputBuffer *out = safe_malloc(sizeof(OutputBuffer));
+  int failed = 0;
+  for (size_t i = 0; i < BENCH_SAMPLES && !failed; i++) {
+    size_t pair = (size_t)((uint64_t)i * 0x9e3779b97f4a7c15ULL % num_pairs);
+    char key[MAX_STRING_SIZE];
+    char expected[3 * MAX_STRING_SIZE];
+    int len = snprintf(key, sizeof(key), "key%zu", pair);
+    StringView key_view = {key, (size_t)len};
+    output_init(out, -1);
+    kvs_read(1, &key_view, out);
+    len = snprintf(expected, sizeof(expected), "[(key%zu,value%zu)]\n", pair,
+                   pair);
+    failed = out->len != (size_t)len || memcmp(out->data, expected, out->len);
+  }
+  free(out);
+  return failed;
+}
+
+/// Loads the backup into a fresh KVS and prints how long it took.
+/// @return 0 on success, 1 if the backup was not loaded correctly.
+static int bench_load(const char *path, size_t size, size_t num_pairs,
+                      size_t threads) {
+  KvsOptions options = {0};
+  options.load_threads = threads;
+  double start = now_seconds();
+  if (kvs_init(&options) || kvs_restore(path)) {
+    return 1;
+  }
+  double seconds = now_seconds() - start;
+  int failed = check_sample(num_pairs);
+  kvs_terminate();
+  if (failed) {
+    fprintf(stderr, "Backup was not loaded correctly\n");
+    return 1;
+  }
+
+  printf("threads=%zu pairs=%zu bytes=%zu seconds=%.3f pairs_per_sec=%.0f "
+         "mb_per_sec=%.1f\n",
+         threads, num_pairs, size, seconds, (double)num_pairs / seconds,
+         (double)size / seconds / 1e6);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_pairs = 2000000;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cpus > 0 ? (size_t)cpus : 1;
+  if (argc < 2 || argc > 4 ||
+      (argc > 2 && sscanf(argv[2], "%zu", &num_pairs) != 1) ||
+      (argc > 3 && sscanf(argv[3], "%zu", &threads) != 1) ||
+      num_pairs == 0 || threads == 0) {
+    fprintf(stderr, "Usage: %s <backup_path> [pairs] [threads]\n", argv[0]);
+    return 1;
+  }
+
+  size_t size = write_backup_file(argv[1], num_pairs);
+  if (size == 0) {
+    fprintf(stderr, "Failed to write backup file: %s\n", argv[1]);
+    return 1;
+  }
+  int failed = bench_load(argv[1], size, num_pairs, 1);
+  if (!failed && threads > 1) {
+    failed = bench_load(argv[1], size, num_pairs, threads);
+  }
+  unlink(argv[1]);
+  return failed;
+}
@@ -0,0 +1,100 @@
+// Checks that READ commands don't touch the heap: after a warm-up batch, runs
+// READ batches of several sizes, half of the keys missing, in both read modes
+// and counts the allocations made meanwhile. Exits with 1 if there was any.
+//
+// Usage: read_alloc_bench [num_keys] [batches]
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alloc_count.h"
+#include "constants.h"
+#include "operations.h"
+
+static const size_t batch_sizes[] = {1, 16, 128};
+
+/// xorshift64.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_keys = 10000;
+  size_t batches = 20000;
+  if ((argc > 1 && sscanf(argv[1], "%zu", &num_keys) != 1) ||
+      (argc > 2 && sscanf(argv[2], "%zu", &batches) != 1) || argc > 3 ||
+      num_keys == 0) {
+    fprintf(stderr, "Usage: %s [num_keys] [batches]\n", argv[0]);
+    return 1;
+  }
+
+  // Keys are numbered up to twice num_keys, only the even ones are written
+  char (*all_keys)[MAX_STRING_SIZE] =
+      safe_malloc(2 * num_keys * MAX_STRING_SIZE);
+  for (size_t i = 0; i < 2 * num_keys; i++) {
+    snprintf(all_keys[i], MAX_STRING_SIZE, "key%zu", i);
+  }
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd == -1) {
+    fprintf(stderr, "Failed to open /dev/null\n");
+    return 1;
+  }
+
+  int failed = 0;
+  OutputBuffer out;
+  output_init(&out, null_fd);
+  for (int lockfree = 0; lockfree <= 1; lockfree++) {
+    KvsOptions options = {.lockfree_reads = lockfree};
+    if (kvs_init(&options)) {
+      return 1;
+    }
+    for (size_t i = 0; i < 2 * num_keys; i += 2) {
+      StringView key = {all_keys[i], strlen(all_keys[i])};
+      kvs_write(1, &key, &key);
+    }
+
+    for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+      size_t batch_size = batch_sizes[b];
+      uint64_t state = 0x9e3779b97f4a7c15ULL;
+      StringView keys[MAX_WRITE_SIZE];
+      size_t allocs = 0;
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      // The first batch is a warm-up: it may set up per-thread state
+      for (size_t done = 0; done <= batches; done++) {
+        for (size_t i = 0; i < batch_size; i++) {
+          const char *key = all_keys[next_random(&state) % (2 * num_keys)];
+          keys[i] = (StringView){key, strlen(key)};
+        }
+        size_t before = allocations();
+        kvs_read(batch_size, keys, &out);
+        output_end_command(&out);
+        if (done > 0) {
+          allocs += allocations() - before;
+        }
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      double seconds = (double)(end.tv_sec - start.tv_sec) +
+                       (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+      printf("mode=%s batch=%zu batches=%zu keys_per_sec=%.0f allocs=%zu\n",
+             lockfree ? "lockfree" : "rwlock", batch_size, batches,
+             (double)(batches * batch_size) / seconds, allocs);
+      failed |= allocs > 0;
+    }
+    kvs_terminate();
+  }
+
+  output_flush(&out);
+  close(null_fd);
+  free(all_keys);
+  return failed;
+}
@@ -0,0 +1,163 @@
+// Measures how READ throughput scales with the number of reader threads, with
+// the bucket rwlocks and with lock-free (epoch-based) reads. Optionally runs
+// writer threads that keep overwriting values during the measurement.
+//
+// Usage: read_scaling_bench [num_keys] [max_threads] [reads_per_thread]
+//                           [writers]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "operations.h"
+
+#define READ_BATCH 16
+
+static char (*all_keys)[MAX_STRING_SIZE];
+static size_t num_keys;
+static size_t reads_per_thread;
+static int null_fd;
+static atomic_int stop_writers;
+
+/// xorshift64, each thread keeps its own state.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/// Returns a view of the given string.
+static StringView view_of(const char *str) {
+  return (StringView){str, strlen(str)};
+}
+
+static void *reader(void *arg) {
+  uint64_t state = (uint64_t)(size_t)arg * 0x9e3779b97f4a7c15ULL + 1;
+  StringView keys[READ_BATCH];
+  OutputBuffer out;
+  output_init(&out, null_fd);
+  for (size_t done = 0; done < reads_per_thread; done += READ_BATCH) {
+    for (size_t i = 0; i < READ_BATCH; i++) {
+      keys[i] = view_of(all_keys[next_random(&state) % num_keys]);
+    }
+    kvs_read(READ_BATCH, keys, &out);
+    output_end_command(&out);
+  }
+  output_flush(&out);
+  return NULL;
+}
+
+static void *writer(void *arg) {
+  uint64_t state = (uint64_t)(size_t)arg * 0x2545f4914f6cdd1dULL + 1;
+  char value[MAX_STRING_SIZE];
+  while (!atomic_load(&stop_writers)) {
+    size_t index = next_random(&state) % num_keys;
+    StringView key = view_of(all_keys[index]);
+    snprintf(value, sizeof(value), "w%zu", index);
+    StringView value_view = view_of(value);
+    kvs_write(1, &key, &value_view);
+  }
+  return NULL;
+}
+
+static double run(int num_readers, int num_writers) {
+  pthread_t readers[num_readers];
+  pthread_t writers[num_writers > 0 ? num_writers : 1];
+  struct timespec start, end;
+
+  atomic_store(&stop_writers, 0);
+  for (int i = 0; i < num_writers; i++) {
+    pthread_create(&writers[i], NULL, writer, (void *)(size_t)(i + 1));
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < num_readers; i++) {
+    pthread_create(&readers[i], NULL, reader, (void *)(size_t)(i + 1));
+  }
+  for (int i = 0; i < num_readers; i++) {
+    pthread_join(readers[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  atomic_store(&stop_writers, 1);
+  for (int i = 0; i < num_writers; i++) {
+    pthread_join(writers[i], NULL);
+  }
+
+  double seconds = (double)(end.tv_sec - start.tv_sec) +
+                   (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  return (double)(reads_per_thread * (size_t)num_readers) / seconds;
+}
+
+static void load_keys() {
+  StringView keys[MAX_WRITE_SIZE];
+  StringView values[MAX_WRITE_SIZE];
+  char value_bufs[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  size_t batch = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    keys[batch] = view_of(all_keys[i]);
+    snprintf(value_bufs[batch], MAX_STRING_SIZE, "v%zu", i);
+    values[batch] = view_of(value_bufs[batch]);
+    if (++batch == MAX_WRITE_SIZE - 1 || i == num_keys - 1) {
+      kvs_write(batch, keys, values);
+      batch = 0;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int max_threads = 8;
+  int num_writers = 0;
+  num_keys = 100000;
+  reads_per_thread = 200000;
+
+  if ((argc > 1 && sscanf(argv[1], "%zu", &num_keys) != 1) ||
+      (argc > 2 && sscanf(argv[2], "%d", &max_threads) != 1) ||
+      (argc > 3 && sscanf(argv[3], "%zu", &reads_per_thread) != 1) ||
+      (argc > 4 && sscanf(argv[4], "%d", &num_writers) != 1) || argc > 5 ||
+      num_keys == 0 || max_threads <= 0 || num_writers < 0) {
+    fprintf(stderr,
+            "Usage: %s [num_keys] [max_threads] [reads_per_thread] "
+            "[writers]\n",
+            argv[0]);
+    return 1;
+  }
+
+  all_keys = safe_malloc(num_keys * MAX_STRING_SIZE);
+  for (size_t i = 0; i < num_keys; i++) {
+    snprintf(all_keys[i], MAX_STRING_SIZE, "key%zu", i);
+  }
+
+  null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd == -1) {
+    fprintf(stderr, "Failed to open /dev/null\n");
+    return 1;
+  }
+
+  for (int lockfree = 0; lockfree <= 1; lockfree++) {
+    KvsOptions options = {.lockfree_reads = lockfree};
+    if (kvs_init(&options)) {
+      return 1;
+    }
+    load_keys();
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      printf("mode=%s threads=%d writers=%d reads_per_sec=%.0f\n",
+             lockfree ? "lockfree" : "rwlock", threads, num_writers,
+             run(threads, num_writers));
+    }
+    kvs_terminate();
+  }
+
+  close(null_fd);
+  free(all_keys);
+  return 0;
+}
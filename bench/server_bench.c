@@ -0,0 +1,202 @@
+// Load generator for the server mode (kvs -s). Every connection runs on its
+// own thread and keeps up to depth single-key READ or WRITE commands in
+// flight, timing each one from the moment it is sent until its reply line
+// arrives. Reports the throughput and the latency percentiles of all of them.
+//
+// Usage: server_bench <address> [connections] [requests_per_connection]
+//                     [depth] [read_percent]
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "operations.h"
+#include "server.h"
+
+// Number of distinct keys the commands pick from
+#define BENCH_KEYS 10000
+// Longest command sent, with room for the key and value
+#define BENCH_COMMAND_SIZE 64
+
+typedef struct Client {
+  pthread_t thread;
+  uint64_t seed;
+  uint64_t *latencies_ns; // One per request
+  int failed;
+} Client;
+
+static struct sockaddr_storage addr;
+static socklen_t addr_len;
+static size_t requests;
+static size_t depth;
+static unsigned read_percent;
+
+/// xorshift64, each client keeps its own state.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(fd, data, len, 0);
+    if (sent <= 0) {
+      return 1;
+    }
+    data += sent;
+    len -= (size_t)sent;
+  }
+  return 0;
+}
+
+static void *run_client(void *arg) {
+  Client *client = arg;
+  int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, addr_len) == -1) {
+    perror("Failed to connect");
+    client->failed = 1;
+    return NULL;
+  }
+
+  uint64_t *sent_at = safe_malloc(depth * sizeof(uint64_t));
+  char *commands = safe_malloc(depth * BENCH_COMMAND_SIZE);
+  char replies[SERVER_BUF_SIZE];
+  size_t sent = 0;
+  size_t done = 0;
+  // Start of the reply line being received, which may span several recvs
+  char line[4];
+  size_t line_len = 0;
+
+  while (done < requests) {
+    // Fill the window with new commands, sent with a single write
+    size_t len = 0;
+    while (sent < requests && sent - done < depth) {
+      uint64_t key = next_random(&client->seed) % BENCH_KEYS;
+      if (next_random(&client->seed) % 100 < read_percent) {
+        len += (size_t)snprintf(commands + len, BENCH_COMMAND_SIZE,
+                                "READ [key%lu]\n", (unsigned long)key);
+      } else {
+        len += (size_t)snprintf(commands + len, BENCH_COMMAND_SIZE,
+                                "WRITE [(key%lu,value%lu)]\n",
+                                (unsigned long)key, (unsigned long)sent);
+      }
+      sent_at[sent % depth] = now_ns();
+      sent++;
+    }
+    if (len > 0 && send_all(fd, commands, len)) {
+      client->failed = 1;
+      break;
+    }
+
+    ssize_t received = recv(fd, replies, sizeof(replies), 0);
+    if (received <= 0) {
+      client->failed = 1;
+      break;
+    }
+    uint64_t now = now_ns();
+    for (ssize_t i = 0; i < received; i++) {
+      if (replies[i] != '\n') {
+        if (line_len < sizeof(line)) {
+          line[line_len] = replies[i];
+        }
+        line_len++;
+        continue;
+      }
+      // Results come before the line ending the reply
+      if ((line_len == 2 && strncmp(line, "OK", 2) == 0) ||
+          (line_len >= 4 && strncmp(line, SERVER_REPLY_ERROR, 4) == 0)) {
+        client->latencies_ns[done] = now - sent_at[done % depth];
+        done++;
+      }
+      line_len = 0;
+    }
+  }
+
+  close(fd);
+  free(commands);
+  free(sent_at);
+  return NULL;
+}
+
+static int compare_latencies(const void *first, const void *second) {
+  uint64_t a = *(const uint64_t *)first;
+  uint64_t b = *(const uint64_t *)second;
+  return (a > b) - (a < b);
+}
+
+/// Latency below which the given fraction of the sorted samples lie.
+/// @return Latency in microseconds.
+static double percentile(const uint64_t *sorted, size_t count,
+                         double fraction) {
+  size_t index = (size_t)(fraction * (double)(count - 1));
+  return (double)sorted[index] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+  int num_clients = 4;
+  requests = 100000;
+  depth = 16;
+  read_percent = 90;
+
+  if (argc < 2 || argc > 6 ||
+      server_resolve(argv[1], &addr, &addr_len) != 0 ||
+      (argc > 2 && sscanf(argv[2], "%d", &num_clients) != 1) ||
+      (argc > 3 && sscanf(argv[3], "%zu", &requests) != 1) ||
+      (argc > 4 && sscanf(argv[4], "%zu", &depth) != 1) ||
+      (argc > 5 && sscanf(argv[5], "%u", &read_percent) != 1) ||
+      num_clients <= 0 || requests == 0 || depth == 0 || read_percent > 100) {
+    fprintf(stderr,
+            "Usage: %s <address> [connections] [requests_per_connection] "
+            "[depth] [read_percent]\n",
+            argv[0]);
+    return 1;
+  }
+
+  size_t total = (size_t)num_clients * requests;
+  uint64_t *latencies = safe_malloc(total * sizeof(uint64_t));
+  Client *clients = safe_malloc((size_t)num_clients * sizeof(Client));
+  uint64_t start = now_ns();
+  for (int i = 0; i < num_clients; i++) {
+    clients[i].seed = 0x9e3779b97f4a7c15ULL * (unsigned)(i + 1);
+    clients[i].latencies_ns = latencies + (size_t)i * requests;
+    clients[i].failed = 0;
+    pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+  }
+  int failed = 0;
+  for (int i = 0; i < num_clients; i++) {
+    pthread_join(clients[i].thread, NULL);
+    failed |= clients[i].failed;
+  }
+  double seconds = (double)(now_ns() - start) / 1e9;
+  if (failed) {
+    fprintf(stderr, "Lost the connection to the server\n");
+    return 1;
+  }
+
+  qsort(latencies, total, sizeof(uint64_t), compare_latencies);
+  printf("connections=%d requests=%zu depth=%zu read_percent=%u "
+         "ops_per_sec=%.0f p50_us=%.1f p90_us=%.1f p99_us=%.1f "
+         "p999_us=%.1f max_us=%.1f\n",
+         num_clients, total, depth, read_percent, (double)total / seconds,
+         percentile(latencies, total, 0.5), percentile(latencies, total, 0.9),
+         percentile(latencies, total, 0.99),
+         percentile(latencies, total, 0.999),
+         percentile(latencies, total, 1.0));
+
+  free(clients);
+  free(latencies);
+  return 0;
+}
@@ -0,0 +1,161 @@
+// Output of many concurrent jobs, written with blocking writes and then
+// through io_uring. Every thread takes jobs in turn, and each job creates its
+// own .out file and appends lines of pairs to it through an OutputBuffer,
+// like the READs of a job file, until it holds the given size. Prints a line
+// per mode with the throughput and the p50/p99 time of a job.
+//
+// Usage: uring_bench <dir_path> [jobs] [threads] [kb_per_job]
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "operations.h"
+#include "output.h"
+#include "uring.h"
+
+typedef struct Worker {
+  pthread_t thread;
+  int failed;
+} Worker;
+
+static const char *dir_path;
+static size_t num_jobs;
+static size_t bytes_per_job;
+static int use_uring;
+static atomic_size_t next_job;
+static uint64_t *job_ns; // One per job
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/// Writes the output of a job.
+/// @return 0 on success, 1 if the file could not be written.
+static int run_job(size_t job, OutputBuffer *out) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/uring-bench-%zu.out", dir_path, job);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create %s\n", path);
+    return 1;
+  }
+  output_init(out, fd);
+  Uring *ring = use_uring ? uring_open() : NULL;
+  if (ring != NULL) {
+    uring_attach(ring, out);
+  }
+
+  int result = 0;
+  char line[MAX_STRING_SIZE * 2 + 8];
+  for (size_t written = 0, i = 0; written < bytes_per_job && !result; i++) {
+    int len = snprintf(line, sizeof(line), "(key%zu,value%zu)\n", i,
+                       i * 2654435761u % 1000003);
+    result = output_write(out, line, (size_t)len) ||
+             output_end_command(out);
+    written += (size_t)len;
+  }
+  result = output_flush(out) || result;
+  if (ring != NULL) {
+    result = uring_close(ring) || result;
+  }
+  close(fd);
+  unlink(path);
+  return result;
+}
+
+static void *run_worker(void *arg) {
+  Worker *worker = arg;
+  OutputBuffer *out = safe_malloc(sizeof(OutputBuffer));
+  size_t job;
+  while (!worker->failed && (job = atomic_fetch_add(&next_job, 1)) < num_jobs) {
+    uint64_t start = now_ns();
+    worker->failed = run_job(job, out);
+    job_ns[job] = now_ns() - start;
+  }
+  free(out);
+  return NULL;
+}
+
+static int compare_times(const void *first, const void *second) {
+  uint64_t a = *(const uint64_t *)first;
+  uint64_t b = *(const uint64_t *)second;
+  return (a > b) - (a < b);
+}
+
+/// Time below which the given fraction of the sorted samples lie.
+/// @return Time in milliseconds.
+static double percentile(const uint64_t *sorted, size_t count,
+                         double fraction) {
+  size_t index = (size_t)(fraction * (double)(count - 1));
+  return (double)sorted[index] / 1e6;
+}
+
+/// Runs every job with the given mode.
+/// @return 0 on success, 1 if a job failed.
+static int bench_mode(const char *name, int num_threads) {
+  atomic_store(&next_job, 0);
+  Worker *workers = safe_malloc((size_t)num_threads * sizeof(Worker));
+  uint64_t start = now_ns();
+  for (int i = 0; i < num_threads; i++) {
+    workers[i].failed = 0;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  int failed = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    failed = failed || workers[i].failed;
+  }
+  double seconds = (double)(now_ns() - start) / 1e9;
+  free(workers);
+  if (failed) {
+    return 1;
+  }
+
+  qsort(job_ns, num_jobs, sizeof(uint64_t), compare_times);
+  printf("io=%s jobs=%zu threads=%d seconds=%.3f mb_per_sec=%.1f "
+         "job_p50_ms=%.2f job_p99_ms=%.2f\n",
+         name, num_jobs, num_threads, seconds,
+         (double)(num_jobs * bytes_per_job) / seconds / (1 << 20),
+         percentile(job_ns, num_jobs, 0.5), percentile(job_ns, num_jobs, 0.99));
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int num_threads = 8;
+  size_t kb_per_job = 4096;
+  num_jobs = 256;
+
+  if (argc < 2 || argc > 5 ||
+      (argc > 2 && sscanf(argv[2], "%zu", &num_jobs) != 1) ||
+      (argc > 3 && sscanf(argv[3], "%d", &num_threads) != 1) ||
+      (argc > 4 && sscanf(argv[4], "%zu", &kb_per_job) != 1) ||
+      num_jobs == 0 || num_threads <= 0 || kb_per_job == 0) {
+    fprintf(stderr, "Usage: %s <dir_path> [jobs] [threads] [kb_per_job]\n",
+            argv[0]);
+    return 1;
+  }
+  dir_path = argv[1];
+  bytes_per_job = kb_per_job << 10;
+  job_ns = safe_malloc(num_jobs * sizeof(uint64_t));
+
+  int failed = bench_mode("sync", num_threads);
+  if (!failed && uring_supported()) {
+    use_uring = 1;
+    failed = bench_mode("uring", num_threads);
+  } else if (!failed) {
+    printf("io=uring unsupported by the kernel\n");
+  }
+  free(job_ns);
+  return failed;
+}
@@ -0,0 +1,155 @@
+// Throughput of WRITE batches with each sync policy of the write-ahead log,
+// and without one. Every thread writes batches of pairs as fast as it can,
+// timing each kvs_write call. With the commit policy, the batches that arrive
+// while a sync runs share the next one.
+//
+// Usage: wal_bench <log_path> [threads] [batches_per_thread] [pairs_per_batch]
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "operations.h"
+
+// Number of distinct keys the batches pick from
+#define BENCH_KEYS 100000
+
+typedef struct Writer {
+  pthread_t thread;
+  uint64_t seed;
+  uint64_t *latencies_ns; // One per batch
+} Writer;
+
+static size_t batches_per_thread;
+static size_t pairs_per_batch;
+
+/// xorshift64, each writer keeps its own state.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void *run_writer(void *arg) {
+  Writer *writer = arg;
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  StringView key_views[MAX_WRITE_SIZE];
+  StringView value_views[MAX_WRITE_SIZE];
+
+  for (size_t done = 0; done < batches_per_thread; done++) {
+    for (size_t i = 0; i < pairs_per_batch; i++) {
+      int key_len = snprintf(
+          keys[i], MAX_STRING_SIZE, "key%lu",
+          (unsigned long)(next_random(&writer->seed) % BENCH_KEYS));
+      int value_len = snprintf(values[i], MAX_STRING_SIZE, "value%lu",
+                               (unsigned long)done);
+      key_views[i] = (StringView){keys[i], (size_t)key_len};
+      value_views[i] = (StringView){values[i], (size_t)value_len};
+    }
+    uint64_t start = now_ns();
+    kvs_write(pairs_per_batch, key_views, value_views);
+    writer->latencies_ns[done] = now_ns() - start;
+  }
+  return NULL;
+}
+
+static int compare_latencies(const void *first, const void *second) {
+  uint64_t a = *(const uint64_t *)first;
+  uint64_t b = *(const uint64_t *)second;
+  return (a > b) - (a < b);
+}
+
+/// Latency below which the given fraction of the sorted samples lie.
+/// @return Latency in microseconds.
+static double percentile(const uint64_t *sorted, size_t count,
+                         double fraction) {
+  size_t index = (size_t)(fraction * (double)(count - 1));
+  return (double)sorted[index] / 1000.0;
+}
+
+/// Runs the writers against a fresh KVS.
+/// @param name Name of the sync policy, "off" for no log.
+/// @return 0 on success, 1 if the KVS could not be initialized.
+static int bench_policy(const char *name, const char *log_path,
+                        int num_threads) {
+  KvsOptions options = {0};
+  if (strcmp(name, "off") != 0) {
+    options.wal_path = log_path;
+    wal_parse_sync(name, &options.wal_sync);
+  }
+  unlink(log_path);
+  if (kvs_init(&options)) {
+    return 1;
+  }
+
+  size_t total = (size_t)num_threads * batches_per_thread;
+  uint64_t *latencies = safe_malloc(total * sizeof(uint64_t));
+  Writer *writers = safe_malloc((size_t)num_threads * sizeof(Writer));
+  uint64_t start = now_ns();
+  for (int i = 0; i < num_threads; i++) {
+    writers[i].seed = 0x9e3779b97f4a7c15ULL * (unsigned)(i + 1);
+    writers[i].latencies_ns = latencies + (size_t)i * batches_per_thread;
+    pthread_create(&writers[i].thread, NULL, run_writer, &writers[i]);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(writers[i].thread, NULL);
+  }
+  double seconds = (double)(now_ns() - start) / 1e9;
+  kvs_terminate();
+
+  struct stat st;
+  long log_bytes = stat(log_path, &st) == 0 ? (long)st.st_size : 0;
+  qsort(latencies, total, sizeof(uint64_t), compare_latencies);
+  printf("sync=%s threads=%d batches=%zu batches_per_sec=%.0f "
+         "pairs_per_sec=%.0f p50_us=%.1f p99_us=%.1f log_bytes=%ld\n",
+         name, num_threads, total, (double)total / seconds,
+         (double)(total * pairs_per_batch) / seconds,
+         percentile(latencies, total, 0.5),
+         percentile(latencies, total, 0.99), log_bytes);
+
+  free(writers);
+  free(latencies);
+  unlink(log_path);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int num_threads = 8;
+  batches_per_thread = 2000;
+  pairs_per_batch = 4;
+
+  if (argc < 2 || argc > 5 ||
+      (argc > 2 && sscanf(argv[2], "%d", &num_threads) != 1) ||
+      (argc > 3 && sscanf(argv[3], "%zu", &batches_per_thread) != 1) ||
+      (argc > 4 && sscanf(argv[4], "%zu", &pairs_per_batch) != 1) ||
+      num_threads <= 0 || batches_per_thread == 0 || pairs_per_batch == 0 ||
+      pairs_per_batch > MAX_WRITE_SIZE) {
+    fprintf(stderr,
+            "Usage: %s <log_path> [threads] [batches_per_thread] "
+            "[pairs_per_batch]\n",
+            argv[0]);
+    return 1;
+  }
+
+  const char *policies[] = {"off", "none", "periodic", "commit"};
+  for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+    if (bench_policy(policies[i], argv[1], num_threads)) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,225 @@
+// Crash recovery of the write-ahead log. Each round forks a writer that
+// recovers the log, then keeps writing numbered batches with the commit
+// policy, taking incremental backups now and then, until it is killed with
+// SIGKILL at a random point. The backups of a round reuse the paths of the
+// previous round's, so a crash can interrupt the rewrite of a backup that a
+// checkpoint names. A torn batch is then appended to the log, as a
+// crash in the middle of a write would leave it, and the log is recovered
+// again and checked:
+//   - every batch the writer saw complete is there, whole
+//   - the batches after the last one recovered left nothing behind
+//   - the deletions of the recovered batches were applied
+//
+// Usage: wal_crash <log_path> [rounds]
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "operations.h"
+
+// Pairs every batch writes, x<batch>_0 ... x<batch>_3, and "last"
+#define PAIRS_PER_BATCH 4
+// Batch i first deletes x<i - DELETE_DISTANCE>_0
+#define DELETE_DISTANCE 10
+// Batches between backups
+#define BACKUP_INTERVAL 100
+// Largest number of batches a writer completes before it is killed
+#define MAX_BATCHES_PER_ROUND 1000
+
+static const char *log_path;
+
+/// xorshift64.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static StringView view_of(const char *str) {
+  return (StringView){str, strlen(str)};
+}
+
+/// Reads a key of the KVS.
+/// @param value Output value, MAX_STRING_SIZE bytes long.
+/// @return 1 if the key was found, 0 otherwise.
+static int read_value(const char *key, char *value) {
+  OutputBuffer *out = safe_malloc(sizeof(OutputBuffer));
+  output_init(out, -1);
+  StringView key_view = view_of(key);
+  kvs_read(1, &key_view, out);
+
+  // The output is [(key,value)]
+  size_t prefix = 3 + key_view.len;
+  size_t len = out->len - prefix - 3;
+  int found = len < MAX_STRING_SIZE &&
+              strncmp(out->data + prefix, "KVSERROR", len) != 0;
+  if (found) {
+    memcpy(value, out->data + prefix, len);
+    value[len] = '\0';
+  }
+  free(out);
+  return found;
+}
+
+/// Recovers the log.
+/// @return Number of the last batch recovered, -1 if there is none.
+static long recover(KvsOptions *options) {
+  if (kvs_init(options)) {
+    fprintf(stderr, "Failed to recover the write-ahead log\n");
+    exit(1);
+  }
+  char value[MAX_STRING_SIZE];
+  return read_value("last", value) ? atol(value) : -1;
+}
+
+/// Writes batches until killed, reporting each one completed on ack_fd.
+static void run_writer(int ack_fd) {
+  KvsOptions options = {0};
+  options.wal_path = log_path;
+  options.wal_sync = WAL_SYNC_COMMIT;
+  options.incremental_backups = 1;
+  options.max_backups = 2;
+  long batch = recover(&options) + 1;
+
+  char keys[PAIRS_PER_BATCH + 1][MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  StringView key_views[PAIRS_PER_BATCH + 1];
+  StringView value_views[PAIRS_PER_BATCH + 1];
+  for (int backups = 1;; batch++) {
+    // Deleting first, a batch recovered has all its deletions logged too
+    if (batch >= DELETE_DISTANCE) {
+      snprintf(keys[0], sizeof(keys[0]), "x%ld_0", batch - DELETE_DISTANCE);
+      key_views[0] = view_of(keys[0]);
+      OutputBuffer out;
+      output_init(&out, -1);
+      kvs_delete(1, key_views, &out);
+    }
+
+    snprintf(value, sizeof(value), "%ld", batch);
+    for (int i = 0; i < PAIRS_PER_BATCH; i++) {
+      snprintf(keys[i], sizeof(keys[i]), "x%ld_%d", batch, i);
+      key_views[i] = view_of(keys[i]);
+      value_views[i] = view_of(value);
+    }
+    key_views[PAIRS_PER_BATCH] = view_of("last");
+    value_views[PAIRS_PER_BATCH] = view_of(value);
+    kvs_write(PAIRS_PER_BATCH + 1, key_views, value_views);
+    if (write(ack_fd, &batch, sizeof(batch)) != sizeof(batch)) {
+      exit(1);
+    }
+
+    if (batch % BACKUP_INTERVAL == 0) {
+      // Every round rewrites the backups of the previous one, which its
+      // checkpoints may still name
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s.%d.bck", log_path, backups++);
+      kvs_backup(path);
+    }
+  }
+}
+
+/// Checks the recovered state against the batches the writer completed.
+/// @return 0 if it is consistent, 1 otherwise.
+static int check(long last, long acked) {
+  if (last < acked) {
+    fprintf(stderr, "Lost batch %ld, only %ld recovered\n", acked, last);
+    return 1;
+  }
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  for (long batch = 0; batch <= last + 1; batch++) {
+    for (int i = 0; i < PAIRS_PER_BATCH; i++) {
+      snprintf(key, sizeof(key), "x%ld_%d", batch, i);
+      int expected = batch <= last;
+      if (i == 0 && batch + DELETE_DISTANCE <= last) {
+        expected = 0;
+      }
+      int found = read_value(key, value);
+      // The deletion of the batch after the last one may have been logged
+      if (i == 0 && batch + DELETE_DISTANCE == last + 1) {
+        expected = found;
+      }
+      if (found != expected || (found && atol(value) != batch)) {
+        fprintf(stderr, "Batch %ld of %ld recovered wrong: %s %s\n", batch,
+                last, key, found ? value : "missing");
+        return 1;
+      }
+    }
+  }
+  if (read_value("torn", value)) {
+    fprintf(stderr, "Torn batch was recovered\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int rounds = 20;
+  if (argc < 2 || argc > 3 ||
+      (argc > 2 && sscanf(argv[2], "%d", &rounds) != 1) || rounds <= 0) {
+    fprintf(stderr, "Usage: %s <log_path> [rounds]\n", argv[0]);
+    return 1;
+  }
+  log_path = argv[1];
+  unlink(log_path);
+
+  KvsOptions options = {0};
+  options.wal_path = log_path;
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  long acked = -1;
+  for (int round = 1; round <= rounds; round++) {
+    int acks[2];
+    if (pipe(acks) != 0) {
+      perror("Failed to create pipe");
+      return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(acks[0]);
+      run_writer(acks[1]);
+    }
+    close(acks[1]);
+
+    // Kill the writer after a random number of batches, then collect the
+    // ones it completed in the meantime
+    uint64_t kill_after = 1 + next_random(&state) % MAX_BATCHES_PER_ROUND;
+    long batch;
+    for (uint64_t seen = 0;
+         read(acks[0], &batch, sizeof(batch)) == sizeof(batch);) {
+      acked = batch;
+      if (++seen == kill_after) {
+        kill(pid, SIGKILL);
+      }
+    }
+    close(acks[0]);
+    waitpid(pid, NULL, 0);
+
+    int log_fd = open(log_path, O_WRONLY | O_APPEND);
+    const char torn[] = "(torn, 1)\n(x";
+    if (log_fd < 0 || write(log_fd, torn, sizeof(torn) - 1) < 0) {
+      perror("Failed to tear the write-ahead log");
+      return 1;
+    }
+    close(log_fd);
+
+    long last = recover(&options);
+    int failed = check(last, acked);
+    kvs_terminate();
+    printf("round=%d acked=%ld recovered=%ld %s\n", round, acked, last,
+           failed ? "FAILED" : "ok");
+    if (failed) {
+      return 1;
+    }
+  }
+  return 0;
+}
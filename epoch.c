@@ -0,0 +1,119 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "operations.h"
+#include "slab.h"
+
+// Epoch-based reclamation: every reader publishes the global epoch it saw on
+// entry. The global epoch only moves forward once every active reader has
+// seen the current one, so memory retired during epoch e can't be reached by
+// any reader once the global epoch is e + 2.
+
+typedef struct Retired {
+  void *ptr;
+  void (*free_fn)(void *);
+  uint64_t epoch; // Global epoch when the pointer was retired
+  struct Retired *next;
+} Retired;
+
+typedef struct EpochRecord {
+  // (epoch << 1) | 1 while inside a critical section, 0 outside of it
+  atomic_uint_fast64_t state;
+  Retired *retired; // Only touched by the owner thread
+  size_t num_retired;
+  struct EpochRecord *next;
+} EpochRecord;
+
+static atomic_uint_fast64_t global_epoch = 1;
+static EpochRecord *_Atomic records = NULL;
+static _Thread_local EpochRecord *local_record = NULL;
+
+/// Returns the record of the calling thread, registering it on first use.
+static EpochRecord *get_record() {
+  if (local_record != NULL) {
+    return local_record;
+  }
+
+  EpochRecord *record = safe_malloc(sizeof(EpochRecord));
+  atomic_init(&record->state, 0);
+  record->retired = NULL;
+  record->num_retired = 0;
+  record->next = atomic_load(&records);
+  while (!atomic_compare_exchange_weak(&records, &record->next, record))
+    ;
+  local_record = record;
+  return record;
+}
+
+/// Advances the global epoch if every active reader has seen the current one.
+static void try_advance() {
+  uint_fast64_t epoch = atomic_load(&global_epoch);
+  for (EpochRecord *record = atomic_load(&records); record != NULL;
+       record = record->next) {
+    uint_fast64_t state = atomic_load(&record->state);
+    if ((state & 1) && (state >> 1) != epoch) {
+      return; // A reader is still in an older epoch
+    }
+  }
+  atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+/// Frees the retired pointers of a record that no reader can reach anymore.
+static void reclaim(EpochRecord *record) {
+  uint_fast64_t epoch = atomic_load(&global_epoch);
+  Retired **link = &record->retired;
+  while (*link != NULL) {
+    Retired *retired = *link;
+    if (retired->epoch + 2 <= epoch) {
+      *link = retired->next;
+      retired->free_fn(retired->ptr);
+      slab_free(retired, sizeof(Retired));
+      record->num_retired--;
+    } else {
+      link = &retired->next;
+    }
+  }
+}
+
+void epoch_enter() {
+  EpochRecord *record = get_record();
+  uint_fast64_t epoch = atomic_load(&global_epoch);
+  atomic_store(&record->state, (epoch << 1) | 1);
+}
+
+void epoch_exit() {
+  atomic_store_explicit(&local_record->state, 0, memory_order_release);
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+  EpochRecord *record = get_record();
+  Retired *retired = slab_alloc(sizeof(Retired));
+  retired->ptr = ptr;
+  retired->free_fn = free_fn;
+  retired->epoch = atomic_load(&global_epoch);
+  retired->next = record->retired;
+  record->retired = retired;
+
+  if (++record->num_retired >= EPOCH_RETIRE_BATCH) {
+    try_advance();
+    reclaim(record);
+  }
+}
+
+void epoch_terminate() {
+  EpochRecord *record = atomic_exchange(&records, NULL);
+  while (record != NULL) {
+    EpochRecord *next = record->next;
+    while (record->retired != NULL) {
+      Retired *retired = record->retired;
+      record->retired = retired->next;
+      retired->free_fn(retired->ptr);
+      slab_free(retired, sizeof(Retired));
+    }
+    free(record);
+    record = next;
+  }
+  local_record = NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+// Number of retired pointers a thread accumulates before it tries to advance
+// the global epoch and reclaim them.
+#define EPOCH_RETIRE_BATCH 64
+
+/// Marks the calling thread as being inside a read-side critical section.
+/// Memory retired by other threads while the section is open is not freed
+/// until the thread calls epoch_exit.
+void epoch_enter();
+
+/// Ends the read-side critical section opened by epoch_enter.
+void epoch_exit();
+
+/// Schedules memory to be freed once no reader can still be using it. The
+/// pointer must already be unreachable for readers that enter after this call.
+/// @param ptr Pointer to the memory to be reclaimed.
+/// @param free_fn Function used to free the memory.
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/// Frees every pointer still waiting to be reclaimed and the per-thread
+/// bookkeeping. Must only be called once no thread is using the epochs.
+void epoch_terminate();
+
+#endif // KVS_EPOCH_H
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flat_table.h"
+#include "kvs.h"
+
+// The table grows once it is more than 3/4 full, keeping probe runs short
+#define FLAT_MAX_LOAD_NUM 3
+#define FLAT_MAX_LOAD_DEN 4
+
+/// Computes the tag stored for a key. The lowest bit is always set so a
+/// stored tag can never be mistaken for an empty slot.
+static uint64_t flat_tag(const char *key) {
+  return hash(key, strlen(key)) | 1;
+}
+
+/// Computes the slot where the probe sequence of a tag starts.
+static size_t flat_home(const FlatTable *ft, uint64_t tag) {
+  return (size_t)((tag >> 1) & (ft->capacity - 1));
+}
+
+/// Copies a bounded string into a MAX_STRING_SIZE slot field.
+static void flat_copy(char *dest, const char *src) {
+  size_t len = strnlen(src, MAX_STRING_SIZE - 1);
+  memcpy(dest, src, len);
+  dest[len] = '\0';
+}
+
+/// Allocates the tag and slot arrays of a table with the given capacity.
+/// @return 0 on success, 1 if the allocation failed.
+static int flat_alloc(FlatTable *ft, size_t capacity) {
+  ft->tags = calloc(capacity, sizeof(uint64_t));
+  ft->slots = malloc(capacity * sizeof(FlatSlot));
+  if (!ft->tags || !ft->slots) {
+    free(ft->tags);
+    free(ft->slots);
+    return 1;
+  }
+  ft->capacity = capacity;
+  return 0;
+}
+
+/// Finds the slot holding the given key.
+/// @return Index of the slot, or capacity if the key is not in the table.
+static size_t flat_find(const FlatTable *ft, const char *key, uint64_t tag) {
+  size_t mask = ft->capacity - 1;
+  for (size_t i = flat_home(ft, tag);; i = (i + 1) & mask) {
+    if (ft->tags[i] == 0) {
+      return ft->capacity;
+    }
+    if (ft->tags[i] == tag && strcmp(ft->slots[i].key, key) == 0) {
+      return i;
+    }
+  }
+}
+
+/// Doubles the capacity of the table and reinserts every pair.
+/// @return 0 on success, 1 if the allocation failed.
+static int flat_grow(FlatTable *ft) {
+  FlatTable old = *ft;
+  if (flat_alloc(ft, old.capacity * 2)) {
+    *ft = old;
+    return 1;
+  }
+
+  size_t mask = ft->capacity - 1;
+  for (size_t i = 0; i < old.capacity; i++) {
+    if (old.tags[i] == 0) {
+      continue;
+    }
+    size_t j = flat_home(ft, old.tags[i]);
+    while (ft->tags[j] != 0) {
+      j = (j + 1) & mask;
+    }
+    ft->tags[j] = old.tags[i];
+    ft->slots[j] = old.slots[i];
+  }
+
+  free(old.tags);
+  free(old.slots);
+  return 0;
+}
+
+FlatTable *create_flat_table(size_t capacity) {
+  FlatTable *ft = malloc(sizeof(FlatTable));
+  if (!ft) {
+    fprintf(stderr, "Failed to allocate memory for flat table\n");
+    return NULL;
+  }
+
+  size_t rounded = FLAT_INITIAL_CAPACITY;
+  while (rounded < capacity) {
+    rounded *= 2;
+  }
+
+  if (flat_alloc(ft, rounded)) {
+    fprintf(stderr, "Failed to allocate memory for flat table slots\n");
+    free(ft);
+    return NULL;
+  }
+  ft->count = 0;
+  return ft;
+}
+
+int flat_write_pair(FlatTable *ft, const char *key, const char *value) {
+  uint64_t tag = flat_tag(key);
+  size_t index = flat_find(ft, key, tag);
+  if (index != ft->capacity) {
+    flat_copy(ft->slots[index].value, value);
+    return 0;
+  }
+
+  if ((ft->count + 1) * FLAT_MAX_LOAD_DEN > ft->capacity * FLAT_MAX_LOAD_NUM &&
+      flat_grow(ft)) {
+    fprintf(stderr, "Failed to grow flat table\n");
+    return 1;
+  }
+
+  size_t mask = ft->capacity - 1;
+  index = flat_home(ft, tag);
+  while (ft->tags[index] != 0) {
+    index = (index + 1) & mask;
+  }
+  ft->tags[index] = tag;
+  flat_copy(ft->slots[index].key, key);
+  flat_copy(ft->slots[index].value, value);
+  ft->count++;
+  return 0;
+}
+
+const char *flat_read_pair(const FlatTable *ft, const char *key) {
+  size_t index = flat_find(ft, key, flat_tag(key));
+  if (index == ft->capacity) {
+    return NULL;
+  }
+  return ft->slots[index].value;
+}
+
+int flat_delete_pair(FlatTable *ft, const char *key) {
+  size_t hole = flat_find(ft, key, flat_tag(key));
+  if (hole == ft->capacity) {
+    return 1;
+  }
+
+  // Shift back every later pair whose home slot doesn't lie between the hole
+  // and its current position, so lookups never stop early on the hole
+  size_t mask = ft->capacity - 1;
+  for (size_t i = (hole + 1) & mask; ft->tags[i] != 0; i = (i + 1) & mask) {
+    size_t home = flat_home(ft, ft->tags[i]);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      ft->tags[hole] = ft->tags[i];
+      ft->slots[hole] = ft->slots[i];
+      hole = i;
+    }
+  }
+  ft->tags[hole] = 0;
+  ft->count--;
+  return 0;
+}
+
+void free_flat_table(FlatTable *ft) {
+  free(ft->tags);
+  free(ft->slots);
+  free(ft);
+}
@@ -0,0 +1,63 @@
+#ifndef KVS_FLAT_TABLE_H
+#define KVS_FLAT_TABLE_H
+
+// Number of slots a flat table starts with. Must be a power of two.
+#define FLAT_INITIAL_CAPACITY 64
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Keys and values are bounded by MAX_STRING_SIZE, so both live inline in the
+// slot and a lookup never leaves the slot array.
+typedef struct FlatSlot {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+} FlatSlot;
+
+// Open-addressed table with linear probing. The hash tags are kept in their
+// own dense array, so a probe sequence scans contiguous memory and only
+// touches a slot when its tag matches. A tag of 0 marks an empty slot.
+// The table has no locks of its own: it is meant to be owned by a single
+// thread or protected by the caller. The shards of the sharded mode (-n) each
+// own one, see shard.h.
+typedef struct FlatTable {
+  uint64_t *tags;
+  FlatSlot *slots;
+  size_t capacity; // Number of slots, always a power of two
+  size_t count;    // Number of pairs stored in the table
+} FlatTable;
+
+/// Creates a new flat table.
+/// @param capacity Initial number of slots, rounded up to a power of two.
+/// @return Newly created flat table, NULL on failure.
+FlatTable *create_flat_table(size_t capacity);
+
+/// Writes a key value pair to the flat table, overwriting the value in place
+/// if the key already exists.
+/// @param ft Flat table to be modified.
+/// @param key Key of the pair to be written.
+/// @param value Value of the pair to be written.
+/// @return 0 if the pair was written successfully, 1 otherwise.
+int flat_write_pair(FlatTable *ft, const char *key, const char *value);
+
+/// Looks up the value of the given key.
+/// @param ft Flat table to read from.
+/// @param key Key of the pair to read.
+/// @return Pointer to the value stored in the slot, valid until the table is
+/// next modified, or NULL if the key is not in the table.
+const char *flat_read_pair(const FlatTable *ft, const char *key);
+
+/// Deletes the pair with the given key. Later pairs of the probe sequence are
+/// shifted back, so the table never accumulates tombstones.
+/// @param ft Flat table to delete from.
+/// @param key Key of the pair to be deleted.
+/// @return 0 if the pair was deleted successfully, 1 if it was not found.
+int flat_delete_pair(FlatTable *ft, const char *key);
+
+/// Frees the flat table.
+/// @param ft Flat table to be freed.
+void free_flat_table(FlatTable *ft);
+
+#endif // KVS_FLAT_TABLE_H
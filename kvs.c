@@ -1,32 +1,286 @@
-#include <ctype.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "epoch.h"
 #include "kvs.h"
 #include "operations.h"
+#include "slab.h"
 #include "string.h"
 
-int hash(const char *key) {
-  int firstLetter = tolower(key[0]);
-  if (firstLetter >= 'a' && firstLetter <= 'z') {
-    return firstLetter - 'a';
-  } else if (firstLetter >= '0' && firstLetter <= '9') {
-    return firstLetter - '0';
+#define HASH_SEED 0xa0761d6478bd642fULL
+#define HASH_MULT 0xe7037ed1a0b428dbULL
+#define HASH_FINAL 0x8ebc6af09c88c6e3ULL
+
+/// Multiplies two 64-bit words and folds the 128-bit result into 64 bits.
+static uint64_t hash_mix(uint64_t a, uint64_t b) {
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+uint64_t hash(const char *key, size_t len) {
+  const unsigned char *p = (const unsigned char *)key;
+  uint64_t h = HASH_SEED ^ len;
+
+  // Consume the key 8 bytes at a time
+  while (len >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    h = hash_mix(h ^ word, HASH_MULT);
+    p += sizeof(uint64_t);
+    len -= sizeof(uint64_t);
   }
-  return -1; // Invalid index for non-alphabetic or number strings
+
+  // Remaining bytes are zero-padded into a last word
+  uint64_t tail = 0;
+  memcpy(&tail, p, len);
+  h = hash_mix(h ^ tail, HASH_MULT);
+
+  return hash_mix(h, HASH_FINAL);
+}
+
+size_t bucket_index(const HashTable *ht, uint64_t key_hash) {
+  return (size_t)(key_hash & (ht->size - 1));
 }
 
 /*AUXILIARY FUNCTIONS*/
 
-void destroy_locks(HashTable *ht, int up_to_index) {
-  for (int i = 0; i < up_to_index; i++) {
+void destroy_locks(HashTable *ht, size_t up_to_index) {
+  for (size_t i = 0; i < up_to_index; i++) {
     pthread_rwlock_destroy(&ht->table[i].list_lock);
   }
 }
 
+/// Allocates an array of empty buckets with their locks initialized.
+/// @param size Number of buckets.
+/// @return The bucket array, NULL on failure.
+static List *create_buckets(size_t size) {
+  List *table = malloc(size * sizeof(List));
+  if (!table) {
+    fprintf(stderr, "Failed to allocate memory for hash table buckets\n");
+    return NULL;
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    table[i].head = NULL;
+    if (pthread_rwlock_init(&table[i].list_lock, NULL) != 0) {
+      for (size_t j = 0; j < i; j++) {
+        pthread_rwlock_destroy(&table[j].list_lock);
+      }
+      free(table);
+      return NULL;
+    }
+  }
+  return table;
+}
+
+/// Destroys the locks of a bucket array and frees it, along with the pairs
+/// still linked into its buckets.
+/// @param table Bucket array, as returned by create_buckets.
+/// @param size Number of buckets.
+static void free_buckets(List *table, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    KeyNode *keyNode = table[i].head;
+    while (keyNode != NULL) {
+      KeyNode *temp = keyNode;
+      keyNode = keyNode->next;
+      slab_free_string(temp->value);
+      slab_free(temp, sizeof(KeyNode));
+    }
+    pthread_rwlock_destroy(&table[i].list_lock);
+  }
+  free(table);
+}
+
+/// Finds the chain a key is linked into, the caller either holds the lock of
+/// the key's bucket or retries when resize_seq changes.
+/// @param ht Hash table the key belongs to.
+/// @param key_hash Hash of the key, as returned by hash().
+/// @return Bucket whose chain holds the key, if the table has it.
+static List *find_chain(HashTable *ht, uint64_t key_hash) {
+  // Arrays are published before the size, so a reader that sees a size
+  // never indexes an array smaller than it with it
+  size_t size = atomic_load(&ht->size);
+  List *table = atomic_load(&ht->table);
+  List *next_table = atomic_load(&ht->next_table);
+  size_t index = key_hash & (size - 1);
+  if (next_table != NULL && index < atomic_load(&ht->moved)) {
+    return &next_table[key_hash & (2 * size - 1)];
+  }
+  return &table[index];
+}
+
+/// Checks whether a node holds the given key.
+static int key_matches(const KeyNode *keyNode, uint64_t key_hash,
+                       StringView key) {
+  return keyNode->hash == key_hash && keyNode->key[key.len] == '\0' &&
+         memcmp(keyNode->key, key.data, key.len) == 0;
+}
+
+/// Copies a string view into a newly allocated null-terminated string.
+static char *copy_view(StringView view) {
+  char *copy = slab_alloc(view.len + 1);
+  memcpy(copy, view.data, view.len);
+  copy[view.len] = '\0';
+  return copy;
+}
+
+static void free_node(void *keyNode) { slab_free(keyNode, sizeof(KeyNode)); }
+
+/// Frees memory unlinked from the table, or hands it to the epoch reclaimer
+/// when lock-free readers may still be looking at it.
+/// @param ht Hash table the memory belonged to.
+/// @param ptr Memory to be freed.
+/// @param free_fn Function that frees it.
+static void release(const HashTable *ht, void *ptr, void (*free_fn)(void *)) {
+  if (ht->lockfree_reads) {
+    epoch_retire(ptr, free_fn);
+  } else {
+    free_fn(ptr);
+  }
+}
+
+/// Saves the current value of a pair for the snapshots that still need it,
+/// before a write or delete replaces it. The caller holds the bucket lock.
+/// @param ht Hash table the pair belongs to.
+/// @param keyNode Node about to be changed.
+/// @param index Index of the node's bucket.
+static void save_for_snapshots(HashTable *ht, const KeyNode *keyNode,
+                               size_t index) {
+  for (Snapshot *snapshot = ht->snapshots; snapshot != NULL;
+       snapshot = snapshot->next) {
+    // Only the first change since the snapshot matters, and only until the
+    // bucket has been read
+    if (keyNode->version >= snapshot->version ||
+        index < atomic_load(&snapshot->scanned)) {
+      continue;
+    }
+    SnapshotEntry *entry = safe_malloc(sizeof(SnapshotEntry));
+    entry->version = keyNode->version;
+    strcpy(entry->key, keyNode->key);
+    entry->value = strdup(keyNode->value);
+    entry->next = snapshot->saved[index];
+    snapshot->saved[index] = entry;
+  }
+}
+
+/// Adds a key to the deletion log of the table.
+static void log_deleted(HashTable *ht, const char *key) {
+  DeletedKey *deleted = safe_malloc(sizeof(DeletedKey));
+  deleted->version = ht->version;
+  strcpy(deleted->key, key);
+  safe_mutex_lock(&ht->deleted_lock);
+  deleted->next = ht->deleted;
+  ht->deleted = deleted;
+  safe_mutex_unlock(&ht->deleted_lock);
+}
+
+/// Waits until no grow is in progress.
+/// @return The resize sequence number, to be compared after the read.
+static unsigned int read_begin(HashTable *ht) {
+  unsigned int seq;
+  while ((seq = atomic_load(&ht->resize_seq)) & 1) {
+    sched_yield();
+  }
+  return seq;
+}
+
+/// Relinks the nodes of a chain into the buckets of another array, no key is
+/// rehashed or copied.
+/// @param keyNode First node of the chain.
+/// @param table Bucket array the nodes are moved to.
+/// @param mask Number of buckets of the array minus one.
+static void relink_chain(KeyNode *keyNode, List *table, size_t mask) {
+  // A lock-free reader that follows a relinked node ends up in another
+  // chain, which is still NULL-terminated, so it can miss keys but never
+  // loop or crash. It retries once it sees resize_seq changed.
+  while (keyNode != NULL) {
+    KeyNode *next = atomic_load_explicit(&keyNode->next, memory_order_relaxed);
+    List *list = &table[keyNode->hash & mask];
+    atomic_store_explicit(&keyNode->next,
+                          atomic_load_explicit(&list->head,
+                                               memory_order_relaxed),
+                          memory_order_release);
+    atomic_store_explicit(&list->head, keyNode, memory_order_release);
+    keyNode = next;
+  }
+}
+
+/// Moves the pairs of the next bucket that wasn't moved yet into the bigger
+/// array. The caller holds the lock of that bucket in write mode, or the
+/// global lock in write mode, and makes resize_seq odd around the move.
+/// @param ht Hash table that is growing.
+static void move_bucket(HashTable *ht) {
+  size_t index = atomic_load(&ht->moved);
+  List *list = &ht->table[index];
+  relink_chain(atomic_load_explicit(&list->head, memory_order_relaxed),
+               ht->next_table, 2 * ht->size - 1);
+  atomic_store_explicit(&list->head, NULL, memory_order_release);
+  atomic_store(&ht->moved, index + 1);
+}
+
+/// Moves the buckets that are left and replaces the bucket array with the
+/// bigger one. The caller must hold the global lock in write mode.
+/// @param ht Hash table that is growing.
+static void finish_growing(HashTable *ht) {
+  size_t old_size = ht->size;
+  List *old_table = ht->table;
+
+  atomic_fetch_add(&ht->resize_seq, 1);
+  while (atomic_load(&ht->moved) < old_size) {
+    move_bucket(ht);
+  }
+  // Published in the order find_chain reads them backwards
+  List *new_table = ht->next_table;
+  atomic_store(&ht->next_table, NULL);
+  atomic_store(&ht->moved, 0);
+  atomic_store(&ht->table, new_table);
+  atomic_store(&ht->size, 2 * old_size);
+  atomic_fetch_add(&ht->resize_seq, 1);
+
+  for (size_t i = 0; i < old_size; i++) {
+    pthread_rwlock_destroy(&old_table[i].list_lock);
+  }
+  release(ht, old_table, free);
+}
+
+/// Replaces the bucket array with a bigger one and redistributes the existing
+/// pairs. The caller must hold the global lock in write mode.
+/// @param ht Hash table to resize.
+/// @param new_size New number of buckets, a power of two.
+/// @return 0 if the table was resized successfully, 1 otherwise.
+static int resize_hash_table(HashTable *ht, size_t new_size) {
+  size_t old_size = ht->size;
+  List *old_table = ht->table;
+  List *new_table = create_buckets(new_size);
+  if (!new_table) {
+    return 1;
+  }
+
+  // Lock-free readers that overlap the resize retry their lookup
+  atomic_fetch_add(&ht->resize_seq, 1);
+  for (size_t i = 0; i < old_size; i++) {
+    relink_chain(atomic_load_explicit(&old_table[i].head,
+                                      memory_order_relaxed),
+                 new_table, new_size - 1);
+  }
+
+  // The table is published before its size, so a reader that sees the new
+  // size never indexes the old, smaller array with it
+  atomic_store(&ht->table, new_table);
+  atomic_store(&ht->size, new_size);
+  atomic_fetch_add(&ht->resize_seq, 1);
+
+  for (size_t i = 0; i < old_size; i++) {
+    pthread_rwlock_destroy(&old_table[i].list_lock);
+  }
+  release(ht, old_table, free);
+  return 0;
+}
+
 /*END OF AUXILIARY FUNCTIONS*/
 
-struct HashTable *create_hash_table() {
+struct HashTable *create_hash_table(int lockfree_reads) {
   // Allocate memory for the hash table
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht) {
@@ -35,107 +289,333 @@ struct HashTable *create_hash_table() {
   }
 
   // Initialize each bucket's list and its lock
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    ht->table[i].head = NULL; // Set the head pointer to NULL
-
-    if (pthread_rwlock_init(&ht->table[i].list_lock, NULL) != 0) {
-      destroy_locks(ht, i);
-      free(ht);
-      return NULL;
-    }
+  List *table = create_buckets(INITIAL_TABLE_SIZE);
+  if (!table) {
+    free(ht);
+    return NULL;
   }
+  atomic_init(&ht->table, table);
+  atomic_init(&ht->size, INITIAL_TABLE_SIZE);
+  atomic_init(&ht->count, 0);
+  atomic_init(&ht->resize_seq, 0);
+  atomic_init(&ht->next_table, NULL);
+  atomic_init(&ht->moved, 0);
+  ht->lockfree_reads = lockfree_reads;
+  ht->version = 0;
+  ht->snapshots = NULL;
+  ht->log_deletes = 0;
+  ht->deleted = NULL;
+  ht->index_keys = 0;
 
   // Initialize the global lock
+  if (pthread_mutex_init(&ht->deleted_lock, NULL) != 0) {
+    destroy_locks(ht, ht->size);
+    free(table);
+    free(ht);
+    return NULL;
+  }
+  if (pthread_mutex_init(&ht->move_lock, NULL) != 0) {
+    pthread_mutex_destroy(&ht->deleted_lock);
+    destroy_locks(ht, ht->size);
+    free(table);
+    free(ht);
+    return NULL;
+  }
   if (pthread_rwlock_init(&ht->global_lock, NULL) != 0) {
-    destroy_locks(ht, TABLE_SIZE);
+    pthread_mutex_destroy(&ht->move_lock);
+    pthread_mutex_destroy(&ht->deleted_lock);
+    destroy_locks(ht, ht->size);
+    free(table);
+    free(ht);
+    return NULL;
+  }
+  if (index_init(&ht->ordered) != 0) {
+    pthread_rwlock_destroy(&ht->global_lock);
+    pthread_mutex_destroy(&ht->move_lock);
+    pthread_mutex_destroy(&ht->deleted_lock);
+    destroy_locks(ht, ht->size);
+    free(table);
     free(ht);
     return NULL;
   }
   return ht; // Successfully created hash table
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-  int index = hash(key);
-  KeyNode *keyNode = ht->table[index].head;
+int hash_table_overloaded(const HashTable *ht) {
+  if (ht->snapshots != NULL) {
+    return 0;
+  }
+  return atomic_load_explicit(&ht->count, memory_order_relaxed) >
+         ht->size * MAX_LOAD_FACTOR;
+}
+
+size_t bucket_chains(HashTable *ht, size_t index, List **chains) {
+  List *next_table = atomic_load(&ht->next_table);
+  if (next_table != NULL && index < atomic_load(&ht->moved)) {
+    chains[0] = &next_table[index];
+    chains[1] = &next_table[index + ht->size];
+    return 2;
+  }
+  chains[0] = &ht->table[index];
+  return 1;
+}
+
+void hash_table_grow_step(HashTable *ht, size_t num_pairs) {
+  if (ht->snapshots != NULL) {
+    return;
+  }
+  size_t size = ht->size;
+  List *next_table = atomic_load(&ht->next_table);
+  int finished = next_table != NULL && atomic_load(&ht->moved) == size;
+
+  if (finished || (next_table == NULL && hash_table_overloaded(ht))) {
+    // Allocated without holding up anyone, the global lock in write mode
+    // is only taken to swap the bucket arrays
+    List *buckets = finished ? NULL : create_buckets(2 * size);
+    safe_rdwrunlock(&ht->global_lock);
+    safe_wrlock(&ht->global_lock);
+    // Another writer may have changed the table while we waited for the lock
+    if (ht->snapshots == NULL && ht->size == size) {
+      if (finished && ht->next_table != NULL) {
+        finish_growing(ht);
+      } else if (buckets != NULL && ht->next_table == NULL) {
+        atomic_store(&ht->next_table, buckets);
+        buckets = NULL;
+      }
+    }
+    safe_rdwrunlock(&ht->global_lock);
+    safe_rdlock(&ht->global_lock);
+    if (buckets != NULL) {
+      free_buckets(buckets, 2 * size);
+    }
+    return;
+  }
+
+  // Only one writer moves buckets at a time, the others go on writing
+  if (next_table == NULL || pthread_mutex_trylock(&ht->move_lock) != 0) {
+    return;
+  }
+  for (size_t i = 0;
+       i < num_pairs * GROW_BUCKETS_PER_PAIR && atomic_load(&ht->moved) < size;
+       i++) {
+    pthread_rwlock_t *lock = &ht->table[atomic_load(&ht->moved)].list_lock;
+    safe_wrlock(lock);
+    atomic_fetch_add(&ht->resize_seq, 1);
+    move_bucket(ht);
+    atomic_fetch_add(&ht->resize_seq, 1);
+    safe_rdwrunlock(lock);
+  }
+  safe_mutex_unlock(&ht->move_lock);
+}
+
+int grow_hash_table(HashTable *ht) {
+  if (atomic_load(&ht->next_table) != NULL) {
+    finish_growing(ht);
+    return 0;
+  }
+  return resize_hash_table(ht, ht->size * 2);
+}
+
+int reserve_hash_table(HashTable *ht, size_t count) {
+  if (ht->snapshots != NULL) {
+    return 0;
+  }
+  if (atomic_load(&ht->next_table) != NULL) {
+    finish_growing(ht);
+  }
+  size_t new_size = ht->size;
+  while (count > new_size * MAX_LOAD_FACTOR) {
+    new_size *= 2;
+  }
+  if (new_size == ht->size) {
+    return 0;
+  }
+  return resize_hash_table(ht, new_size);
+}
+
+int write_pair(HashTable *ht, StringView key, StringView value) {
+  if (key.len >= MAX_STRING_SIZE) {
+    return 1;
+  }
+  uint64_t key_hash = hash(key.data, key.len);
+  size_t index = bucket_index(ht, key_hash);
+  List *list = find_chain(ht, key_hash);
+  KeyNode *keyNode = atomic_load_explicit(&list->head, memory_order_relaxed);
   // Search for the key node
 
   while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      free(keyNode->value);
-      keyNode->value = strdup(value);
+    if (key_matches(keyNode, key_hash, key)) {
+      save_for_snapshots(ht, keyNode, index);
+      keyNode->version = ht->version;
+      char *old_value =
+          atomic_load_explicit(&keyNode->value, memory_order_relaxed);
+      // Without lock-free readers nobody can see the value change, so its
+      // block is reused whenever the new value fits in it
+      if (!ht->lockfree_reads &&
+          slab_size(strlen(old_value) + 1) == slab_size(value.len + 1)) {
+        memcpy(old_value, value.data, value.len);
+        old_value[value.len] = '\0';
+        return 0;
+      }
+      atomic_store_explicit(&keyNode->value, copy_view(value),
+                            memory_order_release);
+      release(ht, old_value, slab_free_string);
       return 0;
     }
-    keyNode = keyNode->next; // Move to the next node
+    // Move to the next node
+    keyNode = atomic_load_explicit(&keyNode->next, memory_order_relaxed);
   }
 
   // Key not found, create a new key node
-  keyNode = safe_malloc(sizeof(KeyNode));
-  keyNode->key = strdup(key);            // Allocate memory for the key
-  keyNode->value = strdup(value);        // Allocate memory for the value
-  keyNode->next = ht->table[index].head; // Link to existing nodes
-  ht->table[index].head =
-      keyNode; // Place new key node at the start of the list
+  keyNode = slab_alloc(sizeof(KeyNode));
+  memcpy(keyNode->key, key.data, key.len);
+  keyNode->key[key.len] = '\0';
+  keyNode->hash = key_hash;
+  keyNode->version = ht->version;
+  atomic_init(&keyNode->value, copy_view(value)); // Copy the value
+  atomic_init(&keyNode->next, atomic_load_explicit(
+                                  &list->head, memory_order_relaxed));
+  // Place new key node at the start of the list, fully initialized
+  atomic_store_explicit(&list->head, keyNode, memory_order_release);
+  atomic_fetch_add_explicit(&ht->count, 1, memory_order_relaxed);
+  if (ht->index_keys) {
+    index_insert(&ht->ordered, key);
+  }
   return 0;
 }
 
-char *read_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
-  KeyNode *keyNode = ht->table[index].head;
-  char *value;
+const char *lookup_pair(HashTable *ht, StringView key) {
+  if (key.len >= MAX_STRING_SIZE) {
+    return NULL;
+  }
+  uint64_t key_hash = hash(key.data, key.len);
+  unsigned int seq;
 
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      value = strdup(keyNode->value);
-      return value; // Return copy of the value if found
+  do {
+    seq = read_begin(ht);
+    KeyNode *keyNode = atomic_load_explicit(&find_chain(ht, key_hash)->head,
+                                            memory_order_acquire);
+
+    while (keyNode != NULL) {
+      if (key_matches(keyNode, key_hash, key)) {
+        // A node found during a grow still holds the current value
+        return atomic_load_explicit(&keyNode->value, memory_order_acquire);
+      }
+      // Move to the next node
+      keyNode = atomic_load_explicit(&keyNode->next, memory_order_acquire);
     }
-    keyNode = keyNode->next; // Move to the next node
-  }
-  return NULL; // Key not found
+    // Pairs were moved under us, the key may be in a chain we skipped
+  } while (atomic_load(&ht->resize_seq) != seq);
+  return NULL;
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
-  List *list = &ht->table[index];
-  KeyNode *keyNode = list->head;
-  KeyNode *prevNode = NULL;
+char *read_pair(HashTable *ht, StringView key) {
+  const char *value = lookup_pair(ht, key);
+  return value != NULL ? strdup(value) : NULL;
+}
+
+int delete_pair(HashTable *ht, StringView key) {
+  if (key.len >= MAX_STRING_SIZE) {
+    return 1;
+  }
+  uint64_t key_hash = hash(key.data, key.len);
+  size_t index = bucket_index(ht, key_hash);
+  List *list = find_chain(ht, key_hash);
+  KeyNode *_Atomic *link = &list->head;
+  KeyNode *keyNode = atomic_load_explicit(link, memory_order_relaxed);
 
   while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      if (prevNode == NULL) {
-        // Node to delete is the first node in the list
-        ht->table[index].head =
-            keyNode->next; // Update the table to point to the next node
-      } else {
-        // Node to delete is not the first; bypass it
-        prevNode->next =
-            keyNode->next; // Link the previous node to the next node
+    KeyNode *next = atomic_load_explicit(&keyNode->next, memory_order_relaxed);
+    if (key_matches(keyNode, key_hash, key)) {
+      save_for_snapshots(ht, keyNode, index);
+      if (ht->log_deletes) {
+        log_deleted(ht, keyNode->key);
+      }
+      // Bypass the node, readers already on it can still follow its next
+      atomic_store_explicit(link, next, memory_order_release);
+      release(ht, atomic_load_explicit(&keyNode->value, memory_order_relaxed),
+              slab_free_string);
+      release(ht, keyNode, free_node);
+      atomic_fetch_sub_explicit(&ht->count, 1, memory_order_relaxed);
+      if (ht->index_keys) {
+        index_remove(&ht->ordered, key);
       }
-
-      free(keyNode->key);
-      free(keyNode->value);
-      free(keyNode);
       return 0;
     }
-    prevNode = keyNode;      // Move prevNode to current node
-    keyNode = keyNode->next; // Move to the next node
+    link = &keyNode->next; // Move to the next node
+    keyNode = next;
   }
 
   return 1;
 }
 
-void free_table(HashTable *ht) {
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = ht->table[i].head;
-    while (keyNode != NULL) {
-      KeyNode *temp = keyNode;
-      keyNode = keyNode->next;
-      free(temp->key);
-      free(temp->value);
-      free(temp);
+Snapshot *create_snapshot(HashTable *ht) {
+  Snapshot *snapshot = safe_malloc(sizeof(Snapshot));
+  snapshot->version = ++ht->version;
+  snapshot->base_version = 0;
+  snapshot->size = ht->size;
+  atomic_init(&snapshot->scanned, 0);
+  snapshot->saved = calloc(snapshot->size, sizeof(SnapshotEntry *));
+  if (snapshot->saved == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    exit(1);
+  }
+  snapshot->next = ht->snapshots;
+  ht->snapshots = snapshot;
+  return snapshot;
+}
+
+void snapshot_bucket_done(Snapshot *snapshot, size_t index) {
+  atomic_store(&snapshot->scanned, index + 1);
+}
+
+void prune_deleted(HashTable *ht, uint64_t before) {
+  safe_mutex_lock(&ht->deleted_lock);
+  // Newest first, so everything after the first old key is old too
+  DeletedKey **link = &ht->deleted;
+  while (*link != NULL && (*link)->version >= before) {
+    link = &(*link)->next;
+  }
+  DeletedKey *deleted = *link;
+  *link = NULL;
+  safe_mutex_unlock(&ht->deleted_lock);
+
+  while (deleted != NULL) {
+    DeletedKey *next = deleted->next;
+    free(deleted);
+    deleted = next;
+  }
+}
+
+void release_snapshot(HashTable *ht, Snapshot *snapshot) {
+  Snapshot **link = &ht->snapshots;
+  while (*link != snapshot) {
+    link = &(*link)->next;
+  }
+  *link = snapshot->next;
+
+  for (size_t i = 0; i < snapshot->size; i++) {
+    SnapshotEntry *entry = snapshot->saved[i];
+    while (entry != NULL) {
+      SnapshotEntry *next = entry->next;
+      free(entry->value);
+      free(entry);
+      entry = next;
     }
-    ht->table[i].head = NULL;
   }
-  destroy_locks(ht, TABLE_SIZE);
+  free(snapshot->saved);
+  free(snapshot);
+}
+
+void free_table(HashTable *ht) {
+  free_buckets(ht->table, ht->size);
+  if (ht->next_table != NULL) {
+    free_buckets(ht->next_table, 2 * ht->size);
+  }
+  prune_deleted(ht, UINT64_MAX);
+  index_destroy(&ht->ordered);
+  pthread_mutex_destroy(&ht->move_lock);
+  pthread_mutex_destroy(&ht->deleted_lock);
   pthread_rwlock_destroy(&ht->global_lock);
   free(ht);
-}
\ No newline at end of file
+}
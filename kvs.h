@@ -1,63 +1,225 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+// Number of buckets the table starts with. Must be a power of two.
+#define INITIAL_TABLE_SIZE 64
+// Average number of pairs per bucket above which the table doubles in size.
+#define MAX_LOAD_FACTOR 2
+// Buckets moved into the bigger bucket array for every pair written while the
+// table grows, so the move is done long before the table is full again.
+#define GROW_BUCKETS_PER_PAIR 2
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 
+#include "constants.h"
+#include "ordered_index.h"
+#include "string_view.h"
+
+// Links and values are atomic so readers can walk a bucket without taking its
+// lock: writers publish new nodes and values with release stores, and memory
+// that readers may still see is handed to epoch.h instead of being freed.
 typedef struct KeyNode {
-  char *key;
-  char *value;
-  struct KeyNode *next;
+  struct KeyNode *_Atomic next;
+  uint64_t hash;    // Full hash of the key, kept to skip strcmp and rehashing
+  uint64_t version; // Table version the value was written at
+  char *_Atomic value;
+  char key[MAX_STRING_SIZE]; // Stored inline, keys never change
 } KeyNode;
 
 typedef struct List {
-  KeyNode *head;
+  KeyNode *_Atomic head;
   pthread_rwlock_t list_lock;
 } List;
 
+// Pair as it was when a snapshot was taken, saved by the first write or
+// delete of the pair after the snapshot.
+typedef struct SnapshotEntry {
+  struct SnapshotEntry *next;
+  uint64_t version; // Table version the value was written at
+  char *value;
+  char key[MAX_STRING_SIZE];
+} SnapshotEntry;
+
+// Consistent view of the table, read while writers keep modifying it. Pairs
+// written before the snapshot are read from the table itself, and writers save
+// the old pair aside before they overwrite or delete one of those. The table
+// doesn't grow while a snapshot is active, so bucket indexes stay valid.
+typedef struct Snapshot {
+  struct Snapshot *next; // Next active snapshot of the table
+  uint64_t version;      // Pairs written at this version or later are newer
+  // Changes older than this version are left out of the snapshot, set by its
+  // owner. Also keeps the deletions since this version in the table's log.
+  uint64_t base_version;
+  size_t size;           // Number of buckets of the table
+  // Buckets below this index were already read, writers stop saving pairs
+  // of those buckets. Only changed with the bucket's lock held.
+  atomic_size_t scanned;
+  SnapshotEntry **saved; // Pairs saved by writers, one list per bucket
+} Snapshot;
+
+// Key removed from the table, kept in the table's deletion log so a delta
+// backup can tell which keys disappeared since the backup it applies to.
+typedef struct DeletedKey {
+  struct DeletedKey *next;
+  uint64_t version; // Table version the key was deleted at
+  char key[MAX_STRING_SIZE];
+} DeletedKey;
+
+// The global lock protects the bucket array itself. Operations on individual
+// pairs hold it in read mode and lock the buckets they touch, while replacing
+// the bucket array or taking a snapshot of the table (SHOW, BACKUP) hold it in
+// write mode. Lock-free readers take neither lock and use resize_seq instead
+// to notice that pairs were moved between buckets under them.
+//
+// The table grows a bucket at a time: next_table has twice as many buckets,
+// and the pairs of each bucket below moved were relinked into the two buckets
+// of next_table that take its place. Bucket indexes and locks still refer to
+// the old array until every bucket was moved and next_table replaces it.
 typedef struct HashTable {
-  List table[TABLE_SIZE];
+  List *_Atomic table;
+  atomic_size_t size;      // Number of buckets, always a power of two
+  atomic_size_t count;     // Number of pairs stored in the table
+  atomic_uint resize_seq;  // Odd while pairs are being moved between buckets
+  // Buckets the table grows into, twice as many, NULL while it isn't growing
+  List *_Atomic next_table;
+  atomic_size_t moved;     // Buckets whose pairs are in next_table already
+  // Held by the writer moving buckets into next_table
+  pthread_mutex_t move_lock;
+  int lockfree_reads;      // Whether readers may skip the locks
+  uint64_t version;        // Bumped by every snapshot, under the global lock
+  Snapshot *snapshots;     // Active snapshots, under the global lock
+  int log_deletes;         // Whether deleted keys are added to the log
+  DeletedKey *deleted;     // Deletion log, newest first
+  pthread_mutex_t deleted_lock;
+  int index_keys;          // Whether keys are added to the ordered index
+  OrderedIndex ordered;    // Keys in order, for RANGE and PREFIX
   pthread_rwlock_t global_lock;
 } HashTable;
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of
-// the project
-int hash(const char *key);
+// Hash function over the whole key (wyhash-style multiply/fold mixing).
+// @param key Key bytes, not necessarily null-terminated.
+// @param len Length of the key.
+// @return 64-bit hash of the key.
+uint64_t hash(const char *key, size_t len);
+
+/// Maps a key hash to the bucket that holds it.
+/// @param ht Hash table the bucket belongs to.
+/// @param key_hash Hash of the key, as returned by hash().
+/// @return Index of the bucket in ht->table.
+size_t bucket_index(const HashTable *ht, uint64_t key_hash);
+
+/// Finds the chains that hold the pairs of a bucket: the bucket itself, or
+/// the two buckets of the bigger array its pairs were moved to while the table
+/// grows. The caller must hold the bucket lock.
+/// @param ht Hash table the bucket belongs to.
+/// @param index Index of the bucket, as returned by bucket_index.
+/// @param chains Output array with room for two chains.
+/// @return Number of chains written to the output array.
+size_t bucket_chains(HashTable *ht, size_t index, List **chains);
 
 /// Destroys the locks associated with the hash table up to the given index.
 /// @param ht Pointer to the hash table whose locks will be destroyed.
 /// @param up_to_index The index up to which the locks should be destroyed.
 /// This function will iterate over the hash table up to the specified index
 /// and release any locks held by the table entries.
-void destroy_locks(HashTable *ht, int up_to_index);
+void destroy_locks(HashTable *ht, size_t up_to_index);
 
 /// Creates a new event hash table.
+/// @param lockfree_reads If set, readers may call read_pair without holding
+/// any lock, between epoch_enter and epoch_exit, and writers retire the memory
+/// they unlink through epoch_retire.
 /// @return Newly created hash table, NULL on failure
-struct HashTable *create_hash_table();
+struct HashTable *create_hash_table(int lockfree_reads);
+
+/// Checks whether the table went over its maximum load factor. Tables with
+/// active snapshots are never grown.
+/// @param ht Hash table to check.
+/// @return 1 if the table should be grown, 0 otherwise.
+int hash_table_overloaded(const HashTable *ht);
 
-/// Appends a new key value pair to the hash table.
+/// Grows the table while it keeps serving other operations, to be called by
+/// writers before they pick the buckets of their keys. An overloaded table
+/// gets a bucket array twice as big, allocated before the global lock is
+/// taken in write mode to publish it. Each call then moves the pairs of a few
+/// buckets into it, under the lock of the bucket being moved, and once all
+/// were moved the bigger array replaces the old one, which only takes the
+/// global lock in write mode for as long as it takes to swap the pointers.
+/// The caller holds the global lock in read mode, which may be released and
+/// taken back, and no bucket lock. Tables with active snapshots don't change.
+/// @param ht Hash table to grow.
+/// @param num_pairs Number of pairs the caller is about to write.
+void hash_table_grow_step(HashTable *ht, size_t num_pairs);
+
+/// Doubles the number of buckets at once, moving every pair that is not in
+/// the bigger array yet. The caller must hold the global lock in write mode,
+/// so every other operation waits for all the pairs to be moved: meant for
+/// callers that have the table to themselves, like loading a backup.
+/// @param ht Hash table to grow.
+/// @return 0 if the table was grown successfully, 1 otherwise.
+int grow_hash_table(HashTable *ht);
+
+/// Grows the table at once to the size it would reach holding the given
+/// number of pairs, with the same requirements as grow_hash_table.
+/// @param ht Hash table to grow.
+/// @param count Number of pairs the table is about to hold.
+/// @return 0 if the table is big enough, 1 if it could not be grown.
+int reserve_hash_table(HashTable *ht, size_t count);
+
+/// Appends a new key value pair to the hash table. Both strings are copied
+/// into the table, so they may point into memory the caller reuses. New keys
+/// are added to the ordered index too, if the table keeps one.
 /// @param ht Hash table to be modified.
-/// @param key Key of the pair to be written.
+/// @param key Key of the pair to be written, shorter than MAX_STRING_SIZE.
 /// @param value Value of the pair to be written.
 /// @return 0 if the node was appended successfully, 1 otherwise.
-int write_pair(HashTable *ht, const char *key, const char *value);
+int write_pair(HashTable *ht, StringView key, StringView value);
+
+/// Finds the value of given key without copying it. The caller must either
+/// hold the bucket lock of the key or, on a table with lock-free reads, be
+/// inside an epoch, and may only use the value until it lets go of either.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to be read.
+/// @return The value stored in the table, NULL if not found.
+const char *lookup_pair(HashTable *ht, StringView key);
+
+/// Reads the value of given key, with the same requirements as lookup_pair.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to be read.
+/// @return Copy of the value, to be freed by the caller, NULL if not found.
+char *read_pair(HashTable *ht, StringView key);
 
-/// Deletes the value of given key.
+/// Deletes the pair with the given key, and removes it from the ordered
+/// index if the table keeps one.
 /// @param ht Hash table to delete from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
-char *read_pair(HashTable *ht, const char *key);
+int delete_pair(HashTable *ht, StringView key);
 
-/// Appends a new node to the list.
-/// @param list Event list to be modified.
-/// @param key Key of the pair to read.
-/// @return 0 if the node was appended successfully, 1 otherwise.
-int delete_pair(HashTable *ht, const char *key);
+/// Takes a snapshot of the table. The caller must hold the global lock in
+/// write mode, so no batch of writes is half-applied.
+/// @param ht Hash table to take the snapshot of.
+/// @return The new snapshot, to be released with release_snapshot.
+Snapshot *create_snapshot(HashTable *ht);
+
+/// Marks a bucket of the snapshot as read. The caller must hold the bucket
+/// lock, and read the snapshot's pairs of the bucket before releasing it.
+/// @param snapshot Snapshot being read.
+/// @param index Index of the bucket, buckets are read in ascending order.
+void snapshot_bucket_done(Snapshot *snapshot, size_t index);
+
+/// Removes old keys from the deletion log.
+/// @param ht Hash table whose log is pruned.
+/// @param before Keys deleted before this version are removed.
+void prune_deleted(HashTable *ht, uint64_t before);
+
+/// Releases a snapshot and the pairs saved for it. The caller must hold the
+/// global lock in write mode.
+/// @param ht Hash table the snapshot was taken of.
+/// @param snapshot Snapshot to be released.
+void release_snapshot(HashTable *ht, Snapshot *snapshot);
 
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
@@ -8,270 +8,490 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
 #include <unistd.h>
 
 #include "constants.h"
 #include "operations.h"
 #include "parser.h"
+#include "pipeline.h"
+#include "scheduler.h"
+#include "server.h"
+#include "uring.h"
 
 /*GLOBAL VARIABLES*/
 DIR *dir;
-int MAX_PROC;
-int active_child = 0;
+char *dir_path;
+int pipeline_jobs;
+int uring_jobs;
+/*END OF GLOBAL VARIABLES*/
+
+// Maximum number of consecutive READ commands run in parallel
+#define READ_RUN_SIZE 16
 
+// Root task of the scheduler, processes a whole .job or .jobb file
 typedef struct {
-  char *dir_path;
-} ThreadArgs;
+  Task task;
+  char *jobs_file_path;
+} JobTask;
 
-pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t active_child_mutex = PTHREAD_MUTEX_INITIALIZER;
-/*END OF GLOBAL VARIABLES*/
+// A READ command of a run, which idle workers may steal
+typedef struct {
+  Task task;
+  size_t num_keys;
+  StringView keys[MAX_WRITE_SIZE];
+  // Copies of the keys, for job files that aren't mapped
+  char storage[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  OutputBuffer output; // Holds the result of this READ only, never flushed
+  atomic_size_t *pending;
+} ReadTask;
+
+// Consecutive READ commands of a job file. READs don't change the table, so
+// they can run in any order and in parallel, as long as the run completes
+// before the next command of the file and their results are emitted in file
+// order.
+typedef struct {
+  ReadTask *tasks; // Allocated on the first READ of the job
+  size_t len;
+  atomic_size_t pending;
+} ReadRun;
 
-/*MAIN THREAD FUNCTION*/
-void *thread_operation(void *arg) {
-  ThreadArgs *args = (ThreadArgs *)arg;
-  char *dir_path = args->dir_path;
+// State of a job file while its commands run
+typedef struct {
+  char *jobs_file_path;
+  int base_len; // Length of the path without the extension
+  int backups;  // Number of the next backup
+  ReadRun run;
+  int copy_keys;       // Whether the keys of READs must be copied
+  Pipeline *pipeline;  // NULL if the job runs synchronously
+  Uring *ring;         // NULL if the job uses blocking I/O
+  OutputBuffer output;
+} JobState;
+
+/*AUXILIARY FUNCTIONS*/
+
+static void run_read_task(Task *task) {
+  ReadTask *read_task = (ReadTask *)task;
+  if (kvs_read(read_task->num_keys, read_task->keys, &read_task->output)) {
+    fprintf(stderr, "Failed to read pair\n");
+  }
+  atomic_fetch_sub(read_task->pending, 1);
+}
 
-  struct dirent *dp;
-  while (1) {
+/// Adds a parsed READ command to the run.
+/// @param batch Batch of the command, the keys are copied out of it.
+/// @param copy_keys Whether the keys must be copied too, because they live in
+/// space the next command overwrites.
+static void queue_read(ReadRun *run, const CommandBatch *batch,
+                       int copy_keys) {
+  if (run->tasks == NULL) {
+    run->tasks = safe_malloc(READ_RUN_SIZE * sizeof(ReadTask));
+  }
 
-    safe_mutex_lock(&dir_lock);
-    dp = readdir(dir);
-    safe_mutex_unlock(&dir_lock);
+  // The batch is reused by the next command, and unmapped keys live in the
+  // reader's scratch space, which the next command overwrites
+  ReadTask *read_task = &run->tasks[run->len];
+  read_task->num_keys = batch->count;
+  for (size_t i = 0; i < batch->count; i++) {
+    read_task->keys[i] = batch->keys[i];
+    if (copy_keys) {
+      memcpy(read_task->storage[i], batch->keys[i].data, batch->keys[i].len);
+      read_task->keys[i].data = read_task->storage[i];
+    }
+  }
 
-    if (dp == NULL) { // If there are no more files to read
-      break;
+  read_task->task.run = run_read_task;
+  read_task->pending = &run->pending;
+  output_init(&read_task->output, -1);
+  run->len++;
+}
+
+/// Runs the queued READs, letting idle workers steal them, and appends their
+/// results to the job output in file order.
+static void flush_reads(ReadRun *run, OutputBuffer *output) {
+  if (run->len == 0) {
+    return;
+  }
+
+  if (run->len == 1) {
+    if (kvs_read(run->tasks[0].num_keys, run->tasks[0].keys, output)) {
+      fprintf(stderr, "Failed to read pair\n");
+    }
+  } else {
+    atomic_store(&run->pending, run->len);
+    for (size_t i = 0; i < run->len; i++) {
+      scheduler_spawn(&run->tasks[i].task);
     }
-    // Only process file if it is .job
-    if (dp->d_type == DT_REG && strlen(dp->d_name) > 3 &&
-        strcmp(dp->d_name + strlen(dp->d_name) - 4, ".job") == 0) {
-      int backups = 1;
+    scheduler_wait(&run->pending);
+
+    for (size_t i = 0; i < run->len; i++) {
+      output_write(output, run->tasks[i].output.data,
+                   run->tasks[i].output.len);
+      output_end_command(output);
+    }
+  }
+  run->len = 0;
+}
+
+static void run_job(Task *task);
+
+/// Checks whether a file name ends with the given extension.
+static int has_extension(const char *name, const char *extension) {
+  size_t len = strlen(name);
+  size_t extension_len = strlen(extension);
+  return len > extension_len &&
+         strcmp(name + len - extension_len, extension) == 0;
+}
+
+/// Finds the next .job or .jobb file of the directory.
+/// @return Task processing the file, or NULL if there are no more files.
+static Task *next_job(void) {
+  struct dirent *dp;
+  while ((dp = readdir(dir)) != NULL) {
+    // Only process file if it is .job, or .jobb for the binary format
+    if (dp->d_type == DT_REG && (has_extension(dp->d_name, ".job") ||
+                                 has_extension(dp->d_name, ".jobb"))) {
+      JobTask *job = safe_malloc(sizeof(JobTask));
+      job->task.run = run_job;
 
       /*CREATING STRING JOB FILE PATH*/
       size_t len_path = strlen(dir_path) + 1 + strlen(dp->d_name) + 1;
-      char *jobs_file_path = (char *)safe_malloc(len_path);
-      snprintf(jobs_file_path, len_path, "%s/%s", dir_path, dp->d_name);
-
-      int jobs_fd = open(jobs_file_path, O_RDONLY);
-      if (jobs_fd == -1) {
-        fprintf(stderr, "Failed to open .job file\n");
-        free(jobs_file_path);
-        return NULL;
-      }
-      /*JOB FILE OPENED*/
-
-      /*CREATING STRING OUT FILE PATH*/
-      char output_file_path[PATH_MAX];
-      snprintf(output_file_path, sizeof(output_file_path), "%.*sout",
-               (int)(strlen(jobs_file_path) - 3), jobs_file_path);
-
-      int out_fd = open(output_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-      if (out_fd < 0) {
-        fprintf(stderr, "Failed to create output file\n");
-        free(jobs_file_path);
-        return NULL;
-      }
-      /*OUT FILE CREATED*/
-
-      int should_exit = 0;
-      while (!should_exit) {
-        char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-        char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-        unsigned int delay;
-        size_t num_pairs;
-
-        switch (get_next(jobs_fd)) {
-        case CMD_WRITE:
-          num_pairs = parse_write(jobs_fd, keys, values, MAX_WRITE_SIZE,
-                                  MAX_STRING_SIZE);
-          if (num_pairs == 0) {
-            fprintf(stderr, "Invalid command. See HELP for usage\n");
-            continue;
-          }
-
-          if (kvs_write(num_pairs, keys, values)) {
-            fprintf(stderr, "Failed to write pair\n");
-          }
-          break;
-
-        case CMD_READ:
-          num_pairs =
-              parse_read_delete(jobs_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-          if (num_pairs == 0) {
-            fprintf(stderr, "Invalid command. See HELP for usage\n");
-            continue;
-          }
-
-          if (kvs_read(num_pairs, keys, out_fd)) {
-            fprintf(stderr, "Failed to read pair\n");
-          }
-          break;
-
-        case CMD_DELETE:
-          num_pairs =
-              parse_read_delete(jobs_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-          if (num_pairs == 0) {
-            fprintf(stderr, "Invalid command. See HELP for usage\n");
-            continue;
-          }
-
-          if (kvs_delete(num_pairs, keys, out_fd)) {
-            fprintf(stderr, "Failed to delete pair\n");
-          }
-          break;
-
-        case CMD_SHOW:
-          kvs_show(out_fd);
-          break;
-
-        case CMD_WAIT:
-          if (parse_wait(jobs_fd, &delay, NULL) == -1) {
-            fprintf(stderr, "Invalid command. See HELP for usage\n");
-            continue;
-          }
-
-          if (delay > 0) {
-            write_to_file(out_fd, "Waiting...\n");
-            kvs_wait(delay);
-          }
-          break;
-
-        case CMD_BACKUP:
-
-          /*CHECKING IF MAX LIMIT OF CHILD PROCESS IS REACHED AND WAITING*/
-          safe_mutex_lock(&active_child_mutex);
-          if (active_child == MAX_PROC) {
-            pid_t pid = wait(NULL);
-            if (pid == -1) {
-              fprintf(stderr, "wait failed\n");
-            } else {
-              active_child--; // Decrement active children only if a child
-                              // process exits
-            }
-          }
-          safe_mutex_unlock(&active_child_mutex);
-          /*WAIT ENDED - CREATING CHILD PROCESS*/
-          lock_table();
-          pid_t pid = fork();
-          unlock_table();
-
-          if (pid == -1) {
-            fprintf(stderr, "Failed to fork\n");
-            free(jobs_file_path);
-            exit(1);
-          }
-
-          /*CHILD PROCESS*/
-          if (pid == 0) {
-            /*CREATING .BCK FILE*/
-            char temp_path[MAX_JOB_FILE_NAME_SIZE];
-            snprintf(temp_path, sizeof(temp_path), "%.*s",
-                     (int)(strlen(jobs_file_path) - 4), jobs_file_path);
-
-            char backup_file_path[PATH_MAX];
-            snprintf(backup_file_path, sizeof(backup_file_path), "%s-%d.bck",
-                     temp_path, backups);
-
-            int bck_fd =
-                open(backup_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (bck_fd < 0) {
-              fprintf(stderr, "Failed to create backup file: %s\n",
-                      backup_file_path);
-              exit(1); // Ensure child exits on error
-            }
-            /*OPENED .BCK FILE*/
-            if (kvs_backup(bck_fd)) { // Performing the backup
-              fprintf(stderr, "Failed to perform backup.\n");
-              if (close(bck_fd) == -1) {
-                fprintf(stderr, "Failed to close .bck file\n");
-                return NULL;
-              }
-              free(jobs_file_path);
-              exit(1);
-            }
-
-            free(jobs_file_path);
-            if (close(bck_fd) == -1) {
-              fprintf(stderr, "Failed to close .bck file\n");
-              return NULL;
-            }
-            kvs_terminate();
-            close(jobs_fd);
-            close(out_fd);
-            closedir(dir);
-            exit(0); // Child successfully exits after performing the backup
-          }
-          /*END OF CHILD PROCESS*/
-
-          /*PARENT PROCESS JUMP*/
-          active_child++; // Increment active children count
-          backups++;
-          break;
-
-        case CMD_INVALID:
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          break;
-
-        case CMD_HELP:
-          printf("Available commands:\n"
-                 "  WRITE [(key,value),(key2,value2),...]\n"
-                 "  READ [key,key2,...]\n"
-                 "  DELETE [key,key2,...]\n"
-                 "  SHOW\n"
-                 "  WAIT <delay_ms>\n"
-                 "  BACKUP\n"
-                 "  HELP\n");
-          break;
-
-        case CMD_EMPTY:
-          break;
-
-        case EOC:
-          should_exit = 1;
-          break;
+      job->jobs_file_path = (char *)safe_malloc(len_path);
+      snprintf(job->jobs_file_path, len_path, "%s/%s", dir_path, dp->d_name);
+      return &job->task;
+    }
+  }
+  return NULL;
+}
+
+/// Runs a parsed command of a job.
+/// @param command Command, CMD_INVALID if its arguments were invalid.
+/// @param batch Keys and values of the command.
+/// @param delay Delay of a WAIT.
+/// @return 1 if the command was EOC, 0 otherwise.
+static int execute_command(JobState *job, enum Command command,
+                           CommandBatch *batch, unsigned int delay) {
+  OutputBuffer *output = &job->output;
+  // Any other command has to see the effects of the READs before it
+  if (command != CMD_READ) {
+    flush_reads(&job->run, output);
+  }
+
+  switch (command) {
+  case CMD_WRITE:
+    if (kvs_write(batch->count, batch->keys, batch->values)) {
+      fprintf(stderr, "Failed to write pair\n");
+    }
+    break;
+
+  case CMD_READ:
+    queue_read(&job->run, batch, job->copy_keys);
+    if (job->run.len == READ_RUN_SIZE) {
+      flush_reads(&job->run, output);
+    }
+    // The results are emitted by flush_reads
+    return 0;
+
+  case CMD_DELETE:
+    if (kvs_delete(batch->count, batch->keys, output)) {
+      fprintf(stderr, "Failed to delete pair\n");
+    }
+    break;
+
+  case CMD_SHOW:
+    kvs_show(output);
+    break;
+
+  case CMD_STATS:
+    kvs_stats(output);
+    break;
+
+  case CMD_RANGE:
+  case CMD_PREFIX:
+    if (command == CMD_RANGE
+            ? kvs_range(batch->keys[0], batch->keys[1], output)
+            : kvs_prefix(batch->keys[0], output)) {
+      fprintf(stderr, "Failed to read pairs\n");
+    }
+    break;
+
+  case CMD_WAIT:
+    if (delay > 0) {
+      output_puts(output, "Waiting...\n");
+      // The output before the WAIT is in the file while it waits
+      if (job->pipeline != NULL) {
+        pipeline_drain(job->pipeline);
+      } else {
+        output_flush(output);
+        if (job->ring != NULL) {
+          uring_drain(job->ring);
         }
       }
+      kvs_wait(delay);
+    }
+    break;
 
-      if (close(jobs_fd) == -1) {
-        fprintf(stderr, "Failed to close .jobs file\n");
-        return NULL;
-      }
-      if (close(out_fd) == -1) {
-        fprintf(stderr, "Failed to close .out file\n");
-        return NULL;
-      }
-      free(jobs_file_path);
+  case CMD_BACKUP: {
+    /*CREATING .BCK FILE*/
+    char temp_path[MAX_JOB_FILE_NAME_SIZE];
+    snprintf(temp_path, sizeof(temp_path), "%.*s", job->base_len,
+             job->jobs_file_path);
+
+    char backup_file_path[PATH_MAX];
+    snprintf(backup_file_path, sizeof(backup_file_path), "%s-%d.bck",
+             temp_path, job->backups);
+
+    // Written in the background, the file is renamed once it's done
+    if (kvs_backup(backup_file_path)) {
+      fprintf(stderr, "Failed to perform backup.\n");
     }
+    job->backups++;
+    break;
   }
-  return NULL;
+
+  case CMD_INVALID:
+    fprintf(stderr, "Invalid command. See HELP for usage\n");
+    return 0;
+
+  case CMD_HELP:
+    printf(PARSER_HELP_TEXT);
+    break;
+
+  case CMD_EMPTY:
+    break;
+
+  case EOC:
+    return 1;
+  }
+  output_end_command(output);
+  return 0;
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+/*MAIN TASK FUNCTION*/
+static void run_job(Task *task) {
+  JobTask *job_task = (JobTask *)task;
+  JobState job = {.jobs_file_path = job_task->jobs_file_path, .backups = 1};
+  free(job_task);
+
+  int jobs_fd = open(job.jobs_file_path, O_RDONLY);
+  if (jobs_fd == -1) {
+    fprintf(stderr, "Failed to open .job file\n");
+    free(job.jobs_file_path);
+    return;
+  }
+  // Output and backup files are named after the job file without extension
+  job.base_len = (int)(strrchr(job.jobs_file_path, '.') - job.jobs_file_path);
+  // The file is read into the page cache while the job starts
+  if (uring_jobs && (job.ring = uring_open()) != NULL) {
+    uring_prefetch(job.ring, jobs_fd);
+  }
+  JobReader reader;
+  job_reader_init(&reader, jobs_fd);
+  if (has_extension(job.jobs_file_path, ".jobb") &&
+      job_reader_use_binary(&reader)) {
+    fprintf(stderr, "Invalid binary job file: %s\n", job.jobs_file_path);
+    if (job.ring != NULL) {
+      uring_close(job.ring);
+    }
+    job_reader_close(&reader);
+    close(jobs_fd);
+    free(job.jobs_file_path);
+    return;
+  }
+  job.copy_keys = !reader.mapped;
+  /*JOB FILE OPENED*/
+
+  /*CREATING STRING OUT FILE PATH*/
+  char output_file_path[PATH_MAX];
+  snprintf(output_file_path, sizeof(output_file_path), "%.*s.out",
+           job.base_len, job.jobs_file_path);
+
+  int out_fd = open(output_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0) {
+    fprintf(stderr, "Failed to create output file\n");
+    if (job.ring != NULL) {
+      uring_close(job.ring);
+    }
+    job_reader_close(&reader);
+    close(jobs_fd);
+    free(job.jobs_file_path);
+    return;
+  }
+  output_init(&job.output, out_fd);
+  /*OUT FILE CREATED*/
+
+  // Without the threads of a pipeline, the job simply runs synchronously
+  if (pipeline_jobs) {
+    job.pipeline = pipeline_start(&reader, &job.output);
+  }
+  // A pipeline already writes the output on its own thread
+  if (job.pipeline == NULL && job.ring != NULL) {
+    uring_attach(job.ring, &job.output);
+  }
+
+  if (job.pipeline != NULL) {
+    int should_exit = 0;
+    while (!should_exit) {
+      PipelineCommand *command = pipeline_next(job.pipeline);
+      should_exit = execute_command(&job, command->command, &command->batch,
+                                    command->delay);
+      pipeline_release(job.pipeline, command);
+    }
+    if (pipeline_finish(job.pipeline)) {
+      fprintf(stderr, "Failed to write .out file\n");
+    }
+  } else {
+    // Reused by every command of the job, the parser only sets what it parses
+    CommandBatch batch;
+    int should_exit = 0;
+    while (!should_exit) {
+      unsigned int delay;
+      enum Command command =
+          parse_command(&reader, get_next(&reader), &batch, &delay);
+      should_exit = execute_command(&job, command, &batch, delay);
+    }
+    output_flush(&job.output);
+  }
+  if (job.ring != NULL && uring_close(job.ring)) {
+    fprintf(stderr, "Failed to write .out file\n");
+  }
+
+  job_reader_close(&reader);
+  if (close(jobs_fd) == -1) {
+    fprintf(stderr, "Failed to close .jobs file\n");
+  }
+  if (close(out_fd) == -1) {
+    fprintf(stderr, "Failed to close .out file\n");
+  }
+  free(job.run.tasks);
+  free(job.jobs_file_path);
+}
+
+/// Prints the command line usage of the program.
+/// @param program Name the program was invoked with.
+static void print_usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-r] [-i] [-l <backup>] [-s <address>] [-w <log>] "
+          "[-f <sync>] [-t] [-n <shards>] [-p] [-u] [-o] <dir_path> "
+          "<MAX_PROC> <MAX_THREADS>\n"
+          "  -r  Lock-free READ commands (epoch-based reclamation)\n"
+          "  -i  Incremental backups, each one a delta of the previous\n"
+          "  -l  Load a full or delta backup before running the jobs, may be "
+          "repeated\n"
+          "  -s  Serve clients on unix:<path>, <host>:<port> or <port> after "
+          "running the jobs, until SIGINT or SIGTERM\n"
+          "  -w  Log WRITE and DELETE to a write-ahead log, recovered first\n"
+          "  -f  Sync the log on every commit (default), periodic or none\n"
+          "  -t  Print latency and lock statistics to stderr at exit\n"
+          "  -n  Split the keys among shards, each owned by a pinned thread\n"
+          "  -p  Pipeline each job: parse ahead and write the output on other "
+          "threads\n"
+          "  -u  Write output and backups through io_uring, if the kernel "
+          "can\n"
+          "  -o  Keep the keys in order for RANGE and PREFIX, at a cost to "
+          "WRITE and DELETE\n",
+          program);
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <dir_path> <MAX_PROC> <MAX_THREADS>\n", argv[0]);
-    return 1;
+  KvsOptions options = {0};
+  int opt;
+  // Backups to load, in order, each on top of the previous ones
+  const char **restore_paths = safe_malloc((size_t)argc * sizeof(char *));
+  size_t num_restores = 0;
+  const char *server_address = NULL;
+  int print_stats = 0;
+  options.wal_sync = WAL_SYNC_COMMIT;
+  while ((opt = getopt(argc, argv, "ril:s:w:f:tn:puo")) != -1) {
+    switch (opt) {
+    case 'r':
+      options.lockfree_reads = 1;
+      break;
+    case 'i':
+      options.incremental_backups = 1;
+      break;
+    case 'l':
+      restore_paths[num_restores++] = optarg;
+      break;
+    case 's':
+      server_address = optarg;
+      break;
+    case 'w':
+      options.wal_path = optarg;
+      break;
+    case 'f':
+      if (wal_parse_sync(optarg, &options.wal_sync)) {
+        fprintf(stderr, "Invalid sync policy: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 't':
+      print_stats = 1;
+      break;
+    case 'n':
+      if (sscanf(optarg, "%zu", &options.shards) != 1 ||
+          options.shards == 0) {
+        fprintf(stderr, "Invalid number of shards: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'p':
+      pipeline_jobs = 1;
+      break;
+    case 'u':
+      options.io_uring = 1;
+      break;
+    case 'o':
+      options.ordered_index = 1;
+      break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
   }
 
-  if (kvs_init()) {
-    fprintf(stderr, "Failed to initialize KVS\n");
+  if (argc - optind != 3) {
+    print_usage(argv[0]);
     return 1;
   }
+  // The state of the log is the one of the table, a backup loaded on top of
+  // it would never be logged
+  if (num_restores > 0 && options.wal_path != NULL) {
+    fprintf(stderr, "A backup can't be loaded into a write-ahead log\n");
+    return 1;
+  }
+  // Shards only hold the current pairs, neither what they replaced nor what
+  // was deleted
+  if (options.shards > 0 &&
+      (num_restores > 0 || options.wal_path != NULL ||
+       options.incremental_backups)) {
+    fprintf(stderr, "-n can't be used with -l, -w or -i\n");
+    return 1;
+  }
+  if (options.io_uring && !uring_supported()) {
+    fprintf(stderr, "io_uring isn't available, using blocking I/O\n");
+    options.io_uring = 0;
+  }
+  uring_jobs = options.io_uring;
+  char **params = argv + optind;
 
-  char *dir_path = argv[1];
+  dir_path = params[0];
   dir = opendir(dir_path);
   if (dir == NULL) {
     fprintf(stderr, "Failed to open directory\n");
     return 1;
   }
 
-  if (sscanf(argv[2], "%d", &MAX_PROC) != 1) {
+  int MAX_PROC = 0;
+  if (sscanf(params[1], "%d", &MAX_PROC) != 1) {
     fprintf(stderr, "Invalid number provided for MAX_PROC\n");
     return 1;
   }
+  options.max_backups = MAX_PROC > 0 ? (size_t)MAX_PROC : 1;
 
   int MAX_THREADS = 0;
-  if (sscanf(argv[3], "%d", &MAX_THREADS) != 1) {
+  if (sscanf(params[2], "%d", &MAX_THREADS) != 1) {
     fprintf(stderr, "Invalid number provided for MAX_THREADS\n");
     return 1;
   }
@@ -280,39 +500,40 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  pthread_t threads[MAX_THREADS];
-  int thread_created[MAX_THREADS];
-  ThreadArgs args = {argv[1]};
-  for (int i = 0; i < MAX_THREADS; i++) {
-    thread_created[i] = 0;
+  if (kvs_init(&options)) {
+    fprintf(stderr, "Failed to initialize KVS\n");
+    return 1;
   }
-
-  for (int i = 0; i < MAX_THREADS; i++) {
-    if (pthread_create(&threads[i], NULL, thread_operation, (void *)&args) !=
-        0) {
-      fprintf(stderr, "Error creating thread number: %d\n", i);
-    } else {
-      thread_created[i] = 1;
+  for (size_t i = 0; i < num_restores; i++) {
+    if (kvs_restore(restore_paths[i])) {
+      fprintf(stderr, "Failed to load backup: %s\n", restore_paths[i]);
+      return 1;
     }
   }
-  for (int i = 0; i < MAX_THREADS; i++) {
-    if (thread_created[i]) {
-      if (pthread_join(threads[i], NULL) != 0) {
-        fprintf(stderr, "Error joining thread number: %d\n", i);
-      }
-    }
+  free(restore_paths);
+
+  if (scheduler_run(MAX_THREADS, next_job)) {
+    fprintf(stderr, "Failed to start worker threads\n");
   }
 
   closedir(dir);
-  kvs_terminate();
+
+  // The server runs MAX_THREADS event loops, and writes its backups to the
+  // jobs directory
+  if (server_address != NULL &&
+      server_run(server_address, MAX_THREADS, dir_path)) {
+    fprintf(stderr, "Failed to start server\n");
+  }
 
   /*WAITING FOR ALL THE BACKUPS TO FINISH*/
-  while (active_child > 0) {
-    if (wait(NULL) > 0) {
-      pthread_mutex_lock(&active_child_mutex);
-      active_child--;
-      pthread_mutex_unlock(&active_child_mutex);
-    }
+  kvs_wait_backup();
+  if (print_stats) {
+    OutputBuffer *stats = safe_malloc(sizeof(OutputBuffer));
+    output_init(stats, STDERR_FILENO);
+    kvs_stats(stats);
+    output_flush(stats);
+    free(stats);
   }
+  kvs_terminate();
   return 0;
 }
\ No newline at end of file
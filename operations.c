@@ -1,4 +1,8 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,12 +10,61 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "backup.h"
 #include "constants.h"
+#include "epoch.h"
 #include "kvs.h"
 #include "operations.h"
+#include "pair_sort.h"
+#include "shard.h"
+#include "slab.h"
+#include "stats.h"
+#include "uring.h"
+#include "wal.h"
 
 static struct HashTable *kvs_table = NULL;
 
+// In sharded mode WRITE, READ and DELETE go to the shards instead, and the
+// other commands scan them; kvs_table stays empty
+static ShardSet *kvs_shards = NULL;
+
+// Backups being written by background threads, at most max_backups at once
+static pthread_mutex_t backup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backup_done = PTHREAD_COND_INITIALIZER;
+static size_t active_backups = 0;
+// With a write-ahead log, backups record their checkpoints in the order they
+// were taken: a checkpoint supersedes the ones before it, and a delta needs
+// its base on disk. The first is only changed with the table locked, the
+// second with backup_lock held.
+static uint64_t backups_taken = 0;
+static uint64_t backups_checkpointed = 0;
+static size_t max_backups = 1;
+
+// Maximum number of threads loading a backup, see load_backup
+static size_t load_threads = 0;
+
+// Whether WRITE and DELETE batches go to the write-ahead log
+static int wal_enabled = 0;
+
+// With incremental backups, every backup but the first is a delta of the
+// previous one. Both are only changed with the table locked.
+static int incremental_backups = 0;
+// Backups are written through a ring, see uring.h
+static int uring_backups = 0;
+static char *last_backup = NULL; // Name of the previous backup file
+static uint64_t last_backup_version = 0;
+
+// Arguments of a background backup
+typedef struct BackupTask {
+  Snapshot *snapshot; // NULL in sharded mode
+  PairSort *pairs;    // Copied from the shards, in sharded mode
+  int fd;     // Of the temporary file, see backup_temp_path
+  char *base; // Name of the backup this one is a delta of, NULL if full
+  char *path; // Path of the backup, which the file is renamed to once written
+  uint64_t wal_position; // End of the write-ahead log when it was taken
+  uint64_t sequence;     // Number of backups taken before it
+} BackupTask;
+
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
 /// @return Timespec with the given delay.
@@ -21,20 +74,16 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
 
 /*AUXILIARY FUNCTIONS*/
 
-int write_to_file(int out_fd, const char *buffer) {
-  size_t total_written = 0;
-  size_t len = strlen(buffer);
-  while (total_written <
-         len) { // In case it doesn't write the entire buffer in one call
-    ssize_t num_written =
-        write(out_fd, buffer + total_written, len - total_written);
-    if (num_written == -1) {
-      perror("Failed to write to file");
-      return 1;
-    }
-    total_written += (size_t)num_written;
+/// Tells which of the locks of the table a lock is.
+/// @return Metric the waits for the lock are recorded in.
+static enum StatsMetric lock_metric(pthread_rwlock_t *rwlock) {
+  if (kvs_table != NULL && rwlock == &kvs_table->global_lock) {
+    return STATS_GLOBAL_LOCK;
   }
-  return 0;
+  if (kvs_table != NULL && rwlock == &kvs_table->ordered.lock) {
+    return STATS_INDEX_LOCK;
+  }
+  return STATS_BUCKET_LOCK;
 }
 
 /*TABLE LOCK SETTERS*/
@@ -66,14 +115,29 @@ void safe_mutex_unlock(pthread_mutex_t *mutex) {
   }
 }
 void safe_rdlock(pthread_rwlock_t *rwlock) {
-  int result = pthread_rwlock_rdlock(rwlock);
+  // Only a lock that is taken already costs reading the clock
+  uint64_t wait_ns = 0;
+  int result = pthread_rwlock_tryrdlock(rwlock);
+  if (result != 0) {
+    uint64_t start = stats_now();
+    result = pthread_rwlock_rdlock(rwlock);
+    wait_ns = stats_now() - start;
+  }
+  stats_record(lock_metric(rwlock), wait_ns);
   if (result != 0) {
     fprintf(stderr, "Failed to read lock\n");
     exit(1);
   }
 }
 void safe_wrlock(pthread_rwlock_t *rwlock) {
-  int result = pthread_rwlock_wrlock(rwlock);
+  uint64_t wait_ns = 0;
+  int result = pthread_rwlock_trywrlock(rwlock);
+  if (result != 0) {
+    uint64_t start = stats_now();
+    result = pthread_rwlock_wrlock(rwlock);
+    wait_ns = stats_now() - start;
+  }
+  stats_record(lock_metric(rwlock), wait_ns);
   if (result != 0) {
     fprintf(stderr, "Failed to write lock\n");
     exit(1);
@@ -87,65 +151,582 @@ void safe_rdwrunlock(pthread_rwlock_t *rwlock) {
   }
 }
 
-int *create_alphabetical_index(char keys[][MAX_STRING_SIZE], size_t num_pairs) {
+int compare_keys(StringView first, StringView second) {
+  size_t len = first.len < second.len ? first.len : second.len;
+  int result = strncasecmp(first.data, second.data, len);
+  if (result != 0) {
+    return result;
+  }
+  return (first.len > second.len) - (first.len < second.len);
+}
 
-  int *sorted_indexes = safe_malloc(num_pairs * sizeof(int));
+int compare_keys_exact(StringView first, StringView second) {
+  int result = compare_keys(first, second);
+  // Keys equal but for their case have the same length
+  return result != 0 ? result : memcmp(first.data, second.data, first.len);
+}
 
-  // Initialize the index array with original indexes
+uint64_t key_prefix(StringView key) {
+  uint64_t prefix = 0;
+  for (size_t i = 0; i < sizeof(prefix); i++) {
+    unsigned char c = 0;
+    if (i < key.len) {
+      c = (unsigned char)tolower((unsigned char)key.data[i]);
+    }
+    prefix = prefix << 8 | c;
+  }
+  return prefix;
+}
+
+void create_alphabetical_index(const StringView *keys, size_t num_pairs,
+                               int *sorted_indexes) {
+  uint64_t prefixes[MAX_WRITE_SIZE];
+  int scratch[MAX_WRITE_SIZE];
   for (size_t i = 0; i < num_pairs; i++) {
     sorted_indexes[i] = (int)i;
+    prefixes[i] = key_prefix(keys[i]);
+  }
+
+  // Bottom-up merge sort. Most comparisons are settled by the prefixes, and
+  // equal keys keep their order in the command.
+  int *from = sorted_indexes;
+  int *to = scratch;
+  for (size_t width = 1; width < num_pairs; width *= 2) {
+    for (size_t low = 0; low < num_pairs; low += 2 * width) {
+      size_t mid = low + width < num_pairs ? low + width : num_pairs;
+      size_t high = low + 2 * width < num_pairs ? low + 2 * width : num_pairs;
+      size_t left = low, right = mid, out = low;
+      while (left < mid && right < high) {
+        int first = from[left];
+        int second = from[right];
+        int later = prefixes[second] < prefixes[first] ||
+                    (prefixes[second] == prefixes[first] &&
+                     compare_keys(keys[second], keys[first]) < 0);
+        to[out++] = later ? from[right++] : from[left++];
+      }
+      while (left < mid) {
+        to[out++] = from[left++];
+      }
+      while (right < high) {
+        to[out++] = from[right++];
+      }
+    }
+    int *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != sorted_indexes) {
+    memcpy(sorted_indexes, from, num_pairs * sizeof(int));
+  }
+}
+
+/// Sorts bucket indexes in ascending order with a radix sort, one byte per
+/// pass and only as many passes as the largest index of the table needs.
+/// Scratch space lives on the stack, so it never touches the heap.
+static void sort_buckets(size_t *buckets, size_t num_buckets) {
+  size_t scratch[MAX_WRITE_SIZE];
+  size_t *from = buckets;
+  size_t *to = scratch;
+  size_t max_bucket = kvs_table->size - 1;
+
+  for (unsigned shift = 0; shift < 8 * sizeof(size_t) && max_bucket >> shift;
+       shift += 8) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < num_buckets; i++) {
+      counts[(from[i] >> shift) & 0xff]++;
+    }
+    size_t offset = 0;
+    for (size_t digit = 0; digit < 256; digit++) {
+      size_t count = counts[digit];
+      counts[digit] = offset;
+      offset += count;
+    }
+    for (size_t i = 0; i < num_buckets; i++) {
+      to[counts[(from[i] >> shift) & 0xff]++] = from[i];
+    }
+    size_t *swap = from;
+    from = to;
+    to = swap;
   }
+  if (from != buckets) {
+    memcpy(buckets, from, num_buckets * sizeof(size_t));
+  }
+}
 
-  // Sort indexes based on key values using selection sort
-  for (size_t i = 0; i < num_pairs - 1; i++) {
-    size_t min_idx = i;
+/// Finds the distinct buckets that hold the given keys, in ascending order.
+/// Buckets are always locked in this order, so batches that touch the same
+/// buckets can't deadlock on each other.
+/// @param keys Array of key strings.
+/// @param num_pairs Number of keys in the array.
+/// @param buckets Output array with room for num_pairs bucket indexes.
+/// @return Number of distinct buckets written to the output array.
+static size_t collect_buckets(const StringView *keys, size_t num_pairs,
+                              size_t *buckets) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    buckets[i] = bucket_index(kvs_table, hash(keys[i].data, keys[i].len));
+  }
+  sort_buckets(buckets, num_pairs);
 
-    // Find the index of the smallest key in the remaining unsorted portion
-    for (size_t j = i + 1; j < num_pairs; j++) {
-      if (strcasecmp(keys[sorted_indexes[j]], keys[sorted_indexes[min_idx]]) <
-          0) {
-        min_idx = j;
+  size_t num_buckets = 0;
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (num_buckets == 0 || buckets[num_buckets - 1] != buckets[i]) {
+      buckets[num_buckets++] = buckets[i];
+    }
+  }
+  return num_buckets;
+}
+
+/// Locks the given buckets, in the order they are given.
+/// @param buckets Bucket indexes, as returned by collect_buckets.
+/// @param num_buckets Number of buckets to lock.
+/// @param write_mode 1 to lock the buckets for writing, 0 for reading.
+static void lock_buckets(const size_t *buckets, size_t num_buckets,
+                         int write_mode) {
+  for (size_t i = 0; i < num_buckets; i++) {
+    if (write_mode) {
+      safe_wrlock(&kvs_table->table[buckets[i]].list_lock);
+    } else {
+      safe_rdlock(&kvs_table->table[buckets[i]].list_lock);
+    }
+  }
+}
+
+/// Unlocks the given buckets, in reverse locking order.
+/// @param buckets Bucket indexes, as returned by collect_buckets.
+/// @param num_buckets Number of buckets to unlock.
+static void unlock_buckets(const size_t *buckets, size_t num_buckets) {
+  for (size_t i = num_buckets; i > 0; i--) {
+    safe_rdwrunlock(&kvs_table->table[buckets[i - 1]].list_lock);
+  }
+}
+
+/// Writes a pair in the format "(key, value)", followed by a newline.
+/// @return 0 on success, 1 if writing to the file failed.
+static int print_pair(OutputBuffer *out, const char *key, const char *value) {
+  if (output_puts(out, "(") || output_puts(out, key) ||
+      output_puts(out, ", ") || output_puts(out, value) ||
+      output_puts(out, ")\n")) {
+    fprintf(stderr, "Error writing to file\n");
+    return 1;
+  }
+  return 0;
+}
+
+/// Visitor writing every pair it is given with print_pair.
+/// @param arg Output buffer the pairs are written to.
+static int visit_print(void *arg, const char *key, const char *value) {
+  return print_pair(arg, key, value);
+}
+
+/// Visitor adding every pair it is given to a PairSort.
+/// @param arg Sort the pairs are added to.
+static int visit_sort(void *arg, const char *key, const char *value) {
+  return pair_sort_add(arg, key, value);
+}
+
+// Checks whether a key of the ordered index is still within the keys asked
+// for, which start at the first key the index is scanned from
+typedef int (*KeyBound)(StringView key, StringView bound);
+
+static int up_to_bound(StringView key, StringView high) {
+  return compare_keys_exact(key, high) <= 0;
+}
+
+static int has_prefix(StringView key, StringView prefix) {
+  return key.len >= prefix.len &&
+         strncasecmp(key.data, prefix.data, prefix.len) == 0;
+}
+
+/// Visitor counting the pairs it is given.
+/// @param arg Counter of the pairs.
+static int visit_count(void *arg, const char *key, const char *value) {
+  (void)key;
+  (void)value;
+  (*(size_t *)arg)++;
+  return 0;
+}
+
+// Pairs of the shards between a start and a bound, see print_sharded
+typedef struct BoundedSort {
+  PairSort *sort;
+  StringView start;
+  KeyBound in_bound;
+  StringView bound;
+} BoundedSort;
+
+/// Visitor adding the pairs within the bounds to a PairSort.
+/// @param arg BoundedSort the pairs are added to.
+static int visit_bounded(void *arg, const char *key, const char *value) {
+  BoundedSort *bounded = arg;
+  StringView view = {key, strlen(key)};
+  if (compare_keys_exact(view, bounded->start) < 0 ||
+      !bounded->in_bound(view, bounded->bound)) {
+    return 0;
+  }
+  return pair_sort_add(bounded->sort, key, value);
+}
+
+/// Writes the pairs print_ordered would, taken from the shards. Every shard
+/// is scanned, as they keep no order.
+/// @return 0 on success, 1 if writing to the file failed.
+static int print_sharded(StringView start, KeyBound in_bound,
+                         StringView bound, OutputBuffer *out) {
+  BoundedSort bounded = {pair_sort_create(), start, in_bound, bound};
+  int result = shard_scan(kvs_shards, visit_bounded, &bounded) ||
+               pair_sort_finish(bounded.sort, visit_print, out);
+  pair_sort_free(bounded.sort);
+  return result;
+}
+
+/// Writes the result of reading a key, KVSERROR if it wasn't found.
+static void print_read(OutputBuffer *out, StringView key, const char *value) {
+  output_puts(out, "(");
+  output_write(out, key.data, key.len);
+  if (value == NULL) {
+    output_puts(out, ",KVSERROR)");
+  } else {
+    output_puts(out, ",");
+    output_puts(out, value);
+    output_puts(out, ")");
+  }
+}
+
+/// Writes the pairs of the given keys that are still in the table, in the
+/// order given, locking their buckets like a READ does.
+/// @return 0 on success, 1 if writing to the file failed.
+static int print_keys(const StringView *keys, size_t num_keys,
+                      OutputBuffer *out) {
+  size_t buckets[MAX_WRITE_SIZE];
+  size_t num_buckets = 0;
+  if (kvs_table->lockfree_reads) {
+    epoch_enter();
+  } else {
+    safe_rdlock(&kvs_table->global_lock);
+    num_buckets = collect_buckets(keys, num_keys, buckets);
+    lock_buckets(buckets, num_buckets, 0);
+  }
+
+  int result = 0;
+  for (size_t i = 0; i < num_keys && !result; i++) {
+    // Deleted since the index was scanned
+    const char *value = lookup_pair(kvs_table, keys[i]);
+    if (value != NULL) {
+      result = print_pair(out, keys[i].data, value);
+    }
+  }
+
+  if (kvs_table->lockfree_reads) {
+    epoch_exit();
+  } else {
+    unlock_buckets(buckets, num_buckets);
+    safe_rdwrunlock(&kvs_table->global_lock);
+  }
+  return result;
+}
+
+/// Appends a pair to a buffer as "key\0value\0", growing it if needed.
+/// @param buf Buffer, NULL until the first pair.
+/// @param cap Size of the buffer.
+/// @param len Bytes of the buffer in use.
+/// @return Bytes of the buffer in use with the pair.
+static size_t copy_pair(char **buf, size_t *cap, size_t len, const char *key,
+                        const char *value) {
+  size_t key_size = strlen(key) + 1;
+  size_t value_size = strlen(value) + 1;
+  if (len + key_size + value_size > *cap) {
+    size_t capacity = *cap > 0 ? 2 * *cap : 4096;
+    while (capacity < len + key_size + value_size) {
+      capacity *= 2;
+    }
+    char *grown = realloc(*buf, capacity);
+    if (grown == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(1);
+    }
+    *buf = grown;
+    *cap = capacity;
+  }
+  memcpy(*buf + len, key, key_size);
+  memcpy(*buf + len + key_size, value, value_size);
+  return len + key_size + value_size;
+}
+
+/// Visits the pairs of a snapshot, one bucket at a time. Only the bucket
+/// being read is locked, so writers are never blocked for long. Pairs written
+/// before the base version of the snapshot are left out.
+/// @param snapshot Snapshot to be read.
+/// @param visit Called for every pair, once its bucket is unlocked again.
+/// @param arg Argument passed to visit.
+/// @return 0 on success, 1 if visit stopped.
+static int scan_snapshot(Snapshot *snapshot, PairVisitor visit, void *arg) {
+  // The pairs of a bucket are copied out, so that visit may spill or write
+  // them out without holding up the writers of the bucket
+  char *pairs = NULL;
+  size_t cap = 0;
+  int result = 0;
+  for (size_t i = 0; i < snapshot->size && !result; i++) {
+    List *list = &kvs_table->table[i];
+    size_t len = 0;
+    safe_rdlock(&list->list_lock);
+    // Pairs written since the snapshot were saved aside if they replaced
+    // older ones
+    List *chains[2];
+    size_t num_chains = bucket_chains(kvs_table, i, chains);
+    for (size_t c = 0; c < num_chains; c++) {
+      for (KeyNode *keyNode = chains[c]->head; keyNode != NULL;
+           keyNode = keyNode->next) {
+        if (keyNode->version < snapshot->version &&
+            keyNode->version >= snapshot->base_version) {
+          len = copy_pair(&pairs, &cap, len, keyNode->key, keyNode->value);
+        }
       }
     }
+    for (SnapshotEntry *entry = snapshot->saved[i]; entry != NULL;
+         entry = entry->next) {
+      if (entry->version >= snapshot->base_version) {
+        len = copy_pair(&pairs, &cap, len, entry->key, entry->value);
+      }
+    }
+    snapshot_bucket_done(snapshot, i);
+    safe_rdwrunlock(&list->list_lock);
 
-    // Swap the found minimum index with the current index
-    if (min_idx != i) {
-      int temp = sorted_indexes[i];
-      sorted_indexes[i] = sorted_indexes[min_idx];
-      sorted_indexes[min_idx] = temp;
+    for (size_t pos = 0; pos < len && !result;) {
+      const char *key = pairs + pos;
+      const char *value = key + strlen(key) + 1;
+      pos = (size_t)(value - pairs) + strlen(value) + 1;
+      result = visit(arg, key, value);
     }
   }
+  free(pairs);
+  return result;
+}
 
-  return sorted_indexes;
+/// Writes the pairs print_ordered would, taken from a snapshot of the table
+/// like SHOW, for tables that keep no ordered index.
+/// @return 0 on success, 1 if writing to the file failed.
+static int print_scanned(StringView start, KeyBound in_bound,
+                         StringView bound, OutputBuffer *out) {
+  lock_table();
+  Snapshot *snapshot = create_snapshot(kvs_table);
+  unlock_table();
+
+  BoundedSort bounded = {pair_sort_create(), start, in_bound, bound};
+  int result = scan_snapshot(snapshot, visit_bounded, &bounded);
+  lock_table();
+  release_snapshot(kvs_table, snapshot);
+  unlock_table();
+  result = result || pair_sort_finish(bounded.sort, visit_print, out);
+  pair_sort_free(bounded.sort);
+  return result;
 }
 
-int printTable(int fd) {
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i].head;
-    while (keyNode != NULL) {
-      char buf[BUF_SIZE];
-      snprintf(buf, sizeof(buf), "(%s, %s)\n", keyNode->key, keyNode->value);
-      if (write_to_file(fd, buf)) {
-        fprintf(stderr, "Error writing to file\n");
-        safe_rdwrunlock(&kvs_table->global_lock);
-        return 1;
+/// Writes the pairs whose keys follow start in the ordered index, until the
+/// first key out of the bound. Keys are copied out of the index and read from
+/// the table MAX_WRITE_SIZE at a time, so neither is locked for long.
+/// @param start First key that may be written.
+/// @param in_bound Tells whether a key is still to be written.
+/// @param bound Argument of in_bound.
+/// @param out Output buffer to which the pairs will be written.
+/// @return 0 on success, 1 if writing to the file failed.
+static int print_ordered(StringView start, KeyBound in_bound,
+                         StringView bound, OutputBuffer *out) {
+  if (kvs_shards != NULL) {
+    return print_sharded(start, in_bound, bound, out);
+  }
+  if (!kvs_table->index_keys) {
+    return print_scanned(start, in_bound, bound, out);
+  }
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  StringView views[MAX_WRITE_SIZE];
+  char last[MAX_STRING_SIZE];
+  int inclusive = 1;
+  while (1) {
+    size_t num_keys = index_scan(&kvs_table->ordered, start, inclusive, keys,
+                                 MAX_WRITE_SIZE);
+    size_t count = 0;
+    for (; count < num_keys; count++) {
+      views[count] = (StringView){keys[count], strlen(keys[count])};
+      if (!in_bound(views[count], bound)) {
+        break;
       }
-      keyNode = keyNode->next; // Move to the next node
     }
+    if (count > 0 && print_keys(views, count, out)) {
+      return 1;
+    }
+    if (count < MAX_WRITE_SIZE) {
+      return 0; // Out of the bound, or the index ended
+    }
+
+    // Go on after the last key, which may be gone from the index by now
+    memcpy(last, keys[count - 1], views[count - 1].len + 1);
+    start = (StringView){last, views[count - 1].len};
+    inclusive = 0;
   }
-  return 0;
+}
+
+/// Writes the keys deleted between the base of a snapshot and the snapshot.
+/// @param snapshot Snapshot being written.
+/// @param out Output buffer to which the keys will be written.
+/// @return 0 on success, 1 if writing to the file failed.
+static int print_deleted(Snapshot *snapshot, OutputBuffer *out) {
+  int result = 0;
+  safe_mutex_lock(&kvs_table->deleted_lock);
+  for (DeletedKey *deleted = kvs_table->deleted;
+       deleted != NULL && deleted->version >= snapshot->base_version &&
+       !result;
+       deleted = deleted->next) {
+    if (deleted->version < snapshot->version) {
+      result = output_puts(out, "(") || output_puts(out, deleted->key) ||
+               output_puts(out, ")\n");
+    }
+  }
+  safe_mutex_unlock(&kvs_table->deleted_lock);
+  if (result) {
+    fprintf(stderr, "Error writing to file\n");
+  }
+  return result;
+}
+
+/// Path of the file a backup is written to, renamed to the backup once it is
+/// complete. A crash never leaves a truncated file at the path of a backup,
+/// which a checkpoint of the write-ahead log may name.
+static void backup_temp_path(char *temp_path, const char *path) {
+  snprintf(temp_path, PATH_MAX, "%s.tmp", path);
+}
+
+/// Writes a snapshot to its backup file, then releases it.
+/// @param task Backup to be written, freed by the function.
+/// @return 0 if the backup was successful, 1 otherwise.
+static int write_backup(BackupTask *task) {
+  uint64_t start = stats_now();
+  OutputBuffer out;
+  output_init(&out, task->fd);
+  // Without a ring, the backup is written with blocking writes
+  Uring *ring = uring_backups ? uring_open() : NULL;
+  if (ring != NULL) {
+    uring_attach(ring, &out);
+  }
+  int result = 0;
+  if (task->base != NULL) {
+    result = output_puts(&out, BACKUP_DELTA_HEADER) ||
+             output_puts(&out, task->base) || output_puts(&out, "\n") ||
+             print_deleted(task->snapshot, &out);
+  }
+  if (task->pairs != NULL) {
+    result = result || pair_sort_finish(task->pairs, visit_print, &out);
+    pair_sort_free(task->pairs);
+  } else {
+    result = result || scan_snapshot(task->snapshot, visit_print, &out);
+  }
+  result = result || output_flush(&out);
+  if (ring != NULL) {
+    result = uring_close(ring) || result;
+  }
+  // The log may only skip what the backup holds once it is on disk
+  if (wal_enabled && !result && fsync(task->fd) != 0) {
+    fprintf(stderr, "Failed to sync .bck file\n");
+    result = 1;
+  }
+  if (close(task->fd) == -1) {
+    fprintf(stderr, "Failed to close .bck file\n");
+    result = 1;
+  }
+  char temp_path[PATH_MAX];
+  backup_temp_path(temp_path, task->path);
+  if (result) {
+    unlink(temp_path); // The previous file of the backup is kept
+  } else if (rename(temp_path, task->path) != 0) {
+    fprintf(stderr, "Failed to rename .bck file: %s\n", task->path);
+    unlink(temp_path);
+    result = 1;
+  } else if (wal_enabled && sync_parent_dir(task->path)) {
+    fprintf(stderr, "Failed to sync the directory of %s\n", task->path);
+    result = 1;
+  }
+  if (wal_enabled) {
+    safe_mutex_lock(&backup_lock);
+    while (backups_checkpointed != task->sequence) {
+      pthread_cond_wait(&backup_done, &backup_lock);
+    }
+    if (!result) {
+      wal_checkpoint(task->path, task->wal_position);
+    }
+    backups_checkpointed++;
+    pthread_cond_broadcast(&backup_done);
+    safe_mutex_unlock(&backup_lock);
+  }
+
+  lock_table();
+  if (task->snapshot != NULL) {
+    release_snapshot(kvs_table, task->snapshot);
+  }
+  if (incremental_backups) {
+    // Deletions are only needed by the deltas still being written and the
+    // next one
+    uint64_t oldest = last_backup_version;
+    for (Snapshot *snapshot = kvs_table->snapshots; snapshot != NULL;
+         snapshot = snapshot->next) {
+      if (snapshot->base_version < oldest) {
+        oldest = snapshot->base_version;
+      }
+    }
+    prune_deleted(kvs_table, oldest);
+  }
+  unlock_table();
+  free(task->base);
+  free(task->path);
+  free(task);
+  stats_record(STATS_BACKUP_WRITE, stats_now() - start);
+
+  safe_mutex_lock(&backup_lock);
+  active_backups--;
+  pthread_cond_broadcast(&backup_done);
+  safe_mutex_unlock(&backup_lock);
+  return result;
+}
+
+static void *backup_thread(void *arg) {
+  if (write_backup(arg)) {
+    fprintf(stderr, "Failed to perform backup.\n");
+  }
+  return NULL;
 }
 
 /*END OF AUXILIARY FUNCTIONS*/
 
-int kvs_init() {
+int kvs_init(const KvsOptions *options) {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
     return 1;
   }
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  kvs_table = create_hash_table(options->lockfree_reads);
+  if (kvs_table == NULL) {
+    return 1;
+  }
+  max_backups = options->max_backups > 0 ? options->max_backups : 1;
+  incremental_backups = options->incremental_backups;
+  uring_backups = options->io_uring;
+  kvs_table->log_deletes = incremental_backups;
+  kvs_table->index_keys = options->ordered_index;
+  load_threads = options->load_threads;
+  wal_enabled = options->wal_path != NULL;
+  backups_taken = 0;
+  backups_checkpointed = 0;
+  if (wal_enabled && wal_open(kvs_table, options->wal_path, options->wal_sync,
+                              load_threads)) {
+    free_table(kvs_table);
+    kvs_table = NULL;
+    return 1;
+  }
+  if (options->shards > 0 &&
+      (kvs_shards = shard_start(options->shards)) == NULL) {
+    wal_close();
+    free_table(kvs_table);
+    kvs_table = NULL;
+    return 1;
+  }
+  return 0;
 }
 
 int kvs_terminate() {
@@ -153,169 +734,347 @@ int kvs_terminate() {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  if (kvs_shards != NULL) {
+    shard_stop(kvs_shards);
+    kvs_shards = NULL;
+  }
+  wal_close();
   free_table(kvs_table);
+  epoch_terminate();
+  slab_terminate();
+  kvs_table = NULL;
+  free(last_backup);
+  last_backup = NULL;
+  last_backup_version = 0;
   return 0;
 }
 
-// Modified write function to work with sorted indexes
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
+// Writes the pairs, in alphabetical order, with their buckets locked
+int kvs_write(size_t num_pairs, const StringView *keys,
+              const StringView *values) {
 
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  // Create sorted index array
-  int *sorted_indexes = create_alphabetical_index(keys, num_pairs);
-  if (sorted_indexes == NULL) {
-    fprintf(stderr, "Failed to create sorted indexes\n");
-    return 1;
+  uint64_t start = stats_now();
+  if (kvs_shards != NULL) {
+    shard_write(kvs_shards, num_pairs, keys, values);
+    stats_record(STATS_WRITE, stats_now() - start);
+    return 0;
   }
+  int sorted_indexes[MAX_WRITE_SIZE];
+  create_alphabetical_index(keys, num_pairs, sorted_indexes);
+
+  // Writers only share the global lock, the bucket locks keep them apart
+  safe_rdlock(&kvs_table->global_lock);
+  hash_table_grow_step(kvs_table, num_pairs);
 
-  int locked[TABLE_SIZE] = {0};
-  safe_wrlock(&kvs_table->global_lock);
+  size_t buckets[MAX_WRITE_SIZE];
+  size_t num_buckets = collect_buckets(keys, num_pairs, buckets);
+  lock_buckets(buckets, num_buckets, 1);
 
-  // Perform write operations in alphabetical order
+  // Pairs are written in the order the write-ahead log records them. The
+  // sort is stable, so a key repeated in the batch ends up with its last
+  // value both here and when the log is replayed.
   for (size_t i = 0; i < num_pairs; i++) {
     int original_index = sorted_indexes[i];
-    int hashed_index = hash(keys[original_index]);
-    if (!locked[hashed_index]) {
-      locked[hashed_index] = 1;
-      safe_wrlock(&kvs_table->table[hashed_index].list_lock);
-    }
-
     if (write_pair(kvs_table, keys[original_index], values[original_index]) !=
         0) {
-      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[original_index],
-              values[original_index]);
-    }
-  }
-
-  // Unlock all acquired read locks
-  for (int i = TABLE_SIZE - 1; i >= 0; i--) {
-    if (locked[i]) {
-      safe_rdwrunlock(&kvs_table->table[i].list_lock);
+      fprintf(stderr, "Failed to write keypair (%.*s,%.*s)\n",
+              (int)keys[original_index].len, keys[original_index].data,
+              (int)values[original_index].len, values[original_index].data);
     }
   }
 
+  // Logged in the order they were applied, before another batch can change
+  // the same keys
+  uint64_t wal_end = wal_append(keys, values, sorted_indexes, num_pairs);
+  unlock_buckets(buckets, num_buckets);
   safe_rdwrunlock(&kvs_table->global_lock);
-  free(sorted_indexes);
+  wal_commit(wal_end);
+  stats_record(STATS_WRITE, stats_now() - start);
   return 0;
 }
 
-// Modified read function to work with sorted indexes
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd) {
+// Reads the keys, printing the results in alphabetical order
+int kvs_read(size_t num_pairs, const StringView *keys, OutputBuffer *out) {
 
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
+  uint64_t start = stats_now();
   // Create sorted index array
-  int *sorted_indexes = create_alphabetical_index(keys, num_pairs);
-  if (sorted_indexes == NULL) {
-    fprintf(stderr, "Failed to create sorted indexes\n");
-    return 1;
+  int sorted_indexes[MAX_WRITE_SIZE];
+  create_alphabetical_index(keys, num_pairs, sorted_indexes);
+
+  if (kvs_shards != NULL) {
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    int found[MAX_WRITE_SIZE];
+    shard_read(kvs_shards, num_pairs, keys, values, found);
+    output_puts(out, "[");
+    for (size_t i = 0; i < num_pairs; i++) {
+      int index = sorted_indexes[i];
+      print_read(out, keys[index], found[index] ? values[index] : NULL);
+    }
+    output_puts(out, "]\n");
+    stats_record(STATS_READ, stats_now() - start);
+    return 0;
+  }
+
+  size_t buckets[MAX_WRITE_SIZE];
+  size_t num_buckets = 0;
+  if (kvs_table->lockfree_reads) {
+    epoch_enter();
+  } else {
+    // The global lock is shared so the bucket array can't be grown under us
+    safe_rdlock(&kvs_table->global_lock);
+    num_buckets = collect_buckets(keys, num_pairs, buckets);
+    lock_buckets(buckets, num_buckets, 0);
   }
 
-  int locked[TABLE_SIZE] = {0};
-  // Perform read operations in alphabetical order
-  write_to_file(out_fd, "[");
+  // Perform read operations in alphabetical order. Values are formatted
+  // straight from the table, which is still protected, into the output.
+  output_puts(out, "[");
   for (size_t i = 0; i < num_pairs; i++) {
     int original_index = sorted_indexes[i];
-    int hashed_index = hash(keys[original_index]);
-    if (!locked[hashed_index]) {
-      locked[hashed_index] = 1;
-      safe_rdlock(&kvs_table->table[hashed_index].list_lock);
-    }
+    const char *result = lookup_pair(kvs_table, keys[original_index]);
+    print_read(out, keys[original_index], result);
+  }
 
-    char *result = read_pair(kvs_table, keys[original_index]);
+  output_puts(out, "]\n");
+  if (kvs_table->lockfree_reads) {
+    epoch_exit();
+  } else {
+    unlock_buckets(buckets, num_buckets);
+    safe_rdwrunlock(&kvs_table->global_lock);
+  }
+  stats_record(STATS_READ, stats_now() - start);
+  return 0;
+}
+
+// Deletes the keys, reporting the missing ones in alphabetical order
+int kvs_delete(size_t num_pairs, const StringView *keys, OutputBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
 
-    if (result == NULL) {
-      char buf[MAX_WRITE_SIZE];
-      snprintf(buf, sizeof(buf), "(%s,KVSERROR)", keys[original_index]);
-      write_to_file(out_fd, buf);
+  uint64_t start = stats_now();
+  // Only the missing keys are printed, so only they need sorting
+  StringView missing[MAX_WRITE_SIZE];
+  size_t num_missing = 0;
+  if (kvs_shards != NULL) {
+    int found[MAX_WRITE_SIZE];
+    shard_delete(kvs_shards, num_pairs, keys, found);
+    for (size_t i = 0; i < num_pairs; i++) {
+      if (!found[i]) {
+        missing[num_missing++] = keys[i];
+      }
     }
+  } else {
+    safe_rdlock(&kvs_table->global_lock);
+    size_t buckets[MAX_WRITE_SIZE];
+    size_t num_buckets = collect_buckets(keys, num_pairs, buckets);
+    lock_buckets(buckets, num_buckets, 1);
 
-    else {
-      char buf[BUF_SIZE];
-      snprintf(buf, sizeof(buf), "(%s,%s)", keys[original_index], result);
-      write_to_file(out_fd, buf);
-      free(result);
+    StringView deleted[MAX_WRITE_SIZE];
+    size_t num_deleted = 0;
+    for (size_t i = 0; i < num_pairs; i++) {
+      if (delete_pair(kvs_table, keys[i]) != 0) {
+        missing[num_missing++] = keys[i];
+      } else {
+        deleted[num_deleted++] = keys[i];
+      }
     }
+    uint64_t wal_end = wal_append(deleted, NULL, NULL, num_deleted);
+    unlock_buckets(buckets, num_buckets);
+    safe_rdwrunlock(&kvs_table->global_lock);
+    wal_commit(wal_end);
   }
 
-  write_to_file(out_fd, "]\n");
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    if (locked[i]) {
-      safe_rdwrunlock(&kvs_table->table[i].list_lock);
+  if (num_missing > 0) {
+    int sorted_indexes[MAX_WRITE_SIZE];
+    create_alphabetical_index(missing, num_missing, sorted_indexes);
+    output_puts(out, "[");
+    for (size_t i = 0; i < num_missing; i++) {
+      output_puts(out, "(");
+      output_write(out, missing[sorted_indexes[i]].data,
+                   missing[sorted_indexes[i]].len);
+      output_puts(out, ",KVSMISSING)");
     }
+    output_puts(out, "]\n");
   }
-  free(sorted_indexes);
+  stats_record(STATS_DELETE, stats_now() - start);
   return 0;
 }
 
-// Modified delete function to work with sorted indexes
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int out_fd) {
+int kvs_show(OutputBuffer *out) {
+  uint64_t start = stats_now();
+  if (kvs_shards != NULL) {
+    PairSort *sort = pair_sort_create();
+    int result = shard_scan(kvs_shards, visit_sort, sort) ||
+                 pair_sort_finish(sort, visit_print, out);
+    pair_sort_free(sort);
+    stats_record(STATS_SHOW, stats_now() - start);
+    return result;
+  }
+  // Only long enough to let the batches in progress finish
+  lock_table();
+  Snapshot *snapshot = create_snapshot(kvs_table);
+  unlock_table();
+
+  // The pairs are copied out of the table, so writers only wait for the
+  // bucket being copied, and not at all while the pairs are written
+  PairSort *sort = pair_sort_create();
+  int result = scan_snapshot(snapshot, visit_sort, sort);
+  lock_table();
+  release_snapshot(kvs_table, snapshot);
+  unlock_table();
+  result = result || pair_sort_finish(sort, visit_print, out);
+  pair_sort_free(sort);
+  stats_record(STATS_SHOW, stats_now() - start);
+  return result;
+}
+
+int kvs_range(StringView low, StringView high, OutputBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  uint64_t start = stats_now();
+  int result = print_ordered(low, up_to_bound, high, out);
+  stats_record(STATS_RANGE, stats_now() - start);
+  return result;
+}
 
-  // Create sorted index array
-  int *sorted_indexes = create_alphabetical_index(keys, num_pairs);
-  if (sorted_indexes == NULL) {
-    fprintf(stderr, "Failed to create sorted indexes\n");
+int kvs_prefix(StringView prefix, OutputBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  if (prefix.len >= MAX_STRING_SIZE) {
+    return 0; // No key is that long
+  }
+  uint64_t start_ns = stats_now();
+  // Keys with the prefix, in any case, follow it in upper case in the index
+  char start[MAX_STRING_SIZE];
+  for (size_t i = 0; i < prefix.len; i++) {
+    start[i] = (char)toupper((unsigned char)prefix.data[i]);
+  }
+  StringView start_view = {start, prefix.len};
+  int result = print_ordered(start_view, has_prefix, prefix, out);
+  stats_record(STATS_PREFIX, stats_now() - start_ns);
+  return result;
+}
 
-  safe_wrlock(&kvs_table->global_lock);
-  int locked[TABLE_SIZE] = {0};
-  // Perform delete operations in alphabetical order
-  int aux = 0;
-  for (size_t i = 0; i < num_pairs; i++) {
-    int original_index = sorted_indexes[i];
-    int hashed_index = hash(keys[original_index]);
-    if (!locked[hashed_index]) {
-      locked[hashed_index] = 1;
-      safe_wrlock(&kvs_table->table[hashed_index].list_lock);
-    }
-    if (delete_pair(kvs_table, keys[original_index]) != 0) {
-      if (!aux) {
-        write_to_file(out_fd, "[");
-        aux = 1;
-      }
-      char buf[BUF_SIZE];
-      snprintf(buf, sizeof(buf), "(%s,KVSMISSING)", keys[original_index]);
-      write_to_file(out_fd, buf);
-    }
+int kvs_backup(const char *path) {
+  char temp_path[PATH_MAX];
+  backup_temp_path(temp_path, path);
+  int bck_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (bck_fd < 0) {
+    fprintf(stderr, "Failed to create backup file: %s\n", temp_path);
+    return 1;
   }
-  if (aux) {
-    write_to_file(out_fd, "]\n");
+
+  uint64_t start = stats_now();
+  safe_mutex_lock(&backup_lock);
+  while (active_backups == max_backups) {
+    pthread_cond_wait(&backup_done, &backup_lock);
   }
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    if (locked[i]) {
-      safe_rdwrunlock(&kvs_table->table[i].list_lock);
+  active_backups++;
+  safe_mutex_unlock(&backup_lock);
+
+  // Only long enough to let the batches in progress finish
+  BackupTask *task = safe_malloc(sizeof(BackupTask));
+  task->fd = bck_fd;
+  task->base = NULL;
+  task->path = strdup(path);
+  task->pairs = NULL;
+  const char *slash = strrchr(path, '/');
+  const char *name = slash != NULL ? slash + 1 : path;
+  if (kvs_shards != NULL) {
+    // Copied shard by shard, the thread only writes them
+    task->snapshot = NULL;
+    task->pairs = pair_sort_create();
+    shard_scan(kvs_shards, visit_sort, task->pairs);
+  }
+  lock_table();
+  if (kvs_shards == NULL) {
+    task->snapshot = create_snapshot(kvs_table);
+  }
+  // No batch is in progress, so the log holds exactly the snapshot up to here
+  task->wal_position = wal_position();
+  task->sequence = backups_taken++;
+  if (incremental_backups) {
+    if (last_backup != NULL) {
+      task->base = last_backup; // Now owned by the task
+      task->snapshot->base_version = last_backup_version;
     }
+    last_backup = strdup(name);
+    last_backup_version = task->snapshot->version;
   }
-  safe_rdwrunlock(&kvs_table->global_lock);
+  unlock_table();
+  stats_record(STATS_BACKUP, stats_now() - start);
 
-  free(sorted_indexes);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, backup_thread, task) != 0) {
+    return write_backup(task); // Write it ourselves instead
+  }
+  pthread_detach(thread);
   return 0;
 }
 
-int kvs_show(int out_fd) {
+int kvs_restore(const char *path) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  if (kvs_shards != NULL) {
+    fprintf(stderr, "Backups can't be loaded in sharded mode\n");
+    return 1;
+  }
+  uint64_t start = stats_now();
   lock_table();
-  printTable(out_fd);
+  int result = load_backup(kvs_table, path, load_threads);
   unlock_table();
-  return 0;
+  stats_record(STATS_RESTORE, stats_now() - start);
+  return result;
 }
 
-int kvs_backup(int bck_fd) {
-  if (printTable(bck_fd))
+int kvs_stats(OutputBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
     return 1;
-  return 0;
+  }
+  char line[256];
+  int len;
+  if (kvs_shards != NULL) {
+    size_t num_pairs = 0;
+    shard_scan(kvs_shards, visit_count, &num_pairs);
+    len = snprintf(line, sizeof(line), "shards pairs=%zu\n", num_pairs);
+  } else {
+    len = snprintf(line, sizeof(line), "table pairs=%zu buckets=%zu\n",
+                   atomic_load(&kvs_table->count),
+                   atomic_load(&kvs_table->size));
+  }
+  SlabStats slab;
+  slab_stats(&slab);
+  len += snprintf(line + len, sizeof(line) - (size_t)len,
+                  "slab allocations=%zu large=%zu chunks=%zu\n",
+                  slab.allocations, slab.large, slab.chunks);
+  return stats_report(out) || output_write(out, line, (size_t)len);
+}
+
+void kvs_wait_backup() {
+  safe_mutex_lock(&backup_lock);
+  while (active_backups > 0) {
+    pthread_cond_wait(&backup_done, &backup_lock);
+  }
+  safe_mutex_unlock(&backup_lock);
 }
 
 void kvs_wait(unsigned int delay_ms) {
@@ -4,16 +4,25 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "constants.h"
-
-/// Writes the given buffer to a file descriptor, ensuring all bytes are
-/// written. If writing fails, an error message is printed to stderr using
-/// perror.
-/// @param out_fd The file descriptor to write to.
-/// @param buffer The string buffer to write.
-/// @return 0 if the buffer is written successfully, 1 otherwise.
-int write_to_file(int out_fd, const char *buf);
+#include "output.h"
+#include "string_view.h"
+#include "wal.h"
+
+// Startup options of the KVS.
+typedef struct KvsOptions {
+  int lockfree_reads; // READ walks the buckets without locks, see epoch.h
+  size_t max_backups; // Backups written at the same time, at least 1
+  int incremental_backups; // Backups after the first are deltas, see backup.h
+  const char *wal_path;    // Write-ahead log, NULL for none, see wal.h
+  enum WalSync wal_sync;   // When the write-ahead log is synced to disk
+  size_t load_threads;     // Threads loading backups, 0 for one per CPU
+  size_t shards; // Shards owning the keys, 0 for the shared table, see shard.h
+  int io_uring;  // Backups are written through io_uring if the kernel can
+  int ordered_index; // RANGE and PREFIX walk an index kept by every new key
+} KvsOptions;
 
 void lock_table();
 
@@ -53,63 +62,119 @@ void safe_wrlock(pthread_rwlock_t *rwlock);
 /// @param rwlock Pointer to the read-write lock to be unlocked from writing.
 void safe_rdwrunlock(pthread_rwlock_t *rwlock);
 
-/// Creates an array of indices that sorts the keys in alphabetical order.
+/// Compares two keys alphabetically, ignoring case.
+/// @return Negative, zero or positive, like strcasecmp.
+int compare_keys(StringView first, StringView second);
+
+/// Compares two keys like compare_keys, but orders the keys that only differ
+/// in case by their bytes, so only equal keys compare equal.
+/// @return Negative, zero or positive, like strcmp.
+int compare_keys_exact(StringView first, StringView second);
+
+/// Packs the first 8 bytes of a key, folded to lower case, into an integer
+/// with the first byte on top. Keys can't hold a '\0', so padding shorter keys
+/// with zeros puts them first, like compare_keys does.
+/// @param key Key to be packed.
+/// @return Prefix of the key, ordered like the keys by compare_keys.
+uint64_t key_prefix(StringView key);
+
+/// Fills an array of indices that sorts the keys in alphabetical order.
 /// Sorting is case-insensitive.
-/// @param keys Array of key strings to sort.
+/// @param keys Array of keys to sort.
 /// @param num_pairs Number of keys in the array.
-/// @return Pointer to the dynamically allocated array of sorted indices,
-///         or NULL if memory allocation fails.
-int *create_alphabetical_index(char keys[][MAX_STRING_SIZE], size_t num_pairs);
-
-/// Prints the contents of the key-value store's table to the specified output
-/// file. Each key-value pair is written in the format "(key, value)", followed
-/// by a newline. The function iterates over the entire table and writes the
-/// data to the provided file descriptor.
-/// @param fd File descriptor to which the key-value pairs will be written.
-/// @return 0 on success, or 1 if there is an error writing to the file.
-int printTable(int fd);
-
-/// Initializes the KVS state.
+/// @param sorted_indexes Output array with room for num_pairs indices.
+void create_alphabetical_index(const StringView *keys, size_t num_pairs,
+                               int *sorted_indexes);
+
+/// Initializes the KVS state. With a write-ahead log, the state it holds is
+/// recovered first.
+/// @param options Startup options.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-int kvs_init();
+int kvs_init(const KvsOptions *options);
 
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
 
 /// Writes a key value pair to the KVS. If key already exists it is updated.
+/// The strings are copied into the KVS, the views only need to stay valid for
+/// the duration of the call. With a write-ahead log, the pairs are logged
+/// before the call returns.
 /// @param num_pairs Number of pairs being written.
-/// @param keys Array of keys' strings.
-/// @param values Array of values' strings.
+/// @param keys Array of keys.
+/// @param values Array of values.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, const StringView *keys,
+              const StringView *values);
 
-/// Reads values from the KVS.
+/// Reads values from the KVS. With lock-free reads each key is read
+/// atomically, but a batch may observe a concurrent WRITE batch half-applied.
 /// @param num_pairs Number of pairs to read.
-/// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param keys Array of keys.
+/// @param out Output buffer to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, const StringView *keys, OutputBuffer *out);
 
-/// Deletes key value pairs from the KVS.
+/// Deletes key value pairs from the KVS. With a write-ahead log, the deletions
+/// are logged before the call returns.
 /// @param num_pairs Number of pairs to read.
-/// @param keys Array of keys' strings.
+/// @param keys Array of keys.
+/// @param out Output buffer to write the missing keys.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, const StringView *keys, OutputBuffer *out);
+
+/// Writes the state of the KVS, one "(key, value)" line per pair, sorted by
+/// key like the keys of a READ. The state is captured by a snapshot when the
+/// function is called, and the KVS keeps changing while it is written.
+/// @param out Output buffer to write the output.
+/// @return 0 if the state was written successfully, 1 otherwise.
+int kvs_show(OutputBuffer *out);
+
+/// Writes the pairs whose keys are between low and high, both included, one
+/// "(key, value)" line per pair and sorted like the output of SHOW. With
+/// KvsOptions.ordered_index, keys are read from the ordered index in batches,
+/// each read like a READ, so pairs changed during the call may or may not be
+/// seen. Otherwise they are taken from a snapshot, as kvs_show does.
+/// @param low Smallest key to be written.
+/// @param high Largest key to be written.
+/// @param out Output buffer to write the pairs.
+/// @return 0 if the pairs were written successfully, 1 otherwise.
+int kvs_range(StringView low, StringView high, OutputBuffer *out);
 
-/// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_show(int fd);
+/// Writes the pairs whose keys start with the given prefix, ignoring case,
+/// like kvs_range does.
+/// @param prefix Prefix of the keys to be written.
+/// @param out Output buffer to write the pairs.
+/// @return 0 if the pairs were written successfully, 1 otherwise.
+int kvs_prefix(StringView prefix, OutputBuffer *out);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @param fd File descriptor to write the output.
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(int bck_fd);
-
-/// Waits for the last backup to be called.
+/// backup file. The state is captured by a snapshot when the function is
+/// called, and written out by a background thread while the KVS keeps
+/// changing. Waits first if max_backups backups are still being written.
+/// With incremental backups, only the changes since the previous backup are
+/// written, as a delta of it. The backup is written to a temporary file next
+/// to its path and renamed to it once complete, so a crash leaves either the
+/// previous file or the new one. With a write-ahead log, the backup is synced
+/// to disk and recorded as a checkpoint of the log once it is renamed.
+/// @param path Path of the backup file, whose name later deltas refer to.
+/// Backups are expected to share a directory.
+/// @return 0 if the backup was started successfully, 1 otherwise.
+int kvs_backup(const char *path);
+
+/// Loads a full or delta backup into the KVS, on top of its current state.
+/// @param path Path of the backup file.
+/// @return 0 if the backup was loaded successfully, 1 otherwise.
+int kvs_restore(const char *path);
+
+/// Writes a report of the latencies of the calls above, of the waits for
+/// the locks of the table, and of the size of the table, one "key=value" line
+/// per metric, see stats.h.
+/// @param out Output buffer to write the report.
+/// @return 0 if the report was written successfully, 1 otherwise.
+int kvs_stats(OutputBuffer *out);
+
+/// Waits for every backup in progress to be written.
 void kvs_wait_backup();
 
 /// Waits for a given amount of time.
@@ -0,0 +1,152 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "operations.h"
+#include "ordered_index.h"
+#include "slab.h"
+
+/*AUXILIARY FUNCTIONS*/
+
+static char *node_key(IndexNode *node) {
+  return (char *)&node->next[node->level];
+}
+
+/// Size of a node with the given number of links and key length.
+static size_t node_size(size_t level, size_t key_len) {
+  return offsetof(IndexNode, next) + level * sizeof(IndexNode *) + key_len + 1;
+}
+
+/// Compares the key of a node with another key, in the order of
+/// compare_keys_exact.
+static int compare_node(IndexNode *node, uint64_t prefix, StringView key) {
+  if (node->prefix != prefix) {
+    return node->prefix < prefix ? -1 : 1;
+  }
+  StringView node_view = {node_key(node), node->key_len};
+  return compare_keys_exact(node_view, key);
+}
+
+/// Finds, on every level, the last node whose key is before the given one.
+/// @param skip_equal Whether a node holding the key itself counts as before.
+/// @param before Output array of INDEX_MAX_LEVEL nodes, the head on the
+/// levels not in use.
+/// @return The node following before[0], NULL at the end of the index.
+static IndexNode *find_before(OrderedIndex *index, StringView key,
+                              int skip_equal, IndexNode **before) {
+  for (unsigned level = index->level; level < INDEX_MAX_LEVEL; level++) {
+    before[level] = index->head;
+  }
+  uint64_t prefix = key_prefix(key);
+  IndexNode *node = index->head;
+  for (unsigned level = index->level; level > 0; level--) {
+    IndexNode *next = node->next[level - 1];
+    while (next != NULL) {
+      int order = compare_node(next, prefix, key);
+      if (order > 0 || (order == 0 && !skip_equal)) {
+        break;
+      }
+      node = next;
+      next = node->next[level - 1];
+    }
+    before[level - 1] = node;
+  }
+  return node->next[0];
+}
+
+/// Picks the level of a new node, each level a quarter as likely as the one
+/// below it.
+static unsigned random_level(OrderedIndex *index) {
+  // xorshift64
+  index->random ^= index->random << 13;
+  index->random ^= index->random >> 7;
+  index->random ^= index->random << 17;
+  uint64_t bits = index->random;
+  unsigned level = 1;
+  while (level < INDEX_MAX_LEVEL && (bits & 3) == 0) {
+    level++;
+    bits >>= 2;
+  }
+  return level;
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+int index_init(OrderedIndex *index) {
+  index->head = slab_alloc(node_size(INDEX_MAX_LEVEL, 0));
+  index->head->prefix = 0;
+  index->head->key_len = 0;
+  index->head->level = INDEX_MAX_LEVEL;
+  for (size_t i = 0; i < INDEX_MAX_LEVEL; i++) {
+    index->head->next[i] = NULL;
+  }
+  node_key(index->head)[0] = '\0';
+  index->level = 1;
+  index->random = 0x9e3779b97f4a7c15ULL;
+  if (pthread_rwlock_init(&index->lock, NULL) != 0) {
+    slab_free(index->head, node_size(INDEX_MAX_LEVEL, 0));
+    return 1;
+  }
+  return 0;
+}
+
+void index_insert(OrderedIndex *index, StringView key) {
+  safe_wrlock(&index->lock);
+  IndexNode *before[INDEX_MAX_LEVEL];
+  find_before(index, key, 0, before);
+
+  unsigned level = random_level(index);
+  IndexNode *node = slab_alloc(node_size(level, key.len));
+  node->prefix = key_prefix(key);
+  node->key_len = (unsigned char)key.len;
+  node->level = (unsigned char)level;
+  memcpy(node_key(node), key.data, key.len);
+  node_key(node)[key.len] = '\0';
+  for (unsigned i = 0; i < level; i++) {
+    node->next[i] = before[i]->next[i];
+    before[i]->next[i] = node;
+  }
+  if (level > index->level) {
+    index->level = level;
+  }
+  safe_rdwrunlock(&index->lock);
+}
+
+void index_remove(OrderedIndex *index, StringView key) {
+  safe_wrlock(&index->lock);
+  IndexNode *before[INDEX_MAX_LEVEL];
+  IndexNode *node = find_before(index, key, 0, before);
+  if (node != NULL && compare_node(node, key_prefix(key), key) == 0) {
+    for (unsigned i = 0; i < node->level; i++) {
+      before[i]->next[i] = node->next[i];
+    }
+    while (index->level > 1 && index->head->next[index->level - 1] == NULL) {
+      index->level--;
+    }
+    slab_free(node, node_size(node->level, node->key_len));
+  }
+  safe_rdwrunlock(&index->lock);
+}
+
+size_t index_scan(OrderedIndex *index, StringView start, int inclusive,
+                  char (*keys)[MAX_STRING_SIZE], size_t max_keys) {
+  safe_rdlock(&index->lock);
+  IndexNode *before[INDEX_MAX_LEVEL];
+  IndexNode *node = find_before(index, start, !inclusive, before);
+  size_t num_keys = 0;
+  for (; node != NULL && num_keys < max_keys; node = node->next[0]) {
+    memcpy(keys[num_keys++], node_key(node), (size_t)node->key_len + 1);
+  }
+  safe_rdwrunlock(&index->lock);
+  return num_keys;
+}
+
+void index_destroy(OrderedIndex *index) {
+  IndexNode *node = index->head;
+  while (node != NULL) {
+    IndexNode *next = node->next[0];
+    slab_free(node, node_size(node->level, node->key_len));
+    node = next;
+  }
+  index->head = NULL;
+  pthread_rwlock_destroy(&index->lock);
+}
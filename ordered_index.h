@@ -0,0 +1,63 @@
+#ifndef KVS_ORDERED_INDEX_H
+#define KVS_ORDERED_INDEX_H
+
+// Maximum number of levels of the skip list, enough for 4^16 keys.
+#define INDEX_MAX_LEVEL 16
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "string_view.h"
+
+// Node of the skip list, holding a key but no value: values are always read
+// from the hash table.
+typedef struct IndexNode {
+  uint64_t prefix; // See key_prefix, settles most comparisons
+  unsigned char key_len;
+  unsigned char level;      // Number of links
+  struct IndexNode *next[]; // Followed by the key, null-terminated
+} IndexNode;
+
+// Keys of a hash table in the order of compare_keys_exact, kept in a skip
+// list. Only adding and removing keys takes the lock in write mode, so writes
+// overwriting a key don't touch the index.
+typedef struct OrderedIndex {
+  IndexNode *head; // Sentinel with INDEX_MAX_LEVEL links and no key
+  unsigned level;  // Number of levels in use
+  uint64_t random; // State of the generator of node levels
+  pthread_rwlock_t lock;
+} OrderedIndex;
+
+/// Initializes an empty index.
+/// @param index Index to be initialized.
+/// @return 0 on success, 1 if its lock could not be created.
+int index_init(OrderedIndex *index);
+
+/// Adds a key to the index.
+/// @param index Index to be modified.
+/// @param key Key to be added, not in the index yet and shorter than
+/// MAX_STRING_SIZE.
+void index_insert(OrderedIndex *index, StringView key);
+
+/// Removes a key from the index, if present.
+/// @param index Index to be modified.
+/// @param key Key to be removed.
+void index_remove(OrderedIndex *index, StringView key);
+
+/// Copies the keys of the index starting from a given key, in order.
+/// @param index Index to read from.
+/// @param start Key the scan starts from, not necessarily in the index.
+/// @param inclusive Whether start itself is copied, if present.
+/// @param keys Output array of null-terminated keys.
+/// @param max_keys Number of keys the output array has room for.
+/// @return Number of keys copied, below max_keys only if the index ended.
+size_t index_scan(OrderedIndex *index, StringView start, int inclusive,
+                  char (*keys)[MAX_STRING_SIZE], size_t max_keys);
+
+/// Frees every node of the index and its lock.
+/// @param index Index to be destroyed.
+void index_destroy(OrderedIndex *index);
+
+#endif // KVS_ORDERED_INDEX_H
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output.h"
+
+void output_init(OutputBuffer *out, int fd) {
+  out->fd = fd;
+  out->len = 0;
+  out->hand_off = NULL;
+  out->hand_off_arg = NULL;
+}
+
+/// Writes all the given buffers, retrying on partial writes.
+/// @return 0 on success, 1 on error.
+static int write_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t num_written = writev(fd, iov, iovcnt);
+    if (num_written == -1) {
+      perror("Failed to write to file");
+      return 1;
+    }
+
+    // Skip whatever was written, in case it wasn't everything
+    size_t remaining = (size_t)num_written;
+    while (iovcnt > 0 && remaining >= iov->iov_len) {
+      remaining -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + remaining;
+      iov->iov_len -= remaining;
+    }
+  }
+  return 0;
+}
+
+int output_write(OutputBuffer *out, const char *data, size_t len) {
+  if (len <= sizeof(out->data) - out->len) {
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+  }
+
+  if (out->hand_off != NULL) {
+    // Bytes must reach the file in order, so none are written from here
+    while (len > 0) {
+      size_t room = sizeof(out->data) - out->len;
+      size_t num_copied = len < room ? len : room;
+      memcpy(out->data + out->len, data, num_copied);
+      out->len += num_copied;
+      data += num_copied;
+      len -= num_copied;
+      if (out->len == sizeof(out->data) &&
+          out->hand_off(out, out->hand_off_arg)) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  struct iovec iov[2] = {{out->data, out->len}, {(void *)data, len}};
+  out->len = 0;
+  return write_all(out->fd, iov, 2);
+}
+
+int output_puts(OutputBuffer *out, const char *str) {
+  return output_write(out, str, strlen(str));
+}
+
+int output_end_command(OutputBuffer *out) {
+  if (out->len < OUTPUT_FLUSH_THRESHOLD) {
+    return 0;
+  }
+  return output_flush(out);
+}
+
+int output_flush(OutputBuffer *out) {
+  if (out->len == 0) {
+    return 0;
+  }
+  if (out->hand_off != NULL) {
+    return out->hand_off(out, out->hand_off_arg);
+  }
+  struct iovec iov = {out->data, out->len};
+  out->len = 0;
+  return write_all(out->fd, &iov, 1);
+}
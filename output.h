@@ -0,0 +1,57 @@
+#ifndef KVS_OUTPUT_H
+#define KVS_OUTPUT_H
+
+// Size of the buffer output is accumulated in before it is written out.
+#define OUTPUT_BUF_SIZE 65536
+// Amount of buffered output above which it is written out at the end of a
+// command.
+#define OUTPUT_FLUSH_THRESHOLD (OUTPUT_BUF_SIZE / 2)
+
+#include <stddef.h>
+
+// Buffered writer for .out and .bck files. Results are appended to data and
+// reach the file with a few large writes instead of one write per fragment.
+// With a hand-off set, full buffers and flushes go to it instead of the
+// file, e.g. to be written by another thread, see pipeline.h.
+typedef struct OutputBuffer {
+  int fd;
+  size_t len; // Number of bytes of data waiting to be written
+  // Takes the len bytes of data and empties the buffer. Returns 0 on
+  // success, 1 if the output can't be written.
+  int (*hand_off)(struct OutputBuffer *out, void *arg);
+  void *hand_off_arg;
+  char data[OUTPUT_BUF_SIZE];
+} OutputBuffer;
+
+/// Prepares an empty buffer for the given file, without a hand-off.
+/// @param out Buffer to be initialized.
+/// @param fd File descriptor the output goes to.
+void output_init(OutputBuffer *out, int fd);
+
+/// Appends bytes to the buffer. If they don't fit, the buffered bytes and the
+/// new ones are written out together with a single writev, or handed off a
+/// full buffer at a time.
+/// @param out Buffer to append to.
+/// @param data Bytes to append.
+/// @param len Number of bytes to append.
+/// @return 0 on success, 1 if writing to the file failed.
+int output_write(OutputBuffer *out, const char *data, size_t len);
+
+/// Appends a null-terminated string to the buffer.
+/// @param out Buffer to append to.
+/// @param str String to append.
+/// @return 0 on success, 1 if writing to the file failed.
+int output_puts(OutputBuffer *out, const char *str);
+
+/// Marks the end of a command, writing the buffered output out if there is
+/// enough of it.
+/// @param out Buffer of the command's output.
+/// @return 0 on success, 1 if writing to the file failed.
+int output_end_command(OutputBuffer *out);
+
+/// Writes every buffered byte to the file.
+/// @param out Buffer to be flushed.
+/// @return 0 on success, 1 if writing to the file failed.
+int output_flush(OutputBuffer *out);
+
+#endif // KVS_OUTPUT_H
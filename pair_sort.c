@@ -0,0 +1,344 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "operations.h"
+#include "pair_sort.h"
+
+// Pair of a run, pointing into the memory it was copied to
+typedef struct SortEntry {
+  uint64_t prefix; // See key_prefix, settles most comparisons
+  StringView key;  // Null-terminated
+  const char *value;
+} SortEntry;
+
+// Run of the temporary file, read a piece at a time while merging
+typedef struct RunReader {
+  off_t next; // Offset of the first byte not read yet
+  off_t end;  // Offset where the run ends
+  char *buf;
+  size_t cap;
+  size_t pos; // Start of the first pair of buf not visited yet
+  size_t len;
+  SortEntry current; // Smallest pair of the run not visited yet
+} RunReader;
+
+// Pairs are stored as "key\0value\0", in the arena while their run is being
+// filled, then in the temporary file once it is sorted.
+struct PairSort {
+  char *arena;
+  size_t arena_cap;
+  size_t arena_len;
+  SortEntry *entries; // Pairs of the arena, at most PAIR_SORT_RUN_PAIRS
+  size_t entries_cap;
+  size_t count;
+  FILE *spill;     // Sorted runs, NULL until the first one is spilled
+  off_t *run_ends; // Offset where every spilled run ends
+  size_t num_runs;
+  size_t runs_cap;
+};
+
+/*AUXILIARY FUNCTIONS*/
+
+static int compare_entries(const SortEntry *first, const SortEntry *second) {
+  if (first->prefix != second->prefix) {
+    return first->prefix < second->prefix ? -1 : 1;
+  }
+  return compare_keys_exact(first->key, second->key);
+}
+
+static int compare_sort_entries(const void *first, const void *second) {
+  return compare_entries(first, second);
+}
+
+/// Doubles the arena until it has room for size more bytes, without going
+/// over PAIR_SORT_RUN_SIZE, and points the entries into the new one.
+static void grow_arena(PairSort *sort, size_t size) {
+  size_t capacity =
+      sort->arena_cap > 0 ? 2 * sort->arena_cap : PAIR_SORT_INITIAL_SIZE;
+  while (capacity < sort->arena_len + size && capacity < PAIR_SORT_RUN_SIZE) {
+    capacity *= 2;
+  }
+  if (capacity > PAIR_SORT_RUN_SIZE) {
+    capacity = PAIR_SORT_RUN_SIZE;
+  }
+
+  char *arena = safe_malloc(capacity);
+  if (sort->arena_len > 0) {
+    memcpy(arena, sort->arena, sort->arena_len);
+  }
+  for (size_t i = 0; i < sort->count; i++) {
+    SortEntry *entry = &sort->entries[i];
+    entry->key.data = arena + (entry->key.data - sort->arena);
+    entry->value = arena + (entry->value - sort->arena);
+  }
+  free(sort->arena);
+  sort->arena = arena;
+  sort->arena_cap = capacity;
+}
+
+/// Doubles the room for entries, without going over PAIR_SORT_RUN_PAIRS.
+static void grow_entries(PairSort *sort) {
+  size_t capacity =
+      sort->entries_cap > 0 ? 2 * sort->entries_cap : PAIR_SORT_INITIAL_PAIRS;
+  if (capacity > PAIR_SORT_RUN_PAIRS) {
+    capacity = PAIR_SORT_RUN_PAIRS;
+  }
+  SortEntry *entries = safe_malloc(capacity * sizeof(SortEntry));
+  if (sort->count > 0) {
+    memcpy(entries, sort->entries, sort->count * sizeof(SortEntry));
+  }
+  free(sort->entries);
+  sort->entries = entries;
+  sort->entries_cap = capacity;
+}
+
+/// Sorts the run in memory, writes it to the temporary file and empties it.
+/// @return 0 on success, 1 if the run could not be written.
+static int spill_run(PairSort *sort) {
+  if (sort->spill == NULL) {
+    sort->spill = tmpfile();
+    if (sort->spill == NULL) {
+      fprintf(stderr, "Failed to create temporary file\n");
+      return 1;
+    }
+  }
+  qsort(sort->entries, sort->count, sizeof(SortEntry), compare_sort_entries);
+  for (size_t i = 0; i < sort->count; i++) {
+    SortEntry *entry = &sort->entries[i];
+    size_t value_len = strlen(entry->value);
+    if (fwrite(entry->key.data, 1, entry->key.len + 1, sort->spill) !=
+            entry->key.len + 1 ||
+        fwrite(entry->value, 1, value_len + 1, sort->spill) != value_len + 1) {
+      fprintf(stderr, "Failed to write temporary file\n");
+      return 1;
+    }
+  }
+
+  if (sort->num_runs == sort->runs_cap) {
+    sort->runs_cap = sort->runs_cap > 0 ? 2 * sort->runs_cap : 16;
+    off_t *run_ends = safe_malloc(sort->runs_cap * sizeof(off_t));
+    if (sort->num_runs > 0) {
+      memcpy(run_ends, sort->run_ends, sort->num_runs * sizeof(off_t));
+    }
+    free(sort->run_ends);
+    sort->run_ends = run_ends;
+  }
+  sort->run_ends[sort->num_runs++] = ftello(sort->spill);
+  sort->count = 0;
+  sort->arena_len = 0;
+  return 0;
+}
+
+/// Reads the next pair of a run into reader->current.
+/// @param fd Temporary file.
+/// @return 1 if a pair was read, 0 at the end of the run, -1 if the run could
+/// not be read.
+static int next_pair(RunReader *reader, int fd) {
+  while (1) {
+    char *start = reader->buf + reader->pos;
+    size_t avail = reader->len - reader->pos;
+    char *key_end = memchr(start, '\0', avail);
+    char *value_end = NULL;
+    if (key_end != NULL) {
+      size_t key_size = (size_t)(key_end - start) + 1;
+      value_end = memchr(key_end + 1, '\0', avail - key_size);
+    }
+    if (value_end != NULL) {
+      StringView key = {start, (size_t)(key_end - start)};
+      reader->current = (SortEntry){key_prefix(key), key, key_end + 1};
+      reader->pos += (size_t)(value_end + 1 - start);
+      return 1;
+    }
+    if (reader->next == reader->end) {
+      return avail == 0 ? 0 : -1;
+    }
+
+    // Move the partial pair to the front, and read the rest after it
+    memmove(reader->buf, start, avail);
+    reader->pos = 0;
+    reader->len = avail;
+    if (reader->len == reader->cap) {
+      char *buf = safe_malloc(2 * reader->cap);
+      memcpy(buf, reader->buf, reader->len);
+      free(reader->buf);
+      reader->buf = buf;
+      reader->cap *= 2;
+    }
+    size_t want = reader->cap - reader->len;
+    if ((off_t)want > reader->end - reader->next) {
+      want = (size_t)(reader->end - reader->next);
+    }
+    ssize_t got = pread(fd, reader->buf + reader->len, want, reader->next);
+    if (got <= 0) {
+      return -1;
+    }
+    reader->len += (size_t)got;
+    reader->next += got;
+  }
+}
+
+/// Moves a reader down the heap until its pair is smaller than its
+/// children's.
+static void sift_down(RunReader **heap, size_t heap_len, size_t index) {
+  while (1) {
+    size_t smallest = index;
+    for (size_t child = 2 * index + 1; child <= 2 * index + 2; child++) {
+      if (child < heap_len && compare_entries(&heap[child]->current,
+                                              &heap[smallest]->current) < 0) {
+        smallest = child;
+      }
+    }
+    if (smallest == index) {
+      return;
+    }
+    RunReader *swap = heap[index];
+    heap[index] = heap[smallest];
+    heap[smallest] = swap;
+    index = smallest;
+  }
+}
+
+/// Merges the spilled runs with a heap of their smallest pairs.
+/// @return 0 on success, 1 if a run could not be read or visit stopped.
+static int merge_runs(PairSort *sort, PairVisitor visit, void *arg) {
+  if (fflush(sort->spill) != 0) {
+    fprintf(stderr, "Failed to write temporary file\n");
+    return 1;
+  }
+  int fd = fileno(sort->spill);
+  RunReader *readers = safe_malloc(sort->num_runs * sizeof(RunReader));
+  RunReader **heap = safe_malloc(sort->num_runs * sizeof(RunReader *));
+  size_t heap_len = 0;
+  int read_failed = 0;
+  for (size_t i = 0; i < sort->num_runs; i++) {
+    RunReader *reader = &readers[i];
+    reader->next = i > 0 ? sort->run_ends[i - 1] : 0;
+    reader->end = sort->run_ends[i];
+    reader->cap = PAIR_SORT_READ_SIZE;
+    reader->buf = safe_malloc(reader->cap);
+    reader->pos = 0;
+    reader->len = 0;
+    int got = next_pair(reader, fd);
+    read_failed |= got < 0;
+    if (got > 0) {
+      heap[heap_len++] = reader;
+    }
+  }
+  for (size_t i = heap_len / 2; i > 0; i--) {
+    sift_down(heap, heap_len, i - 1);
+  }
+
+  int result = 0;
+  while (heap_len > 0 && !read_failed && !result) {
+    RunReader *top = heap[0];
+    result = visit(arg, top->current.key.data, top->current.value);
+    int got = next_pair(top, fd);
+    read_failed = got < 0;
+    if (got == 0) {
+      heap[0] = heap[--heap_len];
+    }
+    sift_down(heap, heap_len, 0);
+  }
+  if (read_failed) {
+    fprintf(stderr, "Failed to read temporary file\n");
+  }
+
+  for (size_t i = 0; i < sort->num_runs; i++) {
+    free(readers[i].buf);
+  }
+  free(heap);
+  free(readers);
+  return result || read_failed;
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+PairSort *pair_sort_create() {
+  PairSort *sort = safe_malloc(sizeof(PairSort));
+  sort->arena = NULL;
+  sort->arena_cap = 0;
+  sort->arena_len = 0;
+  sort->entries = NULL;
+  sort->entries_cap = 0;
+  sort->count = 0;
+  sort->spill = NULL;
+  sort->run_ends = NULL;
+  sort->num_runs = 0;
+  sort->runs_cap = 0;
+  return sort;
+}
+
+int pair_sort_add(PairSort *sort, const char *key, const char *value) {
+  size_t key_len = strlen(key);
+  size_t value_len = strlen(value);
+  size_t size = key_len + value_len + 2;
+  if (sort->arena_len + size > sort->arena_cap &&
+      sort->arena_cap < PAIR_SORT_RUN_SIZE) {
+    grow_arena(sort, size);
+  }
+  if (sort->count == sort->entries_cap &&
+      sort->entries_cap < PAIR_SORT_RUN_PAIRS) {
+    grow_entries(sort);
+  }
+  // The run is as big as it gets
+  if (sort->arena_len + size > sort->arena_cap ||
+      sort->count == sort->entries_cap) {
+    if (sort->count > 0 && spill_run(sort)) {
+      return 1;
+    }
+    if (size > sort->arena_cap) {
+      // A single huge pair, the arena is empty so no entry points into it
+      free(sort->arena);
+      sort->arena_cap = size;
+      sort->arena = safe_malloc(sort->arena_cap);
+    }
+  }
+
+  char *record = sort->arena + sort->arena_len;
+  memcpy(record, key, key_len + 1);
+  memcpy(record + key_len + 1, value, value_len + 1);
+  sort->arena_len += size;
+  StringView key_view = {record, key_len};
+  sort->entries[sort->count++] =
+      (SortEntry){key_prefix(key_view), key_view, record + key_len + 1};
+  return 0;
+}
+
+int pair_sort_finish(PairSort *sort, PairVisitor visit, void *arg) {
+  if (sort->spill == NULL) {
+    // Every pair fit in a single run, no need to go through the file
+    if (sort->count > 1) {
+      qsort(sort->entries, sort->count, sizeof(SortEntry),
+            compare_sort_entries);
+    }
+    for (size_t i = 0; i < sort->count; i++) {
+      if (visit(arg, sort->entries[i].key.data, sort->entries[i].value)) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  if (sort->count > 0 && spill_run(sort)) {
+    return 1;
+  }
+  // Only the read buffers of the runs are needed from here on
+  free(sort->arena);
+  free(sort->entries);
+  sort->arena = NULL;
+  sort->entries = NULL;
+  return merge_runs(sort, visit, arg);
+}
+
+void pair_sort_free(PairSort *sort) {
+  if (sort->spill != NULL) {
+    fclose(sort->spill);
+  }
+  free(sort->run_ends);
+  free(sort->entries);
+  free(sort->arena);
+  free(sort);
+}
@@ -0,0 +1,49 @@
+#ifndef KVS_PAIR_SORT_H
+#define KVS_PAIR_SORT_H
+
+// Bytes of pairs sorted in memory at once. More pairs are sorted in runs of
+// this size, spilled to a temporary file and merged.
+#define PAIR_SORT_RUN_SIZE (4 << 20)
+// Most pairs sorted in memory at once.
+#define PAIR_SORT_RUN_PAIRS (1 << 16)
+// Bytes and pairs a run has room for at first. Its memory doubles as pairs
+// are added, up to the limits above, so a small sort stays small.
+#define PAIR_SORT_INITIAL_SIZE (4 << 10)
+#define PAIR_SORT_INITIAL_PAIRS 64
+// Bytes read at once from every run being merged.
+#define PAIR_SORT_READ_SIZE (64 << 10)
+
+#include <stddef.h>
+
+// Called for every pair, in order.
+// @param arg Argument given along with the visitor.
+// @return 0 to go on, 1 to stop.
+typedef int (*PairVisitor)(void *arg, const char *key, const char *value);
+
+// Sorts pairs by key, in the order of compare_keys_exact, with memory
+// bounded by the size of a run plus a read buffer per run.
+typedef struct PairSort PairSort;
+
+/// Creates an empty sort, which allocates nothing until pairs are added.
+/// @return The new sort, to be freed with pair_sort_free.
+PairSort *pair_sort_create();
+
+/// Copies a pair into the sort.
+/// @param sort Sort the pair is added to.
+/// @param key Key of the pair, unique among the pairs of the sort.
+/// @param value Value of the pair.
+/// @return 0 on success, 1 if a run could not be spilled.
+int pair_sort_add(PairSort *sort, const char *key, const char *value);
+
+/// Visits the pairs of the sort in order, merging its runs.
+/// @param sort Sort whose pairs are visited, only visited once.
+/// @param visit Called for every pair.
+/// @param arg Argument passed to visit.
+/// @return 0 on success, 1 if a run could not be read or visit stopped.
+int pair_sort_finish(PairSort *sort, PairVisitor visit, void *arg);
+
+/// Frees the sort and its temporary file.
+/// @param sort Sort to be freed.
+void pair_sort_free(PairSort *sort);
+
+#endif // KVS_PAIR_SORT_H
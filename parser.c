@@ -1,27 +1,126 @@
 #include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "constants.h"
 #include "parser.h"
 
-static int read_string(int fd, char *buffer, size_t max) {
-  ssize_t bytes_read;
+void job_reader_init(JobReader *reader, int fd) {
+  reader->fd = fd;
+  reader->pos = 0;
+  reader->len = 0;
+  reader->data = reader->buf;
+  reader->binary = 0;
+  reader->mapped = 0;
+  reader->owns_mapping = 0;
+
+  // Regular files are mapped whole. Anything mmap refuses (empty files,
+  // pipes) falls back to buffered reads.
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+      reader->data = map;
+      reader->len = (size_t)st.st_size;
+      reader->mapped = 1;
+      reader->owns_mapping = 1;
+    }
+  }
+}
+
+void job_reader_init_buffer(JobReader *reader, const char *data, size_t len) {
+  reader->fd = -1;
+  reader->pos = 0;
+  reader->len = len;
+  reader->data = data;
+  reader->binary = 0;
+  reader->mapped = 1;
+  reader->owns_mapping = 0;
+}
+
+void job_reader_close(JobReader *reader) {
+  if (reader->owns_mapping) {
+    munmap((void *)reader->data, reader->len);
+    reader->owns_mapping = 0;
+  }
+  reader->mapped = 0;
+}
+
+/// Refills the buffer of the reader with the next block of the file.
+/// @return 1 if bytes are available, 0 on end of file or error.
+static int refill(JobReader *reader) {
+  if (reader->mapped) {
+    return 0; // The whole file is already available
+  }
+  ssize_t bytes_read = read(reader->fd, reader->buf, sizeof(reader->buf));
+  if (bytes_read <= 0) {
+    return 0;
+  }
+  reader->pos = 0;
+  reader->len = (size_t)bytes_read;
+  return 1;
+}
+
+/// Reads up to n bytes, stopping early only at the end of the file.
+/// @return Number of bytes read.
+static size_t read_chars(JobReader *reader, char *dest, size_t n) {
+  size_t copied = 0;
+  while (copied < n) {
+    if (reader->pos == reader->len && !refill(reader)) {
+      break;
+    }
+    size_t available = reader->len - reader->pos;
+    size_t chunk = n - copied < available ? n - copied : available;
+    memcpy(dest + copied, reader->data + reader->pos, chunk);
+    reader->pos += chunk;
+    copied += chunk;
+  }
+  return copied;
+}
+
+/// Reads the next byte.
+/// @return 1 if a byte was read, 0 on end of file.
+static int read_char(JobReader *reader, char *ch) {
+  if (reader->pos == reader->len && !refill(reader)) {
+    return 0;
+  }
+  *ch = reader->data[reader->pos++];
+  return 1;
+}
+
+/// Reads a key or value up to its delimiter. When the file is mapped the view
+/// points into the mapping, otherwise the string is copied into scratch.
+/// @param reader Reader of the job file.
+/// @param out View of the string read, valid until the next command is read.
+/// @param scratch Room for max bytes, used when the file is not mapped.
+/// @param max Maximum size of the string, delimiter included.
+/// @return 0, 1 or 2 when the string ends in ',', ')' or ']', -1 on error.
+static int read_string(JobReader *reader, StringView *out, char *scratch,
+                       size_t max) {
+  const char *start = reader->data + reader->pos;
   char ch;
   size_t i = 0;
   int value = -1;
 
   while (i < max) {
-    bytes_read = read(fd, &ch, 1);
-
-    if (bytes_read <= 0) {
+    if (!read_char(reader, &ch)) {
       return -1;
     }
 
     if (ch == ' ') {
       return -1;
     }
+    // A line break ends the command, the rest of it is invalid
+    if (ch == '\n') {
+      reader->pos--;
+      return -1;
+    }
 
     if (ch == ',') {
       value = 0;
@@ -34,20 +133,24 @@ static int read_string(int fd, char *buffer, size_t max) {
       break;
     }
 
-    buffer[i++] = ch;
+    if (!reader->mapped) {
+      scratch[i] = ch;
+    }
+    i++;
   }
 
-  buffer[i] = '\0';
+  out->data = reader->mapped ? start : scratch;
+  out->len = i;
 
   return value;
 }
 
-static int read_uint(int fd, unsigned int *value, char *next) {
+static int read_uint(JobReader *reader, unsigned int *value, char *next) {
   char buf[16];
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (!read_char(reader, buf + i)) {
       *next = '\0';
       break;
     }
@@ -73,141 +176,437 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-static void cleanup(int fd) {
+static void cleanup(JobReader *reader) {
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (read_char(reader, &ch) && ch != '\n')
     ;
 }
 
-enum Command get_next(int fd) {
+/// Skips the rest of an invalid line, unless its end was already read.
+/// @param buf Bytes of the line read so far.
+/// @param len Number of bytes in buf.
+/// @return CMD_INVALID.
+static enum Command invalid_line(JobReader *reader, const char *buf,
+                                 size_t len) {
+  if (memchr(buf, '\n', len) == NULL) {
+    cleanup(reader);
+  }
+  return CMD_INVALID;
+}
+
+/// Reads the rest of a command word and checks it, stopping at the first
+/// byte that doesn't match so that no byte of the next line is consumed.
+/// @param buf Buffer holding the first len bytes of the line.
+/// @param len Number of bytes in buf, updated with the ones read.
+/// @param word Expected command word, including the bytes already read.
+/// @return 1 if the line starts with the word, 0 otherwise.
+static int read_word(JobReader *reader, char *buf, size_t *len,
+                     const char *word) {
+  size_t word_len = strlen(word);
+  if (*len > word_len || strncmp(buf, word, *len) != 0) {
+    return 0;
+  }
+  while (*len < word_len) {
+    char ch;
+    if (!read_char(reader, &ch)) {
+      return 0;
+    }
+    buf[(*len)++] = ch;
+    if (ch != word[*len - 1]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/// Checks that a command without arguments ends its line.
+/// @return 1 if it does, 0 otherwise.
+static int read_end(JobReader *reader, char *buf, size_t *len) {
+  size_t num_read = read_chars(reader, buf + *len, 1);
+  *len += num_read;
+  return num_read == 0 || buf[*len - 1] == '\n';
+}
+
+/*BINARY FORMAT*/
+
+// Kinds of records of a binary job file
+enum BinaryRecord {
+  RECORD_WRITE = 'W',
+  RECORD_READ = 'R',
+  RECORD_DELETE = 'D',
+  RECORD_SHOW = 'S',
+  RECORD_RANGE = 'G',
+  RECORD_PREFIX = 'P',
+  RECORD_STATS = 'M',
+  RECORD_WAIT = 'T',
+  RECORD_BACKUP = 'B',
+  RECORD_HELP = 'H',
+  RECORD_INVALID = '?'
+};
+
+/// Reads a little-endian unsigned integer.
+/// @param size Size of the integer, at most 4 bytes.
+/// @return 1 on success, 0 if the input ended first.
+static int read_le(JobReader *reader, size_t size, uint32_t *value) {
+  unsigned char bytes[4];
+  if (read_chars(reader, (char *)bytes, size) != size) {
+    return 0;
+  }
+  *value = 0;
+  for (size_t i = size; i > 0; i--) {
+    *value = *value << 8 | bytes[i - 1];
+  }
+  return 1;
+}
+
+/// Checks that a string has none of the bytes that delimit strings in the
+/// text syntax, in backups or in the write-ahead log.
+/// @return 1 if it has none, 0 otherwise.
+static int is_plain_string(const char *data, size_t len) {
+  // The terminator of the array makes '\0' one of them too
+  static const char reserved[] = " ,()]\n";
+  for (size_t i = 0; i < len; i++) {
+    if (memchr(reserved, data[i], sizeof(reserved)) != NULL) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/// Reads a length-prefixed string. Mapped strings are viewed in place, the
+/// others are copied to scratch.
+/// @param scratch Room for max bytes, used when the file is not mapped.
+/// @param max Maximum size of the string, counting room for a terminator.
+/// @return 1 if the string is valid, 0 if it is too long or holds a byte
+/// reserved for delimiters, -1 if the input ended first.
+static int read_binary_string(JobReader *reader, StringView *out,
+                              char *scratch, size_t max) {
+  uint32_t len;
+  if (!read_le(reader, 1, &len)) {
+    return -1;
+  }
+
+  if (reader->mapped) {
+    if (reader->len - reader->pos < len) {
+      reader->pos = reader->len;
+      return -1;
+    }
+    out->data = reader->data + reader->pos;
+    reader->pos += len;
+  } else {
+    // Strings that are too long are still read, to skip them
+    char skipped[UINT8_MAX];
+    char *dest = len < max ? scratch : skipped;
+    if (read_chars(reader, dest, len) != len) {
+      return -1;
+    }
+    out->data = dest;
+  }
+  out->len = len;
+  return len < max && is_plain_string(out->data, len);
+}
+
+static enum Command get_next_binary(JobReader *reader) {
+  char record;
+  if (!read_char(reader, &record)) {
+    return EOC;
+  }
+
+  switch (record) {
+  case RECORD_WRITE:
+    return CMD_WRITE;
+  case RECORD_READ:
+    return CMD_READ;
+  case RECORD_DELETE:
+    return CMD_DELETE;
+  case RECORD_SHOW:
+    return CMD_SHOW;
+  case RECORD_RANGE:
+    return CMD_RANGE;
+  case RECORD_PREFIX:
+    return CMD_PREFIX;
+  case RECORD_STATS:
+    return CMD_STATS;
+  case RECORD_WAIT:
+    return CMD_WAIT;
+  case RECORD_BACKUP:
+    return CMD_BACKUP;
+  case RECORD_HELP:
+    return CMD_HELP;
+  case RECORD_INVALID:
+    return CMD_INVALID;
+  default:
+    // The length of an unknown record isn't known, so nothing after it is
+    fprintf(stderr, "Corrupted binary job file\n");
+    reader->pos = reader->len;
+    while (refill(reader)) {
+      reader->pos = reader->len;
+    }
+    return EOC;
+  }
+}
+
+/// Reads the keys, or pairs, of a binary WRITE, READ or DELETE record.
+/// Invalid records are read whole, so the next one can still be parsed.
+/// @param with_values Whether every key is followed by a value.
+/// @return Number of keys read. 0 on failure.
+static size_t parse_binary_batch(JobReader *reader, CommandBatch *batch,
+                                 int with_values, size_t max_keys,
+                                 size_t max_string_size) {
+  uint32_t count;
+  if (!read_le(reader, 2, &count)) {
+    return 0;
+  }
+
+  int valid = count > 0 && count < max_keys && max_keys <= MAX_WRITE_SIZE &&
+              max_string_size <= MAX_STRING_SIZE;
+  for (uint32_t i = 0; i < count; i++) {
+    // The entries of an invalid record overwrite each other
+    size_t slot = valid ? i : 0;
+    char *scratch = reader->scratch[with_values ? 2 * slot : slot];
+    int result = read_binary_string(reader, &batch->keys[slot], scratch,
+                                    max_string_size);
+    if (with_values && result >= 0) {
+      int value_result =
+          read_binary_string(reader, &batch->values[slot],
+                             reader->scratch[2 * slot + 1], max_string_size);
+      result = value_result < result ? value_result : result;
+    }
+    if (result < 0) {
+      return 0;
+    }
+    valid &= result;
+  }
+
+  batch->count = valid ? count : 0;
+  return batch->count;
+}
+
+static int parse_binary_wait(JobReader *reader, unsigned int *delay) {
+  uint32_t value;
+  if (!read_le(reader, 4, &value)) {
+    return -1;
+  }
+  *delay = value;
+  return 0;
+}
+
+/// Appends a little-endian unsigned integer to a buffer.
+/// @return Number of bytes written.
+static size_t write_le(char *buf, uint32_t value, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    buf[i] = (char)(value >> (8 * i) & 0xff);
+  }
+  return size;
+}
+
+/// Appends a length-prefixed string to a buffer.
+/// @return Number of bytes written.
+static size_t write_binary_string(char *buf, StringView str) {
+  size_t len = write_le(buf, (uint32_t)str.len, 1);
+  memcpy(buf + len, str.data, str.len);
+  return len + str.len;
+}
+
+int job_reader_use_binary(JobReader *reader) {
+  char magic[JOB_BINARY_MAGIC_SIZE];
+  if (read_chars(reader, magic, sizeof(magic)) != sizeof(magic) ||
+      memcmp(magic, JOB_BINARY_MAGIC, sizeof(magic)) != 0) {
+    return 1;
+  }
+  reader->binary = 1;
+  return 0;
+}
+
+size_t encode_binary_command(char *buf, enum Command command,
+                             const CommandBatch *batch, unsigned int delay) {
+  size_t len = 1;
+  switch (command) {
+  case CMD_WRITE:
+    buf[0] = RECORD_WRITE;
+    len += write_le(buf + len, (uint32_t)batch->count, 2);
+    for (size_t i = 0; i < batch->count; i++) {
+      len += write_binary_string(buf + len, batch->keys[i]);
+      len += write_binary_string(buf + len, batch->values[i]);
+    }
+    return len;
+
+  case CMD_READ:
+  case CMD_DELETE:
+  case CMD_RANGE:
+  case CMD_PREFIX:
+    buf[0] = command == CMD_READ     ? RECORD_READ
+             : command == CMD_DELETE ? RECORD_DELETE
+             : command == CMD_RANGE  ? RECORD_RANGE
+                                     : RECORD_PREFIX;
+    len += write_le(buf + len, (uint32_t)batch->count, 2);
+    for (size_t i = 0; i < batch->count; i++) {
+      len += write_binary_string(buf + len, batch->keys[i]);
+    }
+    return len;
+
+  case CMD_WAIT:
+    buf[0] = RECORD_WAIT;
+    return len + write_le(buf + len, delay, 4);
+
+  case CMD_SHOW:
+    buf[0] = RECORD_SHOW;
+    return len;
+
+  case CMD_STATS:
+    buf[0] = RECORD_STATS;
+    return len;
+
+  case CMD_BACKUP:
+    buf[0] = RECORD_BACKUP;
+    return len;
+
+  case CMD_HELP:
+    buf[0] = RECORD_HELP;
+    return len;
+
+  case CMD_INVALID:
+    buf[0] = RECORD_INVALID;
+    return len;
+
+  case CMD_EMPTY:
+  case EOC:
+    return 0;
+  }
+  return 0;
+}
+
+/*END OF BINARY FORMAT*/
+
+enum Command get_next(JobReader *reader) {
+  if (reader->binary) {
+    return get_next_binary(reader);
+  }
+
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  size_t len = 1;
+  if (!read_char(reader, buf)) {
     return EOC;
   }
 
   switch (buf[0]) {
   case 'W':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-      if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-        cleanup(fd);
-        return CMD_INVALID;
-      }
+    if (read_word(reader, buf, &len, "WAIT ")) {
+      return CMD_WAIT;
+    }
+    if (read_word(reader, buf, &len, "WRITE ")) {
       return CMD_WRITE;
     }
-
-    return CMD_WAIT;
+    return invalid_line(reader, buf, len);
 
   case 'R':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-      cleanup(fd);
-      return CMD_INVALID;
+    if (read_word(reader, buf, &len, "READ ")) {
+      return CMD_READ;
+    }
+    if (read_word(reader, buf, &len, "RANGE ")) {
+      return CMD_RANGE;
     }
+    return invalid_line(reader, buf, len);
 
-    return CMD_READ;
+  case 'P':
+    if (!read_word(reader, buf, &len, "PREFIX ")) {
+      return invalid_line(reader, buf, len);
+    }
+    return CMD_PREFIX;
 
   case 'D':
-    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-      cleanup(fd);
-      return CMD_INVALID;
+    if (!read_word(reader, buf, &len, "DELETE ")) {
+      return invalid_line(reader, buf, len);
     }
-
     return CMD_DELETE;
 
   case 'S':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-      cleanup(fd);
-      return CMD_INVALID;
+    if (read_word(reader, buf, &len, "SHOW")) {
+      return read_end(reader, buf, &len) ? CMD_SHOW
+                                         : invalid_line(reader, buf, len);
     }
-
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-      cleanup(fd);
-      return CMD_INVALID;
+    if (read_word(reader, buf, &len, "STATS") && read_end(reader, buf, &len)) {
+      return CMD_STATS;
     }
-
-    return CMD_SHOW;
+    return invalid_line(reader, buf, len);
 
   case 'B':
-    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-      cleanup(fd);
-      return CMD_INVALID;
-    }
-
-    if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-      cleanup(fd);
-      return CMD_INVALID;
+    if (!read_word(reader, buf, &len, "BACKUP") ||
+        !read_end(reader, buf, &len)) {
+      return invalid_line(reader, buf, len);
     }
-
     return CMD_BACKUP;
 
   case 'H':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-      cleanup(fd);
-      return CMD_INVALID;
-    }
-
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-      cleanup(fd);
-      return CMD_INVALID;
+    if (!read_word(reader, buf, &len, "HELP") || !read_end(reader, buf, &len)) {
+      return invalid_line(reader, buf, len);
     }
-
     return CMD_HELP;
 
   case '#':
-    cleanup(fd);
+    cleanup(reader);
     return CMD_EMPTY;
 
   case '\n':
     return CMD_EMPTY;
 
   default:
-    cleanup(fd);
+    cleanup(reader);
     return CMD_INVALID;
   }
 }
 
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-    cleanup(fd);
+static int parse_pair(JobReader *reader, StringView *key, StringView *value,
+                      size_t index) {
+  if (read_string(reader, key, reader->scratch[2 * index], MAX_STRING_SIZE) !=
+      0) {
+    cleanup(reader);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
+  if (read_string(reader, value, reader->scratch[2 * index + 1],
+                  MAX_STRING_SIZE) != 1) {
+    cleanup(reader);
     return 0;
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
+size_t parse_write(JobReader *reader, CommandBatch *batch, size_t max_pairs,
                    size_t max_string_size) {
   char ch;
+  batch->count = 0;
+  if (reader->binary) {
+    return parse_binary_batch(reader, batch, 1, max_pairs, max_string_size);
+  }
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (!read_char(reader, &ch) || ch != '[') {
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
+  if (!read_char(reader, &ch) || ch != '(') {
+    cleanup(reader);
+    return 0;
+  }
+
+  if (max_string_size > MAX_STRING_SIZE || max_pairs > MAX_WRITE_SIZE) {
+    cleanup(reader);
     return 0;
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
   while (num_pairs < max_pairs) {
-    if (parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+    if (parse_pair(reader, &batch->keys[num_pairs], &batch->values[num_pairs],
+                   num_pairs) == 0) {
+      cleanup(reader);
       return 0;
     }
+    num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
+    if (!read_char(reader, &ch) || (ch != '(' && ch != ']')) {
+      cleanup(reader);
       return 0;
     }
 
@@ -217,37 +616,46 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
   }
 
   if (num_pairs == max_pairs) {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (!read_char(reader, &ch) || (ch != '\n' && ch != '\0')) {
+    cleanup(reader);
     return 0;
   }
 
+  batch->count = num_pairs;
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size) {
+size_t parse_read_delete(JobReader *reader, CommandBatch *batch,
+                         size_t max_keys, size_t max_string_size) {
   char ch;
+  batch->count = 0;
+  if (reader->binary) {
+    return parse_binary_batch(reader, batch, 0, max_keys, max_string_size);
+  }
+
+  if (!read_char(reader, &ch) || ch != '[') {
+    cleanup(reader);
+    return 0;
+  }
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (max_string_size > MAX_STRING_SIZE || max_keys > MAX_WRITE_SIZE) {
+    cleanup(reader);
     return 0;
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_string(reader, &batch->keys[num_keys],
+                             reader->scratch[num_keys], max_string_size);
     if (output < 0 || output == 1) {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
-
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2) {
       break;
@@ -255,34 +663,48 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   }
 
   if (num_keys == max_keys) {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (!read_char(reader, &ch) || (ch != '\n' && ch != '\0')) {
+    cleanup(reader);
     return 0;
   }
 
+  batch->count = num_keys;
   return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+size_t parse_bounds(JobReader *reader, CommandBatch *batch, size_t num_keys) {
+  if (parse_read_delete(reader, batch, MAX_WRITE_SIZE, MAX_STRING_SIZE) !=
+      num_keys) {
+    batch->count = 0;
+    return 0;
+  }
+  return num_keys;
+}
+
+int parse_wait(JobReader *reader, unsigned int *delay,
+               unsigned int *thread_id) {
   char ch;
+  if (reader->binary) {
+    return parse_binary_wait(reader, delay);
+  }
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(reader, delay, &ch) != 0) {
+    cleanup(reader);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(reader, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(reader);
       return -1;
     }
 
@@ -290,7 +712,45 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(reader);
     return -1;
   }
 }
+
+enum Command parse_command(JobReader *reader, enum Command command,
+                           CommandBatch *batch, unsigned int *delay) {
+  switch (command) {
+  case CMD_WRITE:
+    if (parse_write(reader, batch, MAX_WRITE_SIZE, MAX_STRING_SIZE) == 0) {
+      return CMD_INVALID;
+    }
+    break;
+  case CMD_READ:
+  case CMD_DELETE:
+    if (parse_read_delete(reader, batch, MAX_WRITE_SIZE, MAX_STRING_SIZE) ==
+        0) {
+      return CMD_INVALID;
+    }
+    break;
+  case CMD_RANGE:
+  case CMD_PREFIX:
+    if (parse_bounds(reader, batch, command == CMD_RANGE ? 2 : 1) == 0) {
+      return CMD_INVALID;
+    }
+    break;
+  case CMD_WAIT:
+    if (parse_wait(reader, delay, NULL) == -1) {
+      return CMD_INVALID;
+    }
+    break;
+  case CMD_SHOW:
+  case CMD_STATS:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+  return command;
+}
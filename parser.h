@@ -2,13 +2,46 @@
 #define KVS_PARSER_H
 
 #include "constants.h"
+#include "string_view.h"
 #include <stddef.h>
 
+// Size of the blocks read from a job file at a time.
+#define PARSER_BUF_SIZE 65536
+
+// Reply to the HELP command.
+#define PARSER_HELP_TEXT                                                       \
+  "Available commands:\n"                                                      \
+  "  WRITE [(key,value),(key2,value2),...]\n"                                  \
+  "  READ [key,key2,...]\n"                                                    \
+  "  DELETE [key,key2,...]\n"                                                  \
+  "  SHOW\n"                                                                   \
+  "  RANGE [low,high]\n"                                                       \
+  "  PREFIX [prefix]\n"                                                        \
+  "  STATS\n"                                                                  \
+  "  WAIT <delay_ms>\n"                                                        \
+  "  BACKUP\n"                                                                 \
+  "  HELP\n"
+
+// Binary job files (.jobb) start with this magic, followed by one record per
+// command: a byte with the kind of command, then its arguments. Counts of
+// pairs or keys are 16-bit and WAIT delays 32-bit little-endian integers, and
+// keys and values are a length byte followed by their bytes. Nothing has to
+// be scanned for delimiters, but keys and values still can't hold the bytes
+// that delimit them in the text syntax, in backups or in the write-ahead log:
+// '\0', ' ', ',', '(', ')', ']' and '\n'.
+#define JOB_BINARY_MAGIC "KVSJOBB1"
+#define JOB_BINARY_MAGIC_SIZE 8
+// Largest record of a binary job file, a WRITE with every pair at full size.
+#define JOB_BINARY_MAX_RECORD (3 + 2 * MAX_WRITE_SIZE * (1 + MAX_STRING_SIZE))
+
 enum Command {
   CMD_WRITE,
   CMD_READ,
   CMD_DELETE,
   CMD_SHOW,
+  CMD_RANGE,
+  CMD_PREFIX,
+  CMD_STATS,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -17,38 +50,123 @@ enum Command {
   EOC // End of commands
 };
 
-/// Reads a line and returns the corresponding command.
+// Reader over a job file. Regular files are memory-mapped, and the keys and
+// values handed out by the parser point straight into the mapping. Other
+// files are read in blocks into buf, and the strings are copied to scratch.
+// A reader can also parse commands already in memory, e.g. received from a
+// socket, which are treated like a mapping that isn't unmapped on close.
+// Either way, the input is in the text syntax or, once job_reader_use_binary
+// is called, in the binary one.
+typedef struct JobReader {
+  int fd;
+  int binary;       // Whether the input is in the binary format
+  int mapped;       // Whether data holds the whole input
+  int owns_mapping; // Whether data must be unmapped on close
+  const char *data; // Either the mapping or buf
+  size_t pos;       // Next byte of data to be consumed
+  size_t len;       // Number of valid bytes in data
+  char buf[PARSER_BUF_SIZE];
+  char scratch[2 * MAX_WRITE_SIZE][MAX_STRING_SIZE];
+} JobReader;
+
+// Keys and values of the last WRITE, READ, DELETE, RANGE or PREFIX parsed.
+// Only the first count entries are meaningful: the batch is reused from one
+// command to the next and never cleared.
+typedef struct CommandBatch {
+  size_t count;
+  StringView keys[MAX_WRITE_SIZE];
+  StringView values[MAX_WRITE_SIZE]; // Only filled by WRITE
+} CommandBatch;
+
+/// Prepares a reader to parse the given file from its start.
+/// @param reader Reader to be initialized.
 /// @param fd File descriptor to read from.
+void job_reader_init(JobReader *reader, int fd);
+
+/// Prepares a reader to parse commands held in memory. The views handed out
+/// by the parser point into the given bytes.
+/// @param reader Reader to be initialized.
+/// @param data Commands to be parsed, which must stay valid while they are.
+/// @param len Number of bytes of data.
+void job_reader_init_buffer(JobReader *reader, const char *data, size_t len);
+
+/// Switches a reader to the binary format, checking the magic at the start of
+/// its input.
+/// @param reader Reader that hasn't parsed anything yet.
+/// @return 0 on success, 1 if the input isn't a binary job file.
+int job_reader_use_binary(JobReader *reader);
+
+/// Encodes a command as a record of a binary job file.
+/// @param buf Output buffer, with room for JOB_BINARY_MAX_RECORD bytes.
+/// @param command Command to be encoded. Commands that failed to parse are
+/// encoded as CMD_INVALID, CMD_EMPTY and EOC produce no record.
+/// @param batch Keys and values of a WRITE, READ, DELETE, RANGE or PREFIX.
+/// @param delay Delay of a WAIT, in milliseconds.
+/// @return Number of bytes written to buf.
+size_t encode_binary_command(char *buf, enum Command command,
+                             const CommandBatch *batch, unsigned int delay);
+
+/// Releases the mapping of the reader, if any. The file descriptor is left
+/// open.
+/// @param reader Reader to be closed.
+void job_reader_close(JobReader *reader);
+
+/// Reads a line, or a record of a binary job file, and returns the
+/// corresponding command.
+/// @param reader Reader of the job file.
 /// @return The command read.
-enum Command get_next(int fd);
+enum Command get_next(JobReader *reader);
 
-/// Parses a WRITE command.
-/// @param fd File descriptor to read from.
-/// @param keys Array of keys to be written.
-/// @param values Array of values to be written.
-/// @param max_pairs number of pairs to be written.
-/// @param max_string_size maximum size for keys and values.
-/// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
+/// Parses a WRITE command into a batch. The views stay valid until the next
+/// command is read or the reader is closed.
+/// @param reader Reader of the job file.
+/// @param batch Batch to be filled with the pairs to be written.
+/// @param max_pairs number of pairs to be written, at most MAX_WRITE_SIZE.
+/// @param max_string_size maximum size for keys and values, at most
+/// MAX_STRING_SIZE.
+/// @return Number of pairs parsed, also stored in the batch. 0 on failure.
+size_t parse_write(JobReader *reader, CommandBatch *batch, size_t max_pairs,
                    size_t max_string_size);
 
-/// Parses a READ or DELETE command.
-/// @param fd File descriptor to read from.
-/// @param keys Array of keys to be written.
-/// @param max_keys number of keys to be iread or deleted.
-/// @param max_string_size maximum size for keys and values.
-/// @return Number of keys read or deleted. 0 on failure.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size);
+/// Parses a READ or DELETE command into a batch. The views stay valid until
+/// the next command is read or the reader is closed.
+/// @param reader Reader of the job file.
+/// @param batch Batch to be filled with the keys to be read or deleted.
+/// @param max_keys number of keys to be iread or deleted, at most
+/// MAX_WRITE_SIZE.
+/// @param max_string_size maximum size for keys, at most MAX_STRING_SIZE.
+/// @return Number of keys parsed, also stored in the batch. 0 on failure.
+size_t parse_read_delete(JobReader *reader, CommandBatch *batch,
+                         size_t max_keys, size_t max_string_size);
+
+/// Parses the keys of a RANGE, [low,high], or of a PREFIX, [prefix], into a
+/// batch. The views stay valid until the next command is read or the reader
+/// is closed.
+/// @param reader Reader of the job file.
+/// @param batch Batch to be filled with the keys.
+/// @param num_keys Number of keys of the command, 2 for RANGE and 1 for
+/// PREFIX.
+/// @return Number of keys parsed, also stored in the batch. 0 on failure or
+/// if there aren't exactly num_keys.
+size_t parse_bounds(JobReader *reader, CommandBatch *batch, size_t num_keys);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param reader Reader of the job file.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not
 /// be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on
 /// error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(JobReader *reader, unsigned int *delay,
+               unsigned int *thread_id);
+
+/// Parses the arguments of a command, with the parse function of its kind.
+/// @param reader Reader of the job file.
+/// @param command Command just returned by get_next.
+/// @param batch Batch to be filled with the keys and values of the command.
+/// @param delay Pointer to the variable to store the delay of a WAIT in.
+/// @return The command, or CMD_INVALID if its arguments are invalid.
+enum Command parse_command(JobReader *reader, enum Command command,
+                           CommandBatch *batch, unsigned int *delay);
 
 #endif // KVS_PARSER_H
@@ -0,0 +1,244 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "operations.h"
+#include "pipeline.h"
+
+// Bounded queue of pointers between two threads. Pushing to a full ring and
+// popping from an empty one wait.
+typedef struct Ring {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  void **items;
+  size_t capacity;
+  size_t head; // Index of the oldest item
+  size_t count;
+  int closed; // No item will be pushed anymore
+} Ring;
+
+struct Pipeline {
+  JobReader *reader;
+  OutputBuffer *output;
+  Ring free_commands; // Parsed by the parse thread, in order
+  Ring commands;
+  Ring free_chunks; // Written by the output thread, in order
+  Ring chunks;
+  PipelineCommand *command_slots;
+  OutputBuffer *chunk_slots;
+  atomic_int failed; // Writing to the file failed
+  pthread_t parse_thread;
+  pthread_t output_thread;
+};
+
+/*AUXILIARY FUNCTIONS*/
+
+static void ring_init(Ring *ring, size_t capacity) {
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->changed, NULL);
+  ring->items = safe_malloc(capacity * sizeof(void *));
+  ring->capacity = capacity;
+  ring->head = 0;
+  ring->count = 0;
+  ring->closed = 0;
+}
+
+static void ring_destroy(Ring *ring) {
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->changed);
+  free(ring->items);
+}
+
+static void ring_push(Ring *ring, void *item) {
+  safe_mutex_lock(&ring->lock);
+  while (ring->count == ring->capacity) {
+    pthread_cond_wait(&ring->changed, &ring->lock);
+  }
+  ring->items[(ring->head + ring->count) % ring->capacity] = item;
+  ring->count++;
+  pthread_cond_broadcast(&ring->changed);
+  safe_mutex_unlock(&ring->lock);
+}
+
+/// @return The oldest item, NULL once the ring is closed and empty.
+static void *ring_pop(Ring *ring) {
+  safe_mutex_lock(&ring->lock);
+  while (ring->count == 0 && !ring->closed) {
+    pthread_cond_wait(&ring->changed, &ring->lock);
+  }
+  void *item = NULL;
+  if (ring->count > 0) {
+    item = ring->items[ring->head];
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+    pthread_cond_broadcast(&ring->changed);
+  }
+  safe_mutex_unlock(&ring->lock);
+  return item;
+}
+
+/// Wakes the threads waiting to pop once the ring is empty.
+static void ring_close(Ring *ring) {
+  safe_mutex_lock(&ring->lock);
+  ring->closed = 1;
+  pthread_cond_broadcast(&ring->changed);
+  safe_mutex_unlock(&ring->lock);
+}
+
+/// Waits until the ring holds as many items as it can.
+static void ring_wait_full(Ring *ring) {
+  safe_mutex_lock(&ring->lock);
+  while (ring->count < ring->capacity) {
+    pthread_cond_wait(&ring->changed, &ring->lock);
+  }
+  safe_mutex_unlock(&ring->lock);
+}
+
+/// Points the views of a batch at copies of them.
+static void copy_views(StringView *views, size_t count,
+                       char (*storage)[MAX_STRING_SIZE]) {
+  for (size_t i = 0; i < count; i++) {
+    memcpy(storage[i], views[i].data, views[i].len);
+    views[i].data = storage[i];
+  }
+}
+
+/// Parse stage: parses every command of the job, until EOC.
+static void *parse_thread(void *arg) {
+  Pipeline *pipeline = arg;
+  JobReader *reader = pipeline->reader;
+  enum Command command;
+  do {
+    PipelineCommand *slot = ring_pop(&pipeline->free_commands);
+    command = get_next(reader);
+    slot->command = parse_command(reader, command, &slot->batch, &slot->delay);
+    // The next command overwrites the scratch space of the reader
+    if (!reader->mapped) {
+      switch (slot->command) {
+      case CMD_WRITE:
+        copy_views(slot->batch.values, slot->batch.count,
+                   slot->storage + MAX_WRITE_SIZE);
+        copy_views(slot->batch.keys, slot->batch.count, slot->storage);
+        break;
+      case CMD_READ:
+      case CMD_DELETE:
+      case CMD_RANGE:
+      case CMD_PREFIX:
+        copy_views(slot->batch.keys, slot->batch.count, slot->storage);
+        break;
+      case CMD_SHOW:
+      case CMD_STATS:
+      case CMD_WAIT:
+      case CMD_BACKUP:
+      case CMD_HELP:
+      case CMD_EMPTY:
+      case CMD_INVALID:
+      case EOC:
+        break;
+      }
+    }
+    ring_push(&pipeline->commands, slot);
+  } while (command != EOC);
+  return NULL;
+}
+
+/// Output stage: writes the buffers handed off, until the ring is closed.
+static void *output_thread(void *arg) {
+  Pipeline *pipeline = arg;
+  OutputBuffer *chunk;
+  while ((chunk = ring_pop(&pipeline->chunks)) != NULL) {
+    if (output_flush(chunk)) {
+      atomic_store(&pipeline->failed, 1);
+    }
+    ring_push(&pipeline->free_chunks, chunk);
+  }
+  return NULL;
+}
+
+/// Hand-off of the output of the job: copies the buffered bytes into a free
+/// chunk, waiting for one if they are all being written.
+static int hand_off_output(OutputBuffer *out, void *arg) {
+  Pipeline *pipeline = arg;
+  OutputBuffer *chunk = ring_pop(&pipeline->free_chunks);
+  memcpy(chunk->data, out->data, out->len);
+  chunk->len = out->len;
+  out->len = 0;
+  ring_push(&pipeline->chunks, chunk);
+  return atomic_load(&pipeline->failed);
+}
+
+static void free_pipeline(Pipeline *pipeline) {
+  ring_destroy(&pipeline->free_commands);
+  ring_destroy(&pipeline->commands);
+  ring_destroy(&pipeline->free_chunks);
+  ring_destroy(&pipeline->chunks);
+  free(pipeline->command_slots);
+  free(pipeline->chunk_slots);
+  free(pipeline);
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+Pipeline *pipeline_start(JobReader *reader, OutputBuffer *output) {
+  Pipeline *pipeline = safe_malloc(sizeof(Pipeline));
+  pipeline->reader = reader;
+  pipeline->output = output;
+  atomic_init(&pipeline->failed, 0);
+  ring_init(&pipeline->free_commands, PIPELINE_DEPTH);
+  ring_init(&pipeline->commands, PIPELINE_DEPTH);
+  ring_init(&pipeline->free_chunks, PIPELINE_OUTPUT_CHUNKS);
+  ring_init(&pipeline->chunks, PIPELINE_OUTPUT_CHUNKS);
+  pipeline->command_slots =
+      safe_malloc(PIPELINE_DEPTH * sizeof(PipelineCommand));
+  pipeline->chunk_slots =
+      safe_malloc(PIPELINE_OUTPUT_CHUNKS * sizeof(OutputBuffer));
+  for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+    ring_push(&pipeline->free_commands, &pipeline->command_slots[i]);
+  }
+  for (size_t i = 0; i < PIPELINE_OUTPUT_CHUNKS; i++) {
+    output_init(&pipeline->chunk_slots[i], output->fd);
+    ring_push(&pipeline->free_chunks, &pipeline->chunk_slots[i]);
+  }
+
+  if (pthread_create(&pipeline->output_thread, NULL, output_thread,
+                     pipeline) != 0) {
+    free_pipeline(pipeline);
+    return NULL;
+  }
+  if (pthread_create(&pipeline->parse_thread, NULL, parse_thread, pipeline) !=
+      0) {
+    ring_close(&pipeline->chunks);
+    pthread_join(pipeline->output_thread, NULL);
+    free_pipeline(pipeline);
+    return NULL;
+  }
+  output->hand_off = hand_off_output;
+  output->hand_off_arg = pipeline;
+  return pipeline;
+}
+
+PipelineCommand *pipeline_next(Pipeline *pipeline) {
+  return ring_pop(&pipeline->commands);
+}
+
+void pipeline_release(Pipeline *pipeline, PipelineCommand *command) {
+  ring_push(&pipeline->free_commands, command);
+}
+
+int pipeline_drain(Pipeline *pipeline) {
+  int result = output_flush(pipeline->output);
+  ring_wait_full(&pipeline->free_chunks);
+  return result || atomic_load(&pipeline->failed);
+}
+
+int pipeline_finish(Pipeline *pipeline) {
+  int result = pipeline_drain(pipeline);
+  ring_close(&pipeline->chunks);
+  pthread_join(pipeline->output_thread, NULL);
+  pthread_join(pipeline->parse_thread, NULL);
+  pipeline->output->hand_off = NULL;
+  pipeline->output->hand_off_arg = NULL;
+  free_pipeline(pipeline);
+  return result;
+}
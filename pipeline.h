@@ -0,0 +1,61 @@
+#ifndef KVS_PIPELINE_H
+#define KVS_PIPELINE_H
+
+// Commands parsed ahead of the one being run.
+#define PIPELINE_DEPTH 8
+// Buffers of output waiting to be written, each OUTPUT_BUF_SIZE bytes.
+#define PIPELINE_OUTPUT_CHUNKS 4
+
+#include "constants.h"
+#include "output.h"
+#include "parser.h"
+
+// Command parsed by the parse stage, with its arguments
+typedef struct PipelineCommand {
+  enum Command command; // CMD_INVALID if its arguments are invalid
+  unsigned int delay;   // Of a WAIT
+  CommandBatch batch;
+  // Copies of the keys and values, for job files that aren't mapped
+  char storage[2 * MAX_WRITE_SIZE][MAX_STRING_SIZE];
+} PipelineCommand;
+
+// Runs a job file in three stages, connected by bounded rings: a thread
+// parses the commands ahead, the caller runs them in file order, and another
+// thread writes their output. The caller is the only stage that touches the
+// KVS, so commands still see the effects of the ones before them.
+typedef struct Pipeline Pipeline;
+
+/// Starts the parse and output threads of a job.
+/// @param reader Reader of the job file, only used by the parse thread until
+/// pipeline_finish.
+/// @param output Buffer the commands write their output to. Its full buffers
+/// and flushes are handed to the output thread, which writes them to the
+/// file descriptor of the buffer.
+/// @return The pipeline, NULL if a thread could not be started.
+Pipeline *pipeline_start(JobReader *reader, OutputBuffer *output);
+
+/// Waits for the next command of the job, in file order.
+/// @param pipeline Pipeline of the job.
+/// @return The command, to be given back with pipeline_release. The last one
+/// is EOC.
+PipelineCommand *pipeline_next(Pipeline *pipeline);
+
+/// Gives back a command once it was run, so the parse thread can reuse it.
+/// Keys of a job file that isn't mapped must not be used afterwards.
+/// @param pipeline Pipeline of the job.
+/// @param command Command returned by pipeline_next.
+void pipeline_release(Pipeline *pipeline, PipelineCommand *command);
+
+/// Waits until the output written so far, including the buffered output, is
+/// in the file.
+/// @param pipeline Pipeline of the job.
+/// @return 0 on success, 1 if writing to the file failed.
+int pipeline_drain(Pipeline *pipeline);
+
+/// Writes the rest of the output, stops the threads and frees the pipeline.
+/// Must only be called after pipeline_next returned EOC.
+/// @param pipeline Pipeline to be freed.
+/// @return 0 on success, 1 if writing to the file failed.
+int pipeline_finish(Pipeline *pipeline);
+
+#endif // KVS_PIPELINE_H
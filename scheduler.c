@@ -0,0 +1,203 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "operations.h"
+#include "scheduler.h"
+
+typedef struct Deque {
+  pthread_mutex_t lock;
+  Task *tasks[SCHED_DEQUE_SIZE];
+  size_t top;    // Index of the oldest task, stolen first
+  size_t bottom; // Index one past the newest task, popped by the owner
+} Deque;
+
+typedef struct Worker {
+  pthread_t thread;
+  size_t id;
+  Deque deque;
+} Worker;
+
+static Worker *workers = NULL;
+static size_t num_workers = 0;
+static Task *(*next_root_fn)(void) = NULL;
+
+// Roots are handed out under root_lock. Workers only stop once there are no
+// roots left and none is still running, since running roots may spawn tasks.
+static pthread_mutex_t root_lock = PTHREAD_MUTEX_INITIALIZER;
+static int roots_exhausted = 0;
+static atomic_size_t active_roots = 0;
+
+// Idle workers sleep on work_cond until a task is spawned
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+static _Thread_local Worker *current_worker = NULL;
+
+/// Pops the newest task of the worker's own deque.
+static Task *pop_local(Worker *worker) {
+  Deque *deque = &worker->deque;
+  Task *task = NULL;
+  safe_mutex_lock(&deque->lock);
+  if (deque->bottom != deque->top) {
+    deque->bottom--;
+    task = deque->tasks[deque->bottom % SCHED_DEQUE_SIZE];
+  }
+  safe_mutex_unlock(&deque->lock);
+  return task;
+}
+
+/// Steals the oldest task of another worker's deque.
+static Task *steal(Worker *thief) {
+  for (size_t i = 1; i < num_workers; i++) {
+    Deque *deque = &workers[(thief->id + i) % num_workers].deque;
+    Task *task = NULL;
+    safe_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+      task = deque->tasks[deque->top % SCHED_DEQUE_SIZE];
+      deque->top++;
+    }
+    safe_mutex_unlock(&deque->lock);
+    if (task != NULL) {
+      return task;
+    }
+  }
+  return NULL;
+}
+
+/// Takes the next root task, if there is one left.
+static Task *take_root() {
+  Task *task = NULL;
+  safe_mutex_lock(&root_lock);
+  if (!roots_exhausted) {
+    task = next_root_fn();
+    if (task == NULL) {
+      roots_exhausted = 1;
+    } else {
+      atomic_fetch_add(&active_roots, 1);
+    }
+  }
+  safe_mutex_unlock(&root_lock);
+  return task;
+}
+
+/// Sleeps until a task is spawned or SCHED_IDLE_WAIT_US elapse.
+static void idle_wait() {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += SCHED_IDLE_WAIT_US * 1000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  safe_mutex_lock(&idle_lock);
+  pthread_cond_timedwait(&work_cond, &idle_lock, &deadline);
+  safe_mutex_unlock(&idle_lock);
+}
+
+static void *worker_loop(void *arg) {
+  Worker *worker = arg;
+  current_worker = worker;
+
+  while (1) {
+    Task *task = pop_local(worker);
+    if (task == NULL) {
+      task = steal(worker);
+    }
+    if (task != NULL) {
+      task->run(task);
+      continue;
+    }
+
+    task = take_root();
+    if (task != NULL) {
+      task->run(task);
+      atomic_fetch_sub(&active_roots, 1);
+      continue;
+    }
+
+    // Nothing to do: stop once no running root can spawn more work
+    safe_mutex_lock(&root_lock);
+    int done = roots_exhausted && atomic_load(&active_roots) == 0;
+    safe_mutex_unlock(&root_lock);
+    if (done) {
+      break;
+    }
+    idle_wait();
+  }
+  return NULL;
+}
+
+int scheduler_run(int count, Task *(*next_root)(void)) {
+  workers = safe_malloc((size_t)count * sizeof(Worker));
+  num_workers = (size_t)count;
+  next_root_fn = next_root;
+  roots_exhausted = 0;
+
+  for (size_t i = 0; i < num_workers; i++) {
+    workers[i].id = i;
+    workers[i].deque.top = 0;
+    workers[i].deque.bottom = 0;
+    pthread_mutex_init(&workers[i].deque.lock, NULL);
+  }
+
+  int thread_created[count];
+  int created = 0;
+  for (int i = 0; i < count; i++) {
+    thread_created[i] = 0;
+    if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) !=
+        0) {
+      fprintf(stderr, "Error creating thread number: %d\n", i);
+    } else {
+      thread_created[i] = 1;
+      created++;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (thread_created[i] && pthread_join(workers[i].thread, NULL) != 0) {
+      fprintf(stderr, "Error joining thread number: %d\n", i);
+    }
+  }
+
+  for (size_t i = 0; i < num_workers; i++) {
+    pthread_mutex_destroy(&workers[i].deque.lock);
+  }
+  free(workers);
+  workers = NULL;
+  num_workers = 0;
+  return created == 0;
+}
+
+void scheduler_spawn(Task *task) {
+  Deque *deque = &current_worker->deque;
+  safe_mutex_lock(&deque->lock);
+  if (deque->bottom - deque->top == SCHED_DEQUE_SIZE) {
+    safe_mutex_unlock(&deque->lock);
+    task->run(task); // Deque is full, don't wait for a thief
+    return;
+  }
+  deque->tasks[deque->bottom % SCHED_DEQUE_SIZE] = task;
+  deque->bottom++;
+  safe_mutex_unlock(&deque->lock);
+
+  safe_mutex_lock(&idle_lock);
+  pthread_cond_signal(&work_cond);
+  safe_mutex_unlock(&idle_lock);
+}
+
+void scheduler_wait(atomic_size_t *pending) {
+  while (atomic_load(pending) > 0) {
+    Task *task = pop_local(current_worker);
+    if (task == NULL) {
+      task = steal(current_worker);
+    }
+    if (task != NULL) {
+      task->run(task);
+    } else {
+      sched_yield(); // Our remaining tasks are being run by thieves
+    }
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef KVS_SCHEDULER_H
+#define KVS_SCHEDULER_H
+
+// Number of tasks each worker's deque can hold. Tasks spawned into a full
+// deque are run right away by the spawning worker.
+#define SCHED_DEQUE_SIZE 256
+// How long an idle worker sleeps before looking for work again, in
+// microseconds, unless it is woken up by a spawn.
+#define SCHED_IDLE_WAIT_US 1000
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Unit of work. Tasks are embedded as the first member of a larger structure
+// holding their arguments.
+typedef struct Task {
+  void (*run)(struct Task *task);
+} Task;
+
+/// Runs a pool of workers until there is no work left. Each worker owns a
+/// deque of tasks: it pushes and pops at the bottom, and idle workers steal
+/// from the top of other deques. When no task is available anywhere, a worker
+/// asks next_root for a new independent task (e.g. a job file).
+/// @param num_workers Number of worker threads.
+/// @param next_root Returns the next root task, or NULL once there are none
+/// left. Called by one worker at a time.
+/// @return 0 if every worker ran until the end, 1 if no worker could be
+/// started.
+int scheduler_run(int num_workers, Task *(*next_root)(void));
+
+/// Pushes a task onto the calling worker's deque, where it may be stolen by
+/// an idle worker. Must be called from inside a task.
+/// @param task Task to be run.
+void scheduler_spawn(Task *task);
+
+/// Runs tasks from the calling worker's deque, or stolen from other workers,
+/// until the given counter drops to zero. Tasks decrement the counter
+/// themselves when they finish.
+/// @param pending Number of tasks still to finish.
+void scheduler_wait(atomic_size_t *pending);
+
+#endif // KVS_SCHEDULER_H
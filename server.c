@@ -0,0 +1,631 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "operations.h"
+#include "output.h"
+#include "parser.h"
+#include "server.h"
+
+// A client connection, owned by the event loop that accepted it. Its socket
+// never blocks: replies the client isn't reading yet are kept in unsent, and
+// no more commands are read from it until they are all sent.
+typedef struct Connection {
+  int fd;
+  size_t len;       // Number of bytes of in not parsed yet
+  int waiting;      // Whether a WAIT holds back the following commands
+  uint64_t wake_ms; // When the WAIT ends
+  uint32_t events;  // Events the loop waits for on the socket
+  char *unsent;     // Replies the socket didn't take yet
+  size_t unsent_len;
+  size_t unsent_cap;
+  struct Connection *prev;
+  struct Connection *next;
+  OutputBuffer out;
+  char in[SERVER_BUF_SIZE];
+} Connection;
+
+// Event loop run by one thread
+typedef struct EventLoop {
+  pthread_t thread;
+  int epoll_fd;
+  Connection *connections;
+  size_t num_waiting;
+  CommandBatch batch;
+  JobReader reader;
+} EventLoop;
+
+static int listen_fd = -1;
+static int stop_fd = -1; // Becomes readable once the server has to stop
+static const char *backup_dir = NULL; // Where BACKUP writes to
+static atomic_int next_backup = 1;
+
+// Told apart from connections in the epoll events by their address
+static char listen_marker;
+static char stop_marker;
+
+/*AUXILIARY FUNCTIONS*/
+
+/// Reads the monotonic clock.
+/// @return Current time in milliseconds.
+static uint64_t now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/// Changes the events the loop waits for on a connection.
+static void watch(EventLoop *loop, Connection *conn, uint32_t events) {
+  if (conn->events == events) {
+    return;
+  }
+  struct epoll_event event = {.events = events, .data.ptr = conn};
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+    perror("Failed to update connection events");
+    return;
+  }
+  conn->events = events;
+}
+
+/// Waits for what the connection can go on with: sending the replies left,
+/// the end of a WAIT, or more commands.
+static void watch_next(EventLoop *loop, Connection *conn) {
+  watch(loop, conn,
+        conn->unsent_len > 0 ? EPOLLOUT : conn->waiting ? 0 : EPOLLIN);
+}
+
+/// Sends bytes to a client, as many as its socket takes without blocking.
+/// @return Number of bytes sent, -1 if the connection failed.
+static ssize_t send_some(int fd, const char *data, size_t len) {
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t num_sent = send(fd, data + sent, len - sent, 0);
+    if (num_sent >= 0) {
+      sent += (size_t)num_sent;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return (ssize_t)sent;
+}
+
+/// Hand-off of the output of a connection. The replies are sent right away
+/// if nothing is queued before them, and whatever the socket doesn't take is
+/// queued in unsent.
+/// @return 0 on success, 1 if the connection failed.
+static int queue_replies(OutputBuffer *out, void *arg) {
+  Connection *conn = arg;
+  size_t sent = 0;
+  if (conn->unsent_len == 0) {
+    ssize_t num_sent = send_some(conn->fd, out->data, out->len);
+    if (num_sent == -1) {
+      return 1;
+    }
+    sent = (size_t)num_sent;
+  }
+
+  size_t left = out->len - sent;
+  if (conn->unsent_len + left > conn->unsent_cap) {
+    size_t capacity = conn->unsent_cap > 0 ? conn->unsent_cap * 2 : 4096;
+    while (capacity < conn->unsent_len + left) {
+      capacity *= 2;
+    }
+    char *unsent = realloc(conn->unsent, capacity);
+    if (unsent == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(1);
+    }
+    conn->unsent = unsent;
+    conn->unsent_cap = capacity;
+  }
+  memcpy(conn->unsent + conn->unsent_len, out->data + sent, left);
+  conn->unsent_len += left;
+  out->len = 0;
+  return 0;
+}
+
+static void close_connection(EventLoop *loop, Connection *conn) {
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    loop->connections = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+  if (conn->waiting) {
+    loop->num_waiting--;
+  }
+  // Closing the socket also removes it from the epoll set
+  close(conn->fd);
+  free(conn->unsent);
+  free(conn);
+}
+
+/// Writes a backup to the next server-N.bck file of the backup directory.
+/// @return 0 if the backup was started, 1 otherwise.
+static int start_backup() {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/server-%d.bck", backup_dir,
+           atomic_fetch_add(&next_backup, 1));
+  // Written in the background, the file is renamed once it's done
+  return kvs_backup(path);
+}
+
+/// Runs the next command of the reader and appends its reply to the output
+/// of the connection. A WAIT only gets its final reply once it ends.
+static void run_command(EventLoop *loop, Connection *conn) {
+  JobReader *reader = &loop->reader;
+  CommandBatch *batch = &loop->batch;
+  OutputBuffer *out = &conn->out;
+  const char *error = NULL;
+  unsigned int delay;
+
+  switch (get_next(reader)) {
+  case CMD_WRITE:
+    if (parse_write(reader, batch, MAX_WRITE_SIZE, MAX_STRING_SIZE) == 0) {
+      error = "Invalid command. See HELP for usage";
+    } else if (kvs_write(batch->count, batch->keys, batch->values)) {
+      error = "Failed to write pair";
+    }
+    break;
+
+  case CMD_READ:
+    if (parse_read_delete(reader, batch, MAX_WRITE_SIZE, MAX_STRING_SIZE) ==
+        0) {
+      error = "Invalid command. See HELP for usage";
+    } else if (kvs_read(batch->count, batch->keys, out)) {
+      error = "Failed to read pair";
+    }
+    break;
+
+  case CMD_DELETE:
+    if (parse_read_delete(reader, batch, MAX_WRITE_SIZE, MAX_STRING_SIZE) ==
+        0) {
+      error = "Invalid command. See HELP for usage";
+    } else if (kvs_delete(batch->count, batch->keys, out)) {
+      error = "Failed to delete pair";
+    }
+    break;
+
+  case CMD_SHOW:
+    kvs_show(out);
+    break;
+
+  case CMD_STATS:
+    kvs_stats(out);
+    break;
+
+  case CMD_RANGE:
+    if (parse_bounds(reader, batch, 2) == 0) {
+      error = "Invalid command. See HELP for usage";
+    } else if (kvs_range(batch->keys[0], batch->keys[1], out)) {
+      error = "Failed to read pairs";
+    }
+    break;
+
+  case CMD_PREFIX:
+    if (parse_bounds(reader, batch, 1) == 0) {
+      error = "Invalid command. See HELP for usage";
+    } else if (kvs_prefix(batch->keys[0], out)) {
+      error = "Failed to read pairs";
+    }
+    break;
+
+  case CMD_WAIT:
+    if (parse_wait(reader, &delay, NULL) == -1) {
+      error = "Invalid command. See HELP for usage";
+    } else if (delay > 0) {
+      // Only this connection waits, the loop keeps serving the others
+      output_puts(out, "Waiting...\n");
+      conn->waiting = 1;
+      conn->wake_ms = now_ms() + delay;
+      loop->num_waiting++;
+      return;
+    }
+    break;
+
+  case CMD_BACKUP:
+    if (start_backup()) {
+      error = "Failed to perform backup.";
+    }
+    break;
+
+  case CMD_HELP:
+    output_puts(out, PARSER_HELP_TEXT);
+    break;
+
+  case CMD_INVALID:
+    error = "Invalid command. See HELP for usage";
+    break;
+
+  case CMD_EMPTY:
+  case EOC:
+    return;
+  }
+
+  if (error != NULL) {
+    output_puts(out, SERVER_REPLY_ERROR);
+    output_puts(out, error);
+    output_puts(out, "\n");
+  } else {
+    output_puts(out, SERVER_REPLY_OK);
+  }
+}
+
+/// Runs every complete command received on a connection, up to the first
+/// WAIT, and sends the replies.
+/// @return 0 on success, 1 if the connection has to be closed.
+static int serve_commands(EventLoop *loop, Connection *conn) {
+  size_t complete = conn->len;
+  while (complete > 0 && conn->in[complete - 1] != '\n') {
+    complete--;
+  }
+  if (complete == 0 && conn->len == SERVER_BUF_SIZE) {
+    output_puts(&conn->out, SERVER_REPLY_ERROR "Command too long\n");
+    output_flush(&conn->out);
+    return 1;
+  }
+
+  job_reader_init_buffer(&loop->reader, conn->in, complete);
+  while (!conn->waiting && loop->reader.pos < complete) {
+    run_command(loop, conn);
+    output_end_command(&conn->out);
+  }
+  conn->len -= loop->reader.pos;
+  memmove(conn->in, conn->in + loop->reader.pos, conn->len);
+
+  // Whatever arrives during a WAIT, or before the replies are sent, stays
+  // in the socket until then
+  int result = output_flush(&conn->out);
+  watch_next(loop, conn);
+  return result;
+}
+
+/// Receives what a client sent and runs the commands it completes.
+static void handle_input(EventLoop *loop, Connection *conn) {
+  ssize_t received = recv(conn->fd, conn->in + conn->len,
+                          SERVER_BUF_SIZE - conn->len, MSG_DONTWAIT);
+  if (received == 0 ||
+      (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+       errno != EINTR)) {
+    close_connection(loop, conn);
+    return;
+  }
+  if (received > 0) {
+    conn->len += (size_t)received;
+  }
+  if (serve_commands(loop, conn)) {
+    close_connection(loop, conn);
+  }
+}
+
+/// Sends the replies a connection still has queued, and goes back to reading
+/// its commands once they are all sent.
+static void handle_output(EventLoop *loop, Connection *conn) {
+  ssize_t sent = send_some(conn->fd, conn->unsent, conn->unsent_len);
+  if (sent == -1) {
+    close_connection(loop, conn);
+    return;
+  }
+  conn->unsent_len -= (size_t)sent;
+  memmove(conn->unsent, conn->unsent + sent, conn->unsent_len);
+  watch_next(loop, conn);
+}
+
+/// Ends the WAITs that are due and resumes their connections.
+static void wake_connections(EventLoop *loop) {
+  if (loop->num_waiting == 0) {
+    return;
+  }
+
+  uint64_t now = now_ms();
+  Connection *conn = loop->connections;
+  while (conn != NULL) {
+    Connection *next = conn->next;
+    if (conn->waiting && conn->wake_ms <= now) {
+      conn->waiting = 0;
+      loop->num_waiting--;
+      output_puts(&conn->out, SERVER_REPLY_OK);
+      if (serve_commands(loop, conn)) {
+        close_connection(loop, conn);
+      }
+    }
+    conn = next;
+  }
+}
+
+/// Calculates how long the loop may block before a WAIT ends.
+/// @return Timeout for epoll_wait, in milliseconds.
+static int next_timeout(EventLoop *loop) {
+  if (loop->num_waiting == 0) {
+    return -1;
+  }
+
+  uint64_t now = now_ms();
+  uint64_t timeout = INT_MAX;
+  for (Connection *conn = loop->connections; conn != NULL; conn = conn->next) {
+    if (conn->waiting) {
+      uint64_t left = conn->wake_ms > now ? conn->wake_ms - now : 0;
+      timeout = left < timeout ? left : timeout;
+    }
+  }
+  return (int)timeout;
+}
+
+static void accept_connections(EventLoop *loop) {
+  while (1) {
+    // The listener is shared, another loop may take the connection first
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("Failed to accept connection");
+      }
+      return;
+    }
+    // Replies are written as soon as a batch of commands is run. Fails
+    // harmlessly on Unix domain sockets.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // A client that stops reading must not block the loop
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+      perror("Failed to make connection non-blocking");
+      close(fd);
+      continue;
+    }
+
+    Connection *conn = safe_malloc(sizeof(Connection));
+    conn->fd = fd;
+    conn->len = 0;
+    conn->waiting = 0;
+    conn->events = EPOLLIN;
+    conn->unsent = NULL;
+    conn->unsent_len = 0;
+    conn->unsent_cap = 0;
+    conn->prev = NULL;
+    conn->next = loop->connections;
+    output_init(&conn->out, fd);
+    conn->out.hand_off = queue_replies;
+    conn->out.hand_off_arg = conn;
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      perror("Failed to watch connection");
+      close(fd);
+      free(conn);
+      continue;
+    }
+    if (loop->connections != NULL) {
+      loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+  }
+}
+
+static void *event_loop(void *arg) {
+  EventLoop *loop = arg;
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  int running = 1;
+
+  while (running) {
+    int num_events = epoll_wait(loop->epoll_fd, events, SERVER_MAX_EVENTS,
+                                next_timeout(loop));
+    if (num_events == -1 && errno != EINTR) {
+      perror("Failed to wait for events");
+      break;
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &stop_marker) {
+        running = 0;
+      } else if (ptr == &listen_marker) {
+        accept_connections(loop);
+      } else if (((Connection *)ptr)->unsent_len > 0) {
+        handle_output(loop, ptr);
+      } else {
+        handle_input(loop, ptr);
+      }
+    }
+    wake_connections(loop);
+  }
+
+  // Replies the clients aren't reading by now are dropped
+  while (loop->connections != NULL) {
+    output_flush(&loop->connections->out);
+    close_connection(loop, loop->connections);
+  }
+  return NULL;
+}
+
+/// Creates the listening socket of the server.
+/// @return The socket, or -1 on error.
+static int open_listener(const char *address) {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  if (server_resolve(address, &addr, &addr_len)) {
+    fprintf(stderr, "Invalid server address: %s\n", address);
+    return -1;
+  }
+
+  int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("Failed to create socket");
+    return -1;
+  }
+  int one = 1;
+  if (addr.ss_family == AF_UNIX) {
+    // A socket file left behind by a previous run would make bind fail
+    unlink(((struct sockaddr_un *)&addr)->sun_path);
+  } else {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr, addr_len) == -1 ||
+      listen(fd, SERVER_BACKLOG) == -1 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+    perror("Failed to listen on server address");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/// Creates the epoll set of a loop, which watches the listener and stop_fd.
+/// @return 0 on success, 1 on error.
+static int init_loop(EventLoop *loop) {
+  loop->connections = NULL;
+  loop->num_waiting = 0;
+  loop->epoll_fd = epoll_create1(0);
+  if (loop->epoll_fd == -1) {
+    return 1;
+  }
+
+  // Only one of the loops is woken up per incoming connection
+  struct epoll_event listen_event = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                                     .data.ptr = &listen_marker};
+  struct epoll_event stop_event = {.events = EPOLLIN, .data.ptr = &stop_marker};
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) ==
+          -1 ||
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, stop_fd, &stop_event) == -1) {
+    close(loop->epoll_fd);
+    return 1;
+  }
+  return 0;
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+int server_resolve(const char *address, struct sockaddr_storage *addr,
+                   socklen_t *addr_len) {
+  memset(addr, 0, sizeof(*addr));
+
+  size_t prefix_len = strlen(SERVER_UNIX_PREFIX);
+  if (strncmp(address, SERVER_UNIX_PREFIX, prefix_len) == 0) {
+    const char *path = address + prefix_len;
+    struct sockaddr_un *unix_addr = (struct sockaddr_un *)addr;
+    if (path[0] == '\0' || strlen(path) >= sizeof(unix_addr->sun_path)) {
+      return 1;
+    }
+    unix_addr->sun_family = AF_UNIX;
+    strcpy(unix_addr->sun_path, path);
+    *addr_len = sizeof(*unix_addr);
+    return 0;
+  }
+
+  char host[256] = SERVER_DEFAULT_HOST;
+  const char *port = address;
+  const char *colon = strrchr(address, ':');
+  if (colon != NULL) {
+    size_t host_len = (size_t)(colon - address);
+    if (host_len >= sizeof(host)) {
+      return 1;
+    }
+    if (host_len > 0) {
+      memcpy(host, address, host_len);
+      host[host_len] = '\0';
+    }
+    port = colon + 1;
+  }
+
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *result;
+  if (port[0] == '\0' || getaddrinfo(host, port, &hints, &result) != 0) {
+    return 1;
+  }
+  memcpy(addr, result->ai_addr, result->ai_addrlen);
+  *addr_len = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+int server_run(const char *address, int num_threads,
+               const char *backup_path) {
+  backup_dir = backup_path;
+
+  // Only this thread takes the stop signals, the loops inherit the mask.
+  // Clients that go away are noticed through failed writes instead.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  listen_fd = open_listener(address);
+  if (listen_fd == -1) {
+    return 1;
+  }
+  stop_fd = eventfd(0, 0);
+  if (stop_fd == -1) {
+    perror("Failed to create eventfd");
+    close(listen_fd);
+    return 1;
+  }
+
+  EventLoop **loops = safe_malloc((size_t)num_threads * sizeof(EventLoop *));
+  int started = 0;
+  for (; started < num_threads; started++) {
+    EventLoop *loop = safe_malloc(sizeof(EventLoop));
+    if (init_loop(loop)) {
+      free(loop);
+      break;
+    }
+    if (pthread_create(&loop->thread, NULL, event_loop, loop) != 0) {
+      close(loop->epoll_fd);
+      free(loop);
+      break;
+    }
+    loops[started] = loop;
+  }
+
+  if (started > 0) {
+    printf("Listening on %s\n", address);
+    fflush(stdout);
+    int signal_number;
+    sigwait(&signals, &signal_number);
+  } else {
+    fprintf(stderr, "Failed to start event loops\n");
+  }
+
+  // The eventfd stays readable, so every loop sees it
+  uint64_t one = 1;
+  if (write(stop_fd, &one, sizeof(one)) == -1) {
+    perror("Failed to stop event loops");
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(loops[i]->thread, NULL);
+    close(loops[i]->epoll_fd);
+    free(loops[i]);
+  }
+  free(loops);
+
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  if (server_resolve(address, &addr, &addr_len) == 0 &&
+      addr.ss_family == AF_UNIX) {
+    unlink(((struct sockaddr_un *)&addr)->sun_path);
+  }
+  close(listen_fd);
+  close(stop_fd);
+  return started > 0 ? 0 : 1;
+}
@@ -0,0 +1,43 @@
+#ifndef KVS_SERVER_H
+#define KVS_SERVER_H
+
+// Size of the buffer each connection receives commands into. A command has to
+// fit in it whole.
+#define SERVER_BUF_SIZE 65536
+// Maximum number of events an event loop handles per epoll_wait.
+#define SERVER_MAX_EVENTS 64
+// Length of the queue of connections waiting to be accepted.
+#define SERVER_BACKLOG 128
+// Prefix of the addresses of Unix domain sockets.
+#define SERVER_UNIX_PREFIX "unix:"
+// Host TCP addresses given only as a port are bound to.
+#define SERVER_DEFAULT_HOST "127.0.0.1"
+
+// Every command but an empty line or a comment is answered with its output,
+// as it would be written to a .out file, followed by one of these lines.
+#define SERVER_REPLY_OK "OK\n"
+#define SERVER_REPLY_ERROR "ERR "
+
+#include <sys/socket.h>
+
+/// Resolves a server address: "unix:<path>" for a Unix domain socket,
+/// "<host>:<port>" or just "<port>" for TCP.
+/// @param address Address to be resolved.
+/// @param addr Output socket address.
+/// @param addr_len Output size of the socket address.
+/// @return 0 on success, 1 if the address is invalid.
+int server_resolve(const char *address, struct sockaddr_storage *addr,
+                   socklen_t *addr_len);
+
+/// Serves the KVS on the given address until SIGINT or SIGTERM. Each thread
+/// runs an epoll event loop over its own connections, and runs the commands
+/// received on them in order, so clients may pipeline them.
+/// @param address Address to listen on, see server_resolve.
+/// @param num_threads Number of event loop threads.
+/// @param backup_path Directory the backups requested by clients go to, as
+/// server-1.bck, server-2.bck, ...
+/// @return 0 once the server stopped, 1 if it couldn't be started.
+int server_run(const char *address, int num_threads,
+               const char *backup_path);
+
+#endif // KVS_SERVER_H
@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flat_table.h"
+#include "kvs.h"
+#include "operations.h"
+#include "shard.h"
+
+#define SHARD_CACHE_LINE 64
+
+enum ShardOp { SHARD_WRITE, SHARD_READ, SHARD_DELETE, SHARD_SCAN };
+
+// Lets a thread sleep until another one has something for it. The sleeper
+// sets sleeping before checking for work one last time, and the waker makes
+// the work visible before checking sleeping, so one of them always sees the
+// other.
+typedef struct ShardWaiter {
+  atomic_int sleeping;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ShardWaiter;
+
+// Requests of a batch still being run by the shards
+typedef struct ShardCall {
+  atomic_size_t pending;
+  ShardWaiter *waiter; // Of the client waiting for the call
+} ShardCall;
+
+// Part of a batch sent to a shard. It lives on the stack of the client,
+// which waits for it to be run.
+typedef struct ShardRequest {
+  enum ShardOp op;
+  const size_t *indexes; // Positions in the batch of the keys of the shard
+  size_t num_keys;
+  const StringView *keys;
+  const StringView *values;
+  char (*results)[MAX_STRING_SIZE];
+  int *found;
+  PairVisitor visit;
+  void *arg;
+  int result; // Of the visitor
+  ShardCall *call;
+} ShardRequest;
+
+// Requests from a single client to a single shard. The client only writes
+// tail, the shard only writes head, each on its own cache line.
+typedef struct ShardQueue {
+  _Alignas(SHARD_CACHE_LINE) atomic_size_t head;
+  _Alignas(SHARD_CACHE_LINE) atomic_size_t tail;
+  ShardRequest *requests[SHARD_QUEUE_SIZE];
+} ShardQueue;
+
+typedef struct Shard {
+  FlatTable *table; // Only touched by the worker
+  ShardQueue *inbox; // A queue per client slot
+  ShardWaiter waiter;
+  pthread_t thread;
+  struct ShardSet *set;
+  int cpu; // CPU the worker is pinned to, -1 for none
+} Shard;
+
+// Thread sending requests to the shards
+typedef struct ShardClient {
+  atomic_int in_use;
+  size_t id; // Index of its queue in the inbox of every shard
+  ShardWaiter waiter;
+} ShardClient;
+
+struct ShardSet {
+  Shard shards[SHARD_MAX];
+  size_t num_shards;
+  ShardClient clients[SHARD_MAX_CLIENTS];
+  atomic_size_t num_clients; // Client slots ever used, polled by the shards
+  pthread_key_t client_key;  // ShardClient of the calling thread
+  atomic_int stopping;
+};
+
+/*AUXILIARY FUNCTIONS*/
+
+static void waiter_init(ShardWaiter *waiter) {
+  atomic_init(&waiter->sleeping, 0);
+  pthread_mutex_init(&waiter->lock, NULL);
+  pthread_cond_init(&waiter->cond, NULL);
+}
+
+static void waiter_destroy(ShardWaiter *waiter) {
+  pthread_mutex_destroy(&waiter->lock);
+  pthread_cond_destroy(&waiter->cond);
+}
+
+/// Sleeps until woken, at most SHARD_SLEEP_MS, unless there is work already.
+/// @param ready Tells whether there is work.
+static void waiter_sleep(ShardWaiter *waiter, int (*ready)(void *),
+                         void *arg) {
+  safe_mutex_lock(&waiter->lock);
+  atomic_store(&waiter->sleeping, 1);
+  if (!ready(arg)) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += SHARD_SLEEP_MS * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&waiter->cond, &waiter->lock, &until);
+  }
+  atomic_store(&waiter->sleeping, 0);
+  safe_mutex_unlock(&waiter->lock);
+}
+
+/// Wakes the owner of the waiter, if it sleeps. Must be called after the
+/// work for it is visible.
+static void waiter_wake(ShardWaiter *waiter) {
+  if (atomic_load(&waiter->sleeping)) {
+    safe_mutex_lock(&waiter->lock);
+    pthread_cond_signal(&waiter->cond);
+    safe_mutex_unlock(&waiter->lock);
+  }
+}
+
+/// Adds a request to a queue, waiting for room if it is full.
+static void queue_push(ShardQueue *queue, ShardRequest *request) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  while (tail - atomic_load_explicit(&queue->head, memory_order_acquire) ==
+         SHARD_QUEUE_SIZE) {
+    sched_yield();
+  }
+  queue->requests[tail & (SHARD_QUEUE_SIZE - 1)] = request;
+  // Sequentially consistent, against the shard going to sleep
+  atomic_store(&queue->tail, tail + 1);
+}
+
+/// Takes the oldest request of a queue.
+/// @return The request, NULL if the queue is empty.
+static ShardRequest *queue_pop(ShardQueue *queue) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  if (head == atomic_load(&queue->tail)) {
+    return NULL;
+  }
+  ShardRequest *request = queue->requests[head & (SHARD_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return request;
+}
+
+/// Tells whether a shard has requests queued.
+static int shard_ready(void *arg) {
+  Shard *shard = arg;
+  if (atomic_load(&shard->set->stopping)) {
+    return 1;
+  }
+  size_t num_clients = atomic_load(&shard->set->num_clients);
+  for (size_t i = 0; i < num_clients; i++) {
+    ShardQueue *queue = &shard->inbox[i];
+    if (atomic_load_explicit(&queue->head, memory_order_relaxed) !=
+        atomic_load(&queue->tail)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Tells whether every request of a call was run.
+static int call_done(void *arg) {
+  ShardCall *call = arg;
+  return atomic_load(&call->pending) == 0;
+}
+
+/// Copies a key or value into a null-terminated buffer.
+static void copy_view(char *dest, StringView view) {
+  memcpy(dest, view.data, view.len);
+  dest[view.len] = '\0';
+}
+
+/// Runs a request on the table of a shard, then completes it. The request
+/// belongs to its client again once completed.
+static void run_request(Shard *shard, ShardRequest *request) {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  for (size_t i = 0; i < request->num_keys; i++) {
+    size_t index = request->indexes[i];
+    copy_view(key, request->keys[index]);
+    switch (request->op) {
+    case SHARD_WRITE:
+      copy_view(value, request->values[index]);
+      if (flat_write_pair(shard->table, key, value) != 0) {
+        fprintf(stderr, "Failed to write keypair (%s,%s)\n", key, value);
+      }
+      break;
+    case SHARD_READ: {
+      const char *result = flat_read_pair(shard->table, key);
+      request->found[index] = result != NULL;
+      if (result != NULL) {
+        strcpy(request->results[index], result);
+      }
+      break;
+    }
+    case SHARD_DELETE:
+      request->found[index] = flat_delete_pair(shard->table, key) == 0;
+      break;
+    case SHARD_SCAN:
+      break;
+    }
+  }
+  if (request->op == SHARD_SCAN) {
+    FlatTable *table = shard->table;
+    request->result = 0;
+    for (size_t i = 0; i < table->capacity && !request->result; i++) {
+      if (table->tags[i] != 0) {
+        request->result = request->visit(request->arg, table->slots[i].key,
+                                         table->slots[i].value);
+      }
+    }
+  }
+
+  // The call may be gone as soon as pending drops to 0
+  ShardWaiter *waiter = request->call->waiter;
+  if (atomic_fetch_sub(&request->call->pending, 1) == 1) {
+    waiter_wake(waiter);
+  }
+}
+
+/// Pins the calling thread to a CPU, if it can.
+static void pin_to_cpu(int cpu) {
+  if (cpu < 0) {
+    return;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET((size_t)cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+/// Worker of a shard: runs the requests of every client, in the order each
+/// client sent them, until the set stops.
+static void *shard_main(void *arg) {
+  Shard *shard = arg;
+  pin_to_cpu(shard->cpu);
+  unsigned idle = 0;
+  while (1) {
+    int worked = 0;
+    size_t num_clients = atomic_load(&shard->set->num_clients);
+    for (size_t i = 0; i < num_clients; i++) {
+      ShardRequest *request;
+      while ((request = queue_pop(&shard->inbox[i])) != NULL) {
+        run_request(shard, request);
+        worked = 1;
+      }
+    }
+    if (worked) {
+      idle = 0;
+    } else if (atomic_load(&shard->set->stopping)) {
+      return NULL;
+    } else if (++idle < SHARD_SPINS) {
+      sched_yield();
+    } else {
+      waiter_sleep(&shard->waiter, shard_ready, shard);
+      idle = 0;
+    }
+  }
+}
+
+/// Frees the client slot of a thread when it exits.
+static void release_client(void *arg) {
+  ShardClient *client = arg;
+  atomic_store(&client->in_use, 0);
+}
+
+/// Returns the client slot of the calling thread, taking a free one on its
+/// first request.
+static ShardClient *get_client(ShardSet *set) {
+  ShardClient *client = pthread_getspecific(set->client_key);
+  if (client != NULL) {
+    return client;
+  }
+  while (1) {
+    for (size_t i = 0; i < SHARD_MAX_CLIENTS; i++) {
+      int free_slot = 0;
+      if (atomic_compare_exchange_strong(&set->clients[i].in_use, &free_slot,
+                                         1)) {
+        // Shards poll every slot below num_clients
+        size_t used = atomic_load(&set->num_clients);
+        while (used <= i && !atomic_compare_exchange_weak(&set->num_clients,
+                                                          &used, i + 1)) {
+        }
+        pthread_setspecific(set->client_key, &set->clients[i]);
+        return &set->clients[i];
+      }
+    }
+    sched_yield(); // Every slot is taken, wait for a thread to exit
+  }
+}
+
+/// Shard of a key.
+static size_t shard_of(const ShardSet *set, StringView key) {
+  // The flat tables use the low bits of the hash, the shards the high ones
+  uint64_t high = hash(key.data, key.len) >> 32;
+  return (size_t)((high * set->num_shards) >> 32);
+}
+
+/// Sends the requests of a call and waits for every one to be run.
+static void run_call(ShardSet *set, ShardRequest *requests,
+                     const size_t *shards, size_t num_requests) {
+  ShardClient *client = get_client(set);
+  ShardCall call;
+  atomic_init(&call.pending, num_requests);
+  call.waiter = &client->waiter;
+  for (size_t i = 0; i < num_requests; i++) {
+    Shard *shard = &set->shards[shards[i]];
+    requests[i].call = &call;
+    queue_push(&shard->inbox[client->id], &requests[i]);
+    waiter_wake(&shard->waiter);
+  }
+  for (unsigned spins = 0; !call_done(&call); spins++) {
+    if (spins < SHARD_SPINS) {
+      sched_yield();
+    } else {
+      waiter_sleep(&client->waiter, call_done, &call);
+    }
+  }
+}
+
+/// Splits a batch by shard and runs it.
+static void run_batch(ShardSet *set, enum ShardOp op, size_t num_keys,
+                      const StringView *keys, const StringView *values,
+                      char (*results)[MAX_STRING_SIZE], int *found) {
+  // Positions of the keys grouped by shard, in batch order within a shard
+  size_t key_shards[MAX_WRITE_SIZE];
+  size_t counts[SHARD_MAX] = {0};
+  for (size_t i = 0; i < num_keys; i++) {
+    key_shards[i] = shard_of(set, keys[i]);
+    counts[key_shards[i]]++;
+  }
+  size_t starts[SHARD_MAX];
+  size_t offset = 0;
+  for (size_t s = 0; s < set->num_shards; s++) {
+    starts[s] = offset;
+    offset += counts[s];
+  }
+  size_t indexes[MAX_WRITE_SIZE];
+  size_t next[SHARD_MAX];
+  memcpy(next, starts, sizeof(next));
+  for (size_t i = 0; i < num_keys; i++) {
+    indexes[next[key_shards[i]]++] = i;
+  }
+
+  ShardRequest requests[SHARD_MAX];
+  size_t shards[SHARD_MAX];
+  size_t num_requests = 0;
+  for (size_t s = 0; s < set->num_shards; s++) {
+    if (counts[s] == 0) {
+      continue;
+    }
+    ShardRequest *request = &requests[num_requests];
+    request->op = op;
+    request->indexes = &indexes[starts[s]];
+    request->num_keys = counts[s];
+    request->keys = keys;
+    request->values = values;
+    request->results = results;
+    request->found = found;
+    shards[num_requests++] = s;
+  }
+  run_call(set, requests, shards, num_requests);
+}
+
+/// Picks the CPUs the shards are pinned to, in turn among the ones the
+/// process may run on.
+static void assign_cpus(ShardSet *set) {
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE];
+  int num_cpus = 0;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET((size_t)cpu, &allowed)) {
+        cpus[num_cpus++] = cpu;
+      }
+    }
+  }
+  for (size_t s = 0; s < set->num_shards; s++) {
+    set->shards[s].cpu = num_cpus > 0 ? cpus[s % (size_t)num_cpus] : -1;
+  }
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+ShardSet *shard_start(size_t num_shards) {
+  if (num_shards == 0 || num_shards > SHARD_MAX) {
+    fprintf(stderr, "Invalid number of shards: %zu\n", num_shards);
+    return NULL;
+  }
+  ShardSet *set = safe_malloc(sizeof(ShardSet));
+  set->num_shards = num_shards;
+  atomic_init(&set->num_clients, 0);
+  atomic_init(&set->stopping, 0);
+  for (size_t i = 0; i < SHARD_MAX_CLIENTS; i++) {
+    atomic_init(&set->clients[i].in_use, 0);
+    set->clients[i].id = i;
+    waiter_init(&set->clients[i].waiter);
+  }
+  pthread_key_create(&set->client_key, release_client);
+  assign_cpus(set);
+
+  size_t inbox_size = SHARD_MAX_CLIENTS * sizeof(ShardQueue);
+  for (size_t s = 0; s < num_shards; s++) {
+    Shard *shard = &set->shards[s];
+    shard->set = set;
+    shard->table = create_flat_table(FLAT_INITIAL_CAPACITY);
+    shard->inbox = aligned_alloc(SHARD_CACHE_LINE, inbox_size);
+    if (shard->table == NULL || shard->inbox == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(1);
+    }
+    for (size_t i = 0; i < SHARD_MAX_CLIENTS; i++) {
+      atomic_init(&shard->inbox[i].head, 0);
+      atomic_init(&shard->inbox[i].tail, 0);
+    }
+    waiter_init(&shard->waiter);
+  }
+  for (size_t s = 0; s < num_shards; s++) {
+    if (pthread_create(&set->shards[s].thread, NULL, shard_main,
+                       &set->shards[s]) != 0) {
+      fprintf(stderr, "Failed to start shard %zu\n", s);
+      for (size_t r = s; r < num_shards; r++) {
+        free_flat_table(set->shards[r].table);
+        free(set->shards[r].inbox);
+        waiter_destroy(&set->shards[r].waiter);
+      }
+      set->num_shards = s; // Only stop the ones running
+      shard_stop(set);
+      return NULL;
+    }
+  }
+  return set;
+}
+
+void shard_write(ShardSet *set, size_t num_pairs, const StringView *keys,
+                 const StringView *values) {
+  run_batch(set, SHARD_WRITE, num_pairs, keys, values, NULL, NULL);
+}
+
+void shard_read(ShardSet *set, size_t num_keys, const StringView *keys,
+                char (*values)[MAX_STRING_SIZE], int *found) {
+  run_batch(set, SHARD_READ, num_keys, keys, NULL, values, found);
+}
+
+void shard_delete(ShardSet *set, size_t num_keys, const StringView *keys,
+                  int *found) {
+  run_batch(set, SHARD_DELETE, num_keys, keys, NULL, NULL, found);
+}
+
+int shard_scan(ShardSet *set, PairVisitor visit, void *arg) {
+  // One shard at a time, so the visitor is never called concurrently
+  for (size_t s = 0; s < set->num_shards; s++) {
+    ShardRequest request = {.op = SHARD_SCAN, .visit = visit, .arg = arg};
+    run_call(set, &request, &s, 1);
+    if (request.result) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void shard_stop(ShardSet *set) {
+  atomic_store(&set->stopping, 1);
+  for (size_t s = 0; s < set->num_shards; s++) {
+    waiter_wake(&set->shards[s].waiter);
+    pthread_join(set->shards[s].thread, NULL);
+  }
+  for (size_t s = 0; s < set->num_shards; s++) {
+    free_flat_table(set->shards[s].table);
+    free(set->shards[s].inbox);
+    waiter_destroy(&set->shards[s].waiter);
+  }
+  for (size_t i = 0; i < SHARD_MAX_CLIENTS; i++) {
+    waiter_destroy(&set->clients[i].waiter);
+  }
+  pthread_key_delete(set->client_key);
+  free(set);
+}
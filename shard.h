@@ -0,0 +1,75 @@
+#ifndef KVS_SHARD_H
+#define KVS_SHARD_H
+
+// Most shards a set can have.
+#define SHARD_MAX 64
+// Most threads sending requests to a set at once. The slot of a thread is
+// freed when it exits.
+#define SHARD_MAX_CLIENTS 256
+// Requests a client can have queued to a shard. Must be a power of two.
+#define SHARD_QUEUE_SIZE 16
+// Times an idle shard polls its queues, and a client its reply, before going
+// to sleep until woken.
+#define SHARD_SPINS 256
+// Longest sleep of an idle shard or client, in case a wake-up is missed.
+#define SHARD_SLEEP_MS 10
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "pair_sort.h"
+#include "string_view.h"
+
+// Keys split among shards by hash, each shard a FlatTable owned by a worker
+// thread pinned to a CPU. Other threads never touch the tables: they send
+// requests to the workers over a single-producer single-consumer queue per
+// client and shard, and wait for the replies. A batch is only atomic within
+// each shard it touches.
+typedef struct ShardSet ShardSet;
+
+/// Creates the shards and starts their workers, pinned to the CPUs the
+/// process may run on in turn.
+/// @param num_shards Number of shards, at most SHARD_MAX.
+/// @return The new set, NULL if a worker could not be started.
+ShardSet *shard_start(size_t num_shards);
+
+/// Writes pairs, each to the shard of its key.
+/// @param set Set to write to.
+/// @param num_pairs Number of pairs, at most MAX_WRITE_SIZE.
+/// @param keys Keys of the pairs, shorter than MAX_STRING_SIZE.
+/// @param values Values of the pairs, shorter than MAX_STRING_SIZE.
+void shard_write(ShardSet *set, size_t num_pairs, const StringView *keys,
+                 const StringView *values);
+
+/// Reads the values of keys.
+/// @param set Set to read from.
+/// @param num_keys Number of keys, at most MAX_WRITE_SIZE.
+/// @param keys Keys to read.
+/// @param values Output array with the null-terminated value of every key
+/// found.
+/// @param found Output array telling whether every key was found.
+void shard_read(ShardSet *set, size_t num_keys, const StringView *keys,
+                char (*values)[MAX_STRING_SIZE], int *found);
+
+/// Deletes keys.
+/// @param set Set to delete from.
+/// @param num_keys Number of keys, at most MAX_WRITE_SIZE.
+/// @param keys Keys to delete.
+/// @param found Output array telling whether every key was there.
+void shard_delete(ShardSet *set, size_t num_keys, const StringView *keys,
+                  int *found);
+
+/// Visits every pair of the set, a shard at a time, on the thread of the
+/// shard. Each shard is seen at a single point in time, but not all at the
+/// same one.
+/// @param set Set to scan.
+/// @param visit Called for every pair, in no particular order.
+/// @param arg Argument passed to visit.
+/// @return 0 on success, 1 if visit stopped the scan.
+int shard_scan(ShardSet *set, PairVisitor visit, void *arg);
+
+/// Stops the workers and frees the set. No request may be in progress.
+/// @param set Set to be freed.
+void shard_stop(ShardSet *set);
+
+#endif // KVS_SHARD_H
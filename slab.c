@@ -0,0 +1,258 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "operations.h"
+#include "slab.h"
+
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / SLAB_ALIGN)
+
+// Free blocks are linked through their first word
+typedef struct FreeBlock {
+  struct FreeBlock *next;
+} FreeBlock;
+
+// Header of a chunk, the blocks follow it
+typedef struct Chunk {
+  struct Chunk *next;
+  char blocks[];
+} Chunk;
+
+// Blocks of one size shared by every thread
+typedef struct SizeClass {
+  pthread_mutex_t lock;
+  FreeBlock *free;
+  char *bump; // Next uncarved block of the newest chunk
+  char *end;
+  Chunk *chunks;
+} SizeClass;
+
+// Per-thread cache. Only the owner touches the lists, the counters are also
+// read by slab_stats.
+typedef struct SlabCache {
+  FreeBlock *free[SLAB_NUM_CLASSES];
+  size_t count[SLAB_NUM_CLASSES];
+  atomic_size_t allocations;
+  atomic_size_t large;
+  struct SlabCache *next;
+} SlabCache;
+
+static SizeClass classes[SLAB_NUM_CLASSES];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+// Caches of the running threads, and the counters of the finished ones
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static SlabCache *caches = NULL;
+static SlabStats finished = {0, 0, 0};
+static atomic_size_t chunks = 0;
+
+static _Thread_local SlabCache *local_cache = NULL;
+
+/*AUXILIARY FUNCTIONS*/
+
+/// Bumps a counter only its owner thread writes to.
+static void count(atomic_size_t *counter) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+/// Hands back the first n blocks of a cache's list to the shared pool.
+static void give_back(SlabCache *cache, size_t class, size_t n) {
+  FreeBlock *first = cache->free[class];
+  FreeBlock *last = first;
+  for (size_t i = 1; i < n; i++) {
+    last = last->next;
+  }
+  cache->free[class] = last->next;
+  cache->count[class] -= n;
+
+  SizeClass *size_class = &classes[class];
+  safe_mutex_lock(&size_class->lock);
+  last->next = size_class->free;
+  size_class->free = first;
+  safe_mutex_unlock(&size_class->lock);
+}
+
+/// Returns every cached block to the shared pool when a thread exits.
+static void destroy_cache(void *arg) {
+  SlabCache *cache = arg;
+  for (size_t class = 0; class < SLAB_NUM_CLASSES; class++) {
+    if (cache->count[class] > 0) {
+      give_back(cache, class, cache->count[class]);
+    }
+  }
+
+  safe_mutex_lock(&caches_lock);
+  SlabCache **link = &caches;
+  while (*link != cache) {
+    link = &(*link)->next;
+  }
+  *link = cache->next;
+  finished.allocations += atomic_load(&cache->allocations);
+  finished.large += atomic_load(&cache->large);
+  safe_mutex_unlock(&caches_lock);
+  free(cache);
+}
+
+static void init_classes() {
+  for (size_t class = 0; class < SLAB_NUM_CLASSES; class++) {
+    pthread_mutex_init(&classes[class].lock, NULL);
+    classes[class].free = NULL;
+    classes[class].bump = NULL;
+    classes[class].end = NULL;
+    classes[class].chunks = NULL;
+  }
+  pthread_key_create(&cache_key, destroy_cache);
+}
+
+/// Returns the cache of the calling thread, creating it on first use.
+static SlabCache *get_cache() {
+  if (local_cache != NULL) {
+    return local_cache;
+  }
+  pthread_once(&init_once, init_classes);
+
+  SlabCache *cache = calloc(1, sizeof(SlabCache));
+  if (cache == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    exit(1);
+  }
+  pthread_setspecific(cache_key, cache);
+  safe_mutex_lock(&caches_lock);
+  cache->next = caches;
+  caches = cache;
+  safe_mutex_unlock(&caches_lock);
+  local_cache = cache;
+  return cache;
+}
+
+/// Moves up to SLAB_CACHE_SIZE / 2 blocks of the shared pool into the cache,
+/// carving new ones out of a chunk if the pool runs dry.
+static void refill(SlabCache *cache, size_t class) {
+  SizeClass *size_class = &classes[class];
+  size_t block_size = (class + 1) * SLAB_ALIGN;
+  size_t wanted = SLAB_CACHE_SIZE / 2;
+
+  safe_mutex_lock(&size_class->lock);
+  while (cache->count[class] < wanted) {
+    FreeBlock *block = size_class->free;
+    if (block != NULL) {
+      size_class->free = block->next;
+    } else {
+      if (size_class->bump == size_class->end) {
+        Chunk *chunk = safe_malloc(SLAB_CHUNK_SIZE);
+        chunk->next = size_class->chunks;
+        size_class->chunks = chunk;
+        size_t num_blocks = (SLAB_CHUNK_SIZE - sizeof(Chunk)) / block_size;
+        size_class->bump = chunk->blocks;
+        size_class->end = chunk->blocks + num_blocks * block_size;
+        atomic_fetch_add(&chunks, 1);
+      }
+      block = (FreeBlock *)(void *)size_class->bump;
+      size_class->bump += block_size;
+    }
+    block->next = cache->free[class];
+    cache->free[class] = block;
+    cache->count[class]++;
+  }
+  safe_mutex_unlock(&size_class->lock);
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+void *slab_alloc(size_t size) {
+  SlabCache *cache = get_cache();
+  count(&cache->allocations);
+  if (size > SLAB_MAX_SIZE) {
+    count(&cache->large);
+    return safe_malloc(size);
+  }
+
+  size_t class = size == 0 ? 0 : (size - 1) / SLAB_ALIGN;
+  if (cache->free[class] == NULL) {
+    refill(cache, class);
+  }
+  FreeBlock *block = cache->free[class];
+  cache->free[class] = block->next;
+  cache->count[class]--;
+  return block;
+}
+
+void slab_free(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+  if (size > SLAB_MAX_SIZE) {
+    free(ptr);
+    return;
+  }
+
+  SlabCache *cache = get_cache();
+  size_t class = size == 0 ? 0 : (size - 1) / SLAB_ALIGN;
+  FreeBlock *block = ptr;
+  block->next = cache->free[class];
+  cache->free[class] = block;
+  if (++cache->count[class] > SLAB_CACHE_SIZE) {
+    give_back(cache, class, SLAB_CACHE_SIZE / 2);
+  }
+}
+
+void slab_free_string(void *str) {
+  if (str != NULL) {
+    slab_free(str, strlen(str) + 1);
+  }
+}
+
+size_t slab_size(size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    return size;
+  }
+  if (size == 0) {
+    return SLAB_ALIGN;
+  }
+  return (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+}
+
+void slab_stats(SlabStats *stats) {
+  safe_mutex_lock(&caches_lock);
+  *stats = finished;
+  for (SlabCache *cache = caches; cache != NULL; cache = cache->next) {
+    stats->allocations += atomic_load(&cache->allocations);
+    stats->large += atomic_load(&cache->large);
+  }
+  safe_mutex_unlock(&caches_lock);
+  stats->chunks = atomic_load(&chunks);
+}
+
+void slab_terminate() {
+  if (pthread_once(&init_once, init_classes) != 0) {
+    return;
+  }
+
+  // Cached blocks point into the chunks, so every cache is emptied too
+  safe_mutex_lock(&caches_lock);
+  for (SlabCache *cache = caches; cache != NULL; cache = cache->next) {
+    memset(cache->free, 0, sizeof(cache->free));
+    memset(cache->count, 0, sizeof(cache->count));
+  }
+  safe_mutex_unlock(&caches_lock);
+
+  for (size_t class = 0; class < SLAB_NUM_CLASSES; class++) {
+    SizeClass *size_class = &classes[class];
+    safe_mutex_lock(&size_class->lock);
+    while (size_class->chunks != NULL) {
+      Chunk *chunk = size_class->chunks;
+      size_class->chunks = chunk->next;
+      free(chunk);
+    }
+    size_class->free = NULL;
+    size_class->bump = NULL;
+    size_class->end = NULL;
+    safe_mutex_unlock(&size_class->lock);
+  }
+  atomic_store(&chunks, 0);
+}
@@ -0,0 +1,56 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+// Granularity of the size classes, every block is aligned to it.
+#define SLAB_ALIGN 8
+// Largest allocation served from the slabs, enough for a KeyNode and for any
+// string shorter than MAX_STRING_SIZE. Bigger ones go straight to malloc.
+#define SLAB_MAX_SIZE 80
+// Size of the chunks the slabs are carved from.
+#define SLAB_CHUNK_SIZE (64 * 1024)
+// Free blocks of a class a thread keeps for itself. Above that, half of them
+// are handed back to the shared pool.
+#define SLAB_CACHE_SIZE 128
+
+#include <stddef.h>
+
+// Counters of the allocator, summed over every thread.
+typedef struct SlabStats {
+  size_t allocations; // Blocks handed out by slab_alloc
+  size_t large;       // Of those, the ones too big for a size class
+  size_t chunks;      // Chunks requested from malloc
+} SlabStats;
+
+/// Allocates a block of at least the given size. Small blocks come from the
+/// calling thread's cache of its size class, which only takes a lock to
+/// refill. Terminates the program if memory runs out.
+/// @param size Size of the block, in bytes.
+/// @return Pointer to the block.
+void *slab_alloc(size_t size);
+
+/// Frees a block returned by slab_alloc.
+/// @param ptr Block to be freed, may be NULL.
+/// @param size Size the block was allocated with, or any size rounding to the
+/// same slab_size.
+void slab_free(void *ptr, size_t size);
+
+/// Frees a null-terminated string allocated with slab_alloc(strlen + 1). Has
+/// the signature of free, for epoch_retire.
+/// @param str String to be freed.
+void slab_free_string(void *str);
+
+/// Rounds a size up to the size of the block that backs it. Two sizes with
+/// the same slab_size can share a block.
+/// @param size Requested size, in bytes.
+/// @return Usable size of the block.
+size_t slab_size(size_t size);
+
+/// Collects the counters of every thread.
+/// @param stats Output counters.
+void slab_stats(SlabStats *stats);
+
+/// Releases every chunk. Must only be called once no thread uses the blocks
+/// anymore. The allocator can be used again afterwards.
+void slab_terminate();
+
+#endif // KVS_SLAB_H
@@ -0,0 +1,200 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "operations.h"
+#include "stats.h"
+
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+
+// Durations of a metric. Only the owner thread writes to it, the counters are
+// also read by stats_report.
+typedef struct Histogram {
+  atomic_uint_least64_t buckets[STATS_BUCKETS];
+  atomic_uint_least64_t count;
+  atomic_uint_least64_t total_ns;
+  atomic_uint_least64_t max_ns;
+} Histogram;
+
+typedef struct StatsThread {
+  Histogram metrics[STATS_NUM_METRICS];
+  struct StatsThread *next;
+} StatsThread;
+
+// Names of the metrics in the report
+static const char *metric_names[STATS_NUM_METRICS] = {
+    "write",       "read",         "delete",      "show",
+    "range",       "prefix",       "backup",      "backup_write",
+    "restore",     "lock_global",  "lock_bucket", "lock_index"};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+// Histograms of the running threads, and the sums of the finished ones
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static StatsThread *threads = NULL;
+static StatsThread finished;
+
+static _Thread_local StatsThread *local_stats = NULL;
+
+/*AUXILIARY FUNCTIONS*/
+
+/// Adds to a counter only its owner thread writes to.
+static void add(atomic_uint_least64_t *counter, uint64_t value) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+      memory_order_relaxed);
+}
+
+/// Adds every counter of a histogram to another one.
+static void merge(Histogram *into, Histogram *from) {
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    add(&into->buckets[i], atomic_load(&from->buckets[i]));
+  }
+  add(&into->count, atomic_load(&from->count));
+  add(&into->total_ns, atomic_load(&from->total_ns));
+  uint64_t max_ns = atomic_load(&from->max_ns);
+  if (max_ns > atomic_load(&into->max_ns)) {
+    atomic_store(&into->max_ns, max_ns);
+  }
+}
+
+/// Index of the bucket a duration falls in. Durations below
+/// STATS_SUB_BUCKETS get a bucket each, the others are bucketed by their
+/// highest bit and the STATS_SUB_BITS bits after it.
+static size_t bucket_of(uint64_t ns) {
+  if (ns < STATS_SUB_BUCKETS) {
+    return (size_t)ns;
+  }
+  if (ns >= (uint64_t)1 << STATS_MAX_BITS) {
+    return STATS_BUCKETS - 1;
+  }
+  unsigned top = 63 - (unsigned)__builtin_clzll(ns);
+  uint64_t sub = (ns >> (top - STATS_SUB_BITS)) - STATS_SUB_BUCKETS;
+  return ((size_t)(top - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + (size_t)sub;
+}
+
+/// Middle of the durations of a bucket.
+static double bucket_middle(size_t bucket) {
+  if (bucket < STATS_SUB_BUCKETS) {
+    return (double)bucket;
+  }
+  unsigned shift = (unsigned)(bucket >> STATS_SUB_BITS) - 1;
+  uint64_t sub = bucket & (STATS_SUB_BUCKETS - 1);
+  uint64_t low = (STATS_SUB_BUCKETS + sub) << shift;
+  return (double)low + (double)((uint64_t)1 << shift) / 2.0;
+}
+
+/// Duration below which the given fraction of a histogram lies, never above
+/// its longest duration.
+/// @return Duration in microseconds.
+static double percentile(Histogram *histogram, double fraction) {
+  uint64_t count = atomic_load(&histogram->count);
+  uint64_t rank = (uint64_t)(fraction * (double)count);
+  double max_ns = (double)atomic_load(&histogram->max_ns);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    seen += atomic_load(&histogram->buckets[i]);
+    if (seen > rank) {
+      double middle = bucket_middle(i);
+      return (middle < max_ns ? middle : max_ns) / 1000.0;
+    }
+  }
+  return max_ns / 1000.0;
+}
+
+/// Adds the histograms of a thread to the finished ones when it exits.
+static void destroy_thread(void *arg) {
+  StatsThread *stats = arg;
+  safe_mutex_lock(&threads_lock);
+  StatsThread **link = &threads;
+  while (*link != stats) {
+    link = &(*link)->next;
+  }
+  *link = stats->next;
+  for (size_t i = 0; i < STATS_NUM_METRICS; i++) {
+    merge(&finished.metrics[i], &stats->metrics[i]);
+  }
+  safe_mutex_unlock(&threads_lock);
+  free(stats);
+}
+
+static void init_key() { pthread_key_create(&thread_key, destroy_thread); }
+
+/// Returns the histograms of the calling thread, creating them on first use.
+static StatsThread *get_thread() {
+  if (local_stats != NULL) {
+    return local_stats;
+  }
+  pthread_once(&init_once, init_key);
+
+  StatsThread *stats = calloc(1, sizeof(StatsThread));
+  if (stats == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    exit(1);
+  }
+  safe_mutex_lock(&threads_lock);
+  stats->next = threads;
+  threads = stats;
+  safe_mutex_unlock(&threads_lock);
+  pthread_setspecific(thread_key, stats);
+  local_stats = stats;
+  return stats;
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+uint64_t stats_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+void stats_record(enum StatsMetric metric, uint64_t ns) {
+  Histogram *histogram = &get_thread()->metrics[metric];
+  add(&histogram->buckets[bucket_of(ns)], 1);
+  add(&histogram->count, 1);
+  add(&histogram->total_ns, ns);
+  if (ns > atomic_load_explicit(&histogram->max_ns, memory_order_relaxed)) {
+    atomic_store_explicit(&histogram->max_ns, ns, memory_order_relaxed);
+  }
+}
+
+int stats_report(OutputBuffer *out) {
+  StatsThread *merged = calloc(1, sizeof(StatsThread));
+  if (merged == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    exit(1);
+  }
+  safe_mutex_lock(&threads_lock);
+  for (size_t i = 0; i < STATS_NUM_METRICS; i++) {
+    merge(&merged->metrics[i], &finished.metrics[i]);
+    for (StatsThread *stats = threads; stats != NULL; stats = stats->next) {
+      merge(&merged->metrics[i], &stats->metrics[i]);
+    }
+  }
+  safe_mutex_unlock(&threads_lock);
+
+  int result = 0;
+  for (size_t i = 0; i < STATS_NUM_METRICS && !result; i++) {
+    Histogram *histogram = &merged->metrics[i];
+    uint64_t count = atomic_load(&histogram->count);
+    if (count == 0) {
+      continue;
+    }
+    double total_us = (double)atomic_load(&histogram->total_ns) / 1000.0;
+    char line[256];
+    int len = snprintf(
+        line, sizeof(line),
+        "%s count=%lu mean_us=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f "
+        "total_ms=%.1f\n",
+        metric_names[i], (unsigned long)count, total_us / (double)count,
+        percentile(histogram, 0.5), percentile(histogram, 0.99),
+        (double)atomic_load(&histogram->max_ns) / 1000.0, total_us / 1000.0);
+    result = output_write(out, line, (size_t)len);
+  }
+  free(merged);
+  return result;
+}
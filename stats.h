@@ -0,0 +1,51 @@
+#ifndef KVS_STATS_H
+#define KVS_STATS_H
+
+// Every power of two of a histogram is split in 2^STATS_SUB_BITS buckets, so
+// the percentiles reported are within 1 / 2^STATS_SUB_BITS of the real ones.
+#define STATS_SUB_BITS 4
+// Durations of 2^STATS_MAX_BITS ns (about 18 minutes) or more all go to the
+// last bucket.
+#define STATS_MAX_BITS 40
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+#include <stdint.h>
+
+#include "output.h"
+
+// What a duration measures. The first ones are the calls of operations.h,
+// the last ones the waits for the locks of the table.
+enum StatsMetric {
+  STATS_WRITE,
+  STATS_READ,
+  STATS_DELETE,
+  STATS_SHOW,
+  STATS_RANGE,
+  STATS_PREFIX,
+  STATS_BACKUP,       // Taking the snapshot of a backup
+  STATS_BACKUP_WRITE, // Writing a backup, in the background
+  STATS_RESTORE,
+  STATS_GLOBAL_LOCK,
+  STATS_BUCKET_LOCK,
+  STATS_INDEX_LOCK,
+  STATS_NUM_METRICS
+};
+
+/// Current time, for the durations given to stats_record.
+/// @return Monotonic time in nanoseconds.
+uint64_t stats_now();
+
+/// Adds a duration to the histogram of a metric. Every thread has its own
+/// histograms, so recording never takes a lock after a thread's first call.
+/// @param metric Metric the duration belongs to.
+/// @param ns Duration in nanoseconds.
+void stats_record(enum StatsMetric metric, uint64_t ns);
+
+/// Merges the histograms of every thread, including the finished ones, and
+/// writes a line per metric recorded so far:
+///   <metric> count=<n> mean_us=.. p50_us=.. p99_us=.. max_us=.. total_ms=..
+/// @param out Output buffer the report is written to.
+/// @return 0 on success, 1 if writing to the file failed.
+int stats_report(OutputBuffer *out);
+
+#endif // KVS_STATS_H
@@ -0,0 +1,13 @@
+#ifndef KVS_STRING_VIEW_H
+#define KVS_STRING_VIEW_H
+
+#include <stddef.h>
+
+// Non-owning reference to a string that is not necessarily null-terminated,
+// e.g. a key pointing straight into a memory-mapped job file.
+typedef struct StringView {
+  const char *data;
+  size_t len;
+} StringView;
+
+#endif // KVS_STRING_VIEW_H
@@ -0,0 +1,35 @@
+// Merges a delta backup with every backup it depends on into a single full
+// backup, so the chain of deltas can be discarded.
+//
+// Usage: bck_compact <delta.bck> <full.bck>
+
+#include <stdio.h>
+
+#include "operations.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <delta.bck> <full.bck>\n", argv[0]);
+    return 1;
+  }
+
+  KvsOptions options = {0};
+  if (kvs_init(&options)) {
+    fprintf(stderr, "Failed to initialize KVS\n");
+    return 1;
+  }
+  if (kvs_restore(argv[1])) {
+    fprintf(stderr, "Failed to load backup: %s\n", argv[1]);
+    kvs_terminate();
+    return 1;
+  }
+
+  // The first backup of a KVS is always a full one
+  int result = kvs_backup(argv[2]);
+  kvs_wait_backup();
+  kvs_terminate();
+  if (result) {
+    fprintf(stderr, "Failed to perform backup.\n");
+  }
+  return result;
+}
@@ -0,0 +1,271 @@
+// Writes a directory of synthetic job files, the same for the same options,
+// to benchmark kvs with. Every command picks its keys uniformly among a fixed
+// set of keys, whose first letters follow a Zipf distribution.
+//
+// Usage: job_gen [-f files] [-c commands] [-k keys] [-l key_length]
+//                [-s skew] [-m read:write:delete] [-b batch] [-B backup_every]
+//                [-v value_length] [-S seed] <dir_path>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "operations.h"
+#include "output.h"
+
+// Options of the generated jobs
+typedef struct GenOptions {
+  size_t files;
+  size_t commands;     // Per file
+  size_t keys;         // Distinct keys the commands pick from
+  size_t key_length;   // Longest key, none is shorter than its index needs
+  double skew;         // Zipf exponent of the first letters, 0 is uniform
+  unsigned mix[3];     // Weights of READ, WRITE and DELETE
+  size_t batch;        // Keys per command, below MAX_WRITE_SIZE
+  size_t backup_every; // Commands between BACKUPs, 0 for none
+  size_t value_length;
+  uint64_t seed;
+} GenOptions;
+
+/*AUXILIARY FUNCTIONS*/
+
+/// Next number of a splitmix64 generator.
+static uint64_t next_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/// Uniform number in [0, bound).
+static size_t random_below(uint64_t *state, size_t bound) {
+  return (size_t)(next_random(state) % bound);
+}
+
+/// Builds the keys. Key i is a first letter, i in base 26 with as many
+/// digits as the largest index needs, which keeps the keys distinct, and
+/// random letters up to a random length.
+/// @return Array of options->keys null-terminated keys.
+static char (*make_keys(const GenOptions *options))[MAX_STRING_SIZE] {
+  size_t digits = 1;
+  for (size_t n = options->keys - 1; n >= 26; n /= 26) {
+    digits++;
+  }
+  // Cumulative Zipf weights of the first letters
+  double weights[26];
+  double total = 0;
+  for (size_t i = 0; i < 26; i++) {
+    total += 1.0 / pow((double)(i + 1), options->skew);
+    weights[i] = total;
+  }
+
+  uint64_t state = options->seed;
+  char(*keys)[MAX_STRING_SIZE] =
+      safe_malloc(options->keys * sizeof(*keys));
+  for (size_t i = 0; i < options->keys; i++) {
+    double pick = (double)next_random(&state) / 18446744073709551616.0 * total;
+    size_t letter = 0;
+    while (letter < 25 && weights[letter] <= pick) {
+      letter++;
+    }
+    keys[i][0] = (char)('a' + letter);
+    size_t n = i;
+    for (size_t d = digits; d > 0; d--) {
+      keys[i][d] = (char)('a' + n % 26);
+      n /= 26;
+    }
+    size_t len = digits + 1;
+    if (options->key_length > len) {
+      len += random_below(&state, options->key_length - len + 1);
+    }
+    for (size_t j = digits + 1; j < len; j++) {
+      keys[i][j] = (char)('a' + random_below(&state, 26));
+    }
+    keys[i][len] = '\0';
+  }
+  return keys;
+}
+
+/// Picks distinct keys for a command.
+/// @param picked Output array of options->batch key indexes.
+static void pick_keys(const GenOptions *options, uint64_t *state,
+                      size_t *picked) {
+  for (size_t i = 0; i < options->batch; i++) {
+    size_t j;
+    do {
+      picked[i] = random_below(state, options->keys);
+      for (j = 0; j < i && picked[j] != picked[i]; j++) {
+      }
+    } while (j < i);
+  }
+}
+
+/// Writes one job file.
+/// @return 0 on success, 1 otherwise.
+static int write_job(const GenOptions *options, char (*keys)[MAX_STRING_SIZE],
+                     const char *path, uint64_t seed) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create job file: %s\n", path);
+    return 1;
+  }
+  OutputBuffer *out = safe_malloc(sizeof(OutputBuffer));
+  output_init(out, fd);
+  uint64_t state = seed;
+  unsigned mix_total = options->mix[0] + options->mix[1] + options->mix[2];
+  size_t picked[MAX_WRITE_SIZE];
+  char value[MAX_STRING_SIZE];
+  int failed = 0;
+
+  for (size_t c = 0; c < options->commands && !failed; c++) {
+    if (options->backup_every > 0 && c > 0 && c % options->backup_every == 0) {
+      failed = output_puts(out, "BACKUP\n");
+    }
+    size_t kind = random_below(&state, mix_total);
+    const char *name = kind < options->mix[0]                      ? "READ"
+                       : kind < options->mix[0] + options->mix[1] ? "WRITE"
+                                                                   : "DELETE";
+    int is_write = name[0] == 'W';
+    pick_keys(options, &state, picked);
+    failed = failed || output_puts(out, name) || output_puts(out, " [");
+    for (size_t i = 0; i < options->batch && !failed; i++) {
+      // Keys are separated by commas, pairs aren't
+      if (!is_write) {
+        failed = (i > 0 && output_puts(out, ",")) ||
+                 output_puts(out, keys[picked[i]]);
+        continue;
+      }
+      for (size_t j = 0; j < options->value_length; j++) {
+        value[j] = (char)('a' + random_below(&state, 26));
+      }
+      value[options->value_length] = '\0';
+      failed = failed || output_puts(out, "(") ||
+               output_puts(out, keys[picked[i]]) || output_puts(out, ",") ||
+               output_puts(out, value) || output_puts(out, ")");
+    }
+    failed = failed || output_puts(out, "]\n");
+  }
+  failed = failed || output_flush(out);
+  free(out);
+  close(fd);
+  if (failed) {
+    fprintf(stderr, "Failed to write job file: %s\n", path);
+  }
+  return failed;
+}
+
+/// Parses a non-negative number option.
+/// @return 0 on success, 1 if it isn't a number or is above max.
+static int parse_size(const char *arg, size_t max, size_t *value) {
+  char *end;
+  errno = 0;
+  unsigned long long parsed = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' ||
+      parsed > max) {
+    return 1;
+  }
+  *value = (size_t)parsed;
+  return 0;
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+static void print_usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-f files] [-c commands] [-k keys] [-l key_length] "
+          "[-s skew] [-m read:write:delete] [-b batch] [-B backup_every] "
+          "[-v value_length] [-S seed] <dir_path>\n",
+          program);
+}
+
+int main(int argc, char *argv[]) {
+  GenOptions options = {.files = 4,
+                        .commands = 10000,
+                        .keys = 10000,
+                        .key_length = 12,
+                        .skew = 0,
+                        .mix = {60, 30, 10},
+                        .batch = 4,
+                        .backup_every = 0,
+                        .value_length = 16,
+                        .seed = 1};
+  int opt;
+  int invalid = 0;
+  size_t seed;
+  while ((opt = getopt(argc, argv, "f:c:k:l:s:m:b:B:v:S:")) != -1 &&
+         !invalid) {
+    switch (opt) {
+    case 'f':
+      invalid = parse_size(optarg, 100000, &options.files);
+      break;
+    case 'c':
+      invalid = parse_size(optarg, SIZE_MAX, &options.commands);
+      break;
+    case 'k':
+      invalid = parse_size(optarg, SIZE_MAX / MAX_STRING_SIZE, &options.keys) ||
+                options.keys == 0;
+      break;
+    case 'l':
+      invalid = parse_size(optarg, MAX_STRING_SIZE - 1, &options.key_length);
+      break;
+    case 's':
+      invalid = sscanf(optarg, "%lf", &options.skew) != 1 || options.skew < 0;
+      break;
+    case 'm':
+      invalid = sscanf(optarg, "%u:%u:%u", &options.mix[0], &options.mix[1],
+                       &options.mix[2]) != 3 ||
+                options.mix[0] + options.mix[1] + options.mix[2] == 0;
+      break;
+    case 'b':
+      // The parser takes fewer than MAX_WRITE_SIZE keys per command
+      invalid = parse_size(optarg, MAX_WRITE_SIZE - 1, &options.batch) ||
+                options.batch == 0;
+      break;
+    case 'B':
+      invalid = parse_size(optarg, SIZE_MAX, &options.backup_every);
+      break;
+    case 'v':
+      invalid =
+          parse_size(optarg, MAX_STRING_SIZE - 1, &options.value_length) ||
+          options.value_length == 0;
+      break;
+    case 'S':
+      invalid = parse_size(optarg, SIZE_MAX, &seed);
+      options.seed = seed;
+      break;
+    default:
+      invalid = 1;
+    }
+  }
+  if (invalid || argc - optind != 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (options.batch > options.keys) {
+    fprintf(stderr, "A command can't hold more keys than there are\n");
+    return 1;
+  }
+  const char *dir_path = argv[optind];
+  if (mkdir(dir_path, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create directory: %s\n", dir_path);
+    return 1;
+  }
+
+  char(*keys)[MAX_STRING_SIZE] = make_keys(&options);
+  int failed = 0;
+  for (size_t i = 0; i < options.files && !failed; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/gen%zu.job", dir_path, i);
+    failed = write_job(&options, keys, path, options.seed + i + 1);
+  }
+  free(keys);
+  return failed;
+}
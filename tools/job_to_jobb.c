@@ -0,0 +1,64 @@
+// Converts a text job file to the binary format, which kvs runs when its name
+// ends in .jobb. Invalid commands are kept as invalid records, so both files
+// produce the same output.
+//
+// Usage: job_to_jobb <file.job> <file.jobb>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "operations.h"
+#include "output.h"
+#include "parser.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <file.job> <file.jobb>\n", argv[0]);
+    return 1;
+  }
+
+  int job_fd = open(argv[1], O_RDONLY);
+  if (job_fd < 0) {
+    fprintf(stderr, "Failed to open .job file: %s\n", argv[1]);
+    return 1;
+  }
+  int jobb_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (jobb_fd < 0) {
+    fprintf(stderr, "Failed to create .jobb file: %s\n", argv[2]);
+    close(job_fd);
+    return 1;
+  }
+
+  JobReader *reader = safe_malloc(sizeof(JobReader));
+  CommandBatch *batch = safe_malloc(sizeof(CommandBatch));
+  OutputBuffer *out = safe_malloc(sizeof(OutputBuffer));
+  char *record = safe_malloc(JOB_BINARY_MAX_RECORD);
+  job_reader_init(reader, job_fd);
+  output_init(out, jobb_fd);
+  int failed = output_write(out, JOB_BINARY_MAGIC, JOB_BINARY_MAGIC_SIZE);
+
+  enum Command command;
+  while (!failed && (command = get_next(reader)) != EOC) {
+    unsigned int delay = 0;
+    command = parse_command(reader, command, batch, &delay);
+    size_t len = encode_binary_command(record, command, batch, delay);
+    failed = output_write(out, record, len);
+  }
+
+  failed |= output_flush(out);
+  job_reader_close(reader);
+  close(job_fd);
+  if (close(jobb_fd) == -1) {
+    failed = 1;
+  }
+  free(record);
+  free(out);
+  free(batch);
+  free(reader);
+  if (failed) {
+    fprintf(stderr, "Failed to write .jobb file: %s\n", argv[2]);
+  }
+  return failed;
+}
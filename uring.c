@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "operations.h"
+#include "uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) &&               \
+    defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define KVS_HAVE_URING 1
+#endif
+
+#ifdef KVS_HAVE_URING
+
+// Entries of the submission queue, enough for every chunk and a prefetch
+#define URING_ENTRIES 16
+// user_data of the requests that aren't writes of a chunk
+#define URING_NO_CHUNK URING_CHUNKS
+
+typedef struct UringChunk {
+  size_t len;
+  size_t done; // Bytes already written, in case a write is short
+  off_t offset;
+  char data[OUTPUT_BUF_SIZE];
+} UringChunk;
+
+struct Uring {
+  int fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring; // Same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  atomic_uint *sq_tail;
+  unsigned int sq_mask;
+  unsigned int *sq_array;
+  atomic_uint *cq_head;
+  atomic_uint *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned int queued;    // Requests not submitted yet
+  unsigned int in_flight; // Requests submitted and not completed
+  OutputBuffer *out;
+  off_t offset; // Of the next write
+  int failed;   // A write failed
+  size_t num_free;
+  size_t free_chunks[URING_CHUNKS];
+  UringChunk chunks[URING_CHUNKS];
+};
+
+static pthread_once_t support_once = PTHREAD_ONCE_INIT;
+static int supported;
+static int prefetch_supported; // IORING_OP_FADVISE, from Linux 5.6
+
+/*AUXILIARY FUNCTIONS*/
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+                       unsigned int min_complete, unsigned int flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+/// Probes the opcodes the kernel supports with a throwaway ring.
+static void probe_support(void) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = uring_setup(1, &params);
+  if (fd < 0) {
+    return;
+  }
+  size_t size = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = safe_malloc(size);
+  memset(probe, 0, size);
+  // Kernels without probes predate IORING_OP_WRITE
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) ==
+      0) {
+    supported = probe->last_op >= IORING_OP_WRITE &&
+                (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    prefetch_supported =
+        probe->last_op >= IORING_OP_FADVISE &&
+        (probe->ops[IORING_OP_FADVISE].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  close(fd);
+}
+
+/// @return A new submission queue entry, zeroed, to be filled and queued.
+static struct io_uring_sqe *next_sqe(Uring *ring) {
+  unsigned int tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+  unsigned int index = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  return sqe;
+}
+
+/// Makes the entry returned by next_sqe visible to the kernel.
+static void queue_sqe(Uring *ring) {
+  unsigned int tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+  atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+  ring->queued++;
+}
+
+static void queue_write(Uring *ring, size_t index) {
+  UringChunk *chunk = &ring->chunks[index];
+  struct io_uring_sqe *sqe = next_sqe(ring);
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = ring->out->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(chunk->data + chunk->done);
+  sqe->len = (uint32_t)(chunk->len - chunk->done);
+  sqe->off = (uint64_t)chunk->offset + chunk->done;
+  sqe->user_data = index;
+  queue_sqe(ring);
+}
+
+/// Submits the queued requests and waits for at least min_complete of the
+/// ones in flight.
+static void submit(Uring *ring, unsigned int min_complete) {
+  unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (ring->queued > 0 || min_complete > 0) {
+    int result = uring_enter(ring->fd, ring->queued, min_complete, flags);
+    if (result < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+      fprintf(stderr, "Failed to submit writes: %s\n", strerror(errno));
+      exit(1);
+    }
+    ring->queued -= (unsigned int)result;
+    ring->in_flight += (unsigned int)result;
+    // The kernel waits for completions once everything is submitted
+    if (ring->queued == 0) {
+      return;
+    }
+  }
+}
+
+/// Handles the completed requests: frees the chunks written and queues the
+/// rest of the short writes.
+static void reap(Uring *ring) {
+  unsigned int head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    ring->in_flight--;
+    if (cqe->user_data == URING_NO_CHUNK) {
+      continue; // Prefetches are only hints
+    }
+    size_t index = (size_t)cqe->user_data;
+    UringChunk *chunk = &ring->chunks[index];
+    if (cqe->res <= 0) {
+      fprintf(stderr, "Failed to write to file: %s\n",
+              strerror(cqe->res < 0 ? -cqe->res : EIO));
+      ring->failed = 1;
+    } else if ((chunk->done += (size_t)cqe->res) < chunk->len) {
+      queue_write(ring, index);
+      continue;
+    }
+    ring->free_chunks[ring->num_free++] = index;
+  }
+  atomic_store_explicit(ring->cq_head, head, memory_order_release);
+}
+
+/// Hand-off of the attached buffer: queues its bytes as the next write,
+/// waiting for a chunk if they are all in flight.
+static int hand_off_output(OutputBuffer *out, void *arg) {
+  Uring *ring = arg;
+  reap(ring);
+  while (ring->num_free == 0) {
+    submit(ring, 1);
+    reap(ring);
+  }
+  size_t index = ring->free_chunks[--ring->num_free];
+  UringChunk *chunk = &ring->chunks[index];
+  memcpy(chunk->data, out->data, out->len);
+  chunk->len = out->len;
+  chunk->done = 0;
+  chunk->offset = ring->offset;
+  ring->offset += (off_t)out->len;
+  out->len = 0;
+  queue_write(ring, index);
+  if (ring->queued >= URING_BATCH) {
+    submit(ring, 0);
+  }
+  return ring->failed;
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+  return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, offset);
+}
+
+static void free_ring(Uring *ring) {
+  if (ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, URING_ENTRIES * sizeof(struct io_uring_sqe));
+  }
+  if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  close(ring->fd);
+  free(ring);
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+int uring_supported(void) {
+  pthread_once(&support_once, probe_support);
+  return supported;
+}
+
+Uring *uring_open(void) {
+  if (!uring_supported()) {
+    return NULL;
+  }
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = uring_setup(URING_ENTRIES, &params);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  Uring *ring = safe_malloc(sizeof(Uring));
+  ring->fd = fd;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(int);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = map_ring(fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+  ring->cq_ring = ring->sq_ring;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cq_ring = map_ring(fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+  }
+  ring->sqes = map_ring(fd, URING_ENTRIES * sizeof(struct io_uring_sqe),
+                        IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    free_ring(ring);
+    return NULL;
+  }
+
+  char *sq = ring->sq_ring;
+  ring->sq_tail = (atomic_uint *)(void *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned int *)(void *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(void *)(sq + params.sq_off.array);
+  char *cq = ring->cq_ring;
+  ring->cq_head = (atomic_uint *)(void *)(cq + params.cq_off.head);
+  ring->cq_tail = (atomic_uint *)(void *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int *)(void *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(void *)(cq + params.cq_off.cqes);
+
+  ring->queued = 0;
+  ring->in_flight = 0;
+  ring->out = NULL;
+  ring->offset = 0;
+  ring->failed = 0;
+  ring->num_free = URING_CHUNKS;
+  for (size_t i = 0; i < URING_CHUNKS; i++) {
+    ring->free_chunks[i] = URING_CHUNKS - 1 - i;
+  }
+  return ring;
+}
+
+void uring_prefetch(Uring *ring, int fd) {
+  if (!prefetch_supported) {
+    return;
+  }
+  // A length of 0 is the whole file
+  struct io_uring_sqe *sqe = next_sqe(ring);
+  sqe->opcode = IORING_OP_FADVISE;
+  sqe->fd = fd;
+  sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+  sqe->user_data = URING_NO_CHUNK;
+  queue_sqe(ring);
+  submit(ring, 0);
+}
+
+void uring_attach(Uring *ring, OutputBuffer *out) {
+  off_t offset = lseek(out->fd, 0, SEEK_CUR);
+  ring->offset = offset > 0 ? offset : 0;
+  ring->out = out;
+  out->hand_off = hand_off_output;
+  out->hand_off_arg = ring;
+}
+
+int uring_drain(Uring *ring) {
+  while (ring->queued > 0 || ring->in_flight > 0) {
+    submit(ring, 1);
+    reap(ring);
+  }
+  return ring->failed;
+}
+
+int uring_close(Uring *ring) {
+  int result = 0;
+  if (ring->out != NULL) {
+    result = output_flush(ring->out);
+  }
+  result = uring_drain(ring) || result;
+  if (ring->out != NULL) {
+    // Later plain writes go after the ones of the ring
+    lseek(ring->out->fd, ring->offset, SEEK_SET);
+    ring->out->hand_off = NULL;
+    ring->out->hand_off_arg = NULL;
+  }
+  free_ring(ring);
+  return result;
+}
+
+#else // Without io_uring, every caller keeps its blocking writes
+
+int uring_supported(void) { return 0; }
+
+Uring *uring_open(void) { return NULL; }
+
+void uring_prefetch(Uring *ring, int fd) {
+  (void)ring;
+  (void)fd;
+}
+
+void uring_attach(Uring *ring, OutputBuffer *out) {
+  (void)ring;
+  (void)out;
+}
+
+int uring_drain(Uring *ring) {
+  (void)ring;
+  return 0;
+}
+
+int uring_close(Uring *ring) {
+  (void)ring;
+  return 0;
+}
+
+#endif // KVS_HAVE_URING
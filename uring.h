@@ -0,0 +1,54 @@
+#ifndef KVS_URING_H
+#define KVS_URING_H
+
+// Buffers of output a ring can have in flight, each OUTPUT_BUF_SIZE bytes.
+#define URING_CHUNKS 8
+// Writes queued before they are submitted together with a single system call.
+#define URING_BATCH 4
+
+#include "output.h"
+
+// Asynchronous writer for .out and .bck files on top of io_uring, used
+// through the hand-off of an OutputBuffer. A full buffer is copied into a
+// free chunk and queued as a write at the next offset of the file, and the
+// queued writes are submitted in batches, so the thread only waits for the
+// disk when every chunk is in flight. A ring belongs to a single thread.
+typedef struct Uring Uring;
+
+/// Checks once whether the kernel can run the writes of a ring. It may not
+/// have io_uring at all, or forbid it, e.g. in a container.
+/// @return 1 if rings can be opened, 0 otherwise.
+int uring_supported(void);
+
+/// Creates a ring.
+/// @return The new ring, NULL if io_uring isn't supported or the ring could
+/// not be created, e.g. because of the limit of open files.
+Uring *uring_open(void);
+
+/// Asks the kernel to read a file into the page cache in the background, so
+/// reading it later doesn't wait for the disk. Does nothing if the kernel
+/// can't.
+/// @param ring Ring to submit the request on.
+/// @param fd File descriptor of the file.
+void uring_prefetch(Uring *ring, int fd);
+
+/// Makes a ring write the output of a buffer, from the current offset of its
+/// file.
+/// @param ring Ring without a buffer attached.
+/// @param out Buffer without a hand-off, which must not be used after
+/// uring_close.
+void uring_attach(Uring *ring, OutputBuffer *out);
+
+/// Submits the queued writes and waits for all of them to complete. The
+/// output flushed before is then in the file.
+/// @param ring Ring to drain.
+/// @return 0 on success, 1 if a write failed.
+int uring_drain(Uring *ring);
+
+/// Flushes the attached buffer, drains the ring, gives the buffer back its
+/// plain writes and frees the ring.
+/// @param ring Ring to be freed.
+/// @return 0 on success, 1 if a write failed.
+int uring_close(Uring *ring);
+
+#endif // KVS_URING_H
@@ -0,0 +1,427 @@
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "operations.h"
+#include "wal.h"
+
+// Only changed by wal_open and wal_close, so that appends can tell whether
+// the log is open without reading log_fd, which compaction swaps under the
+// lock
+static int log_open = 0;
+static int log_fd = -1;
+static char *log_path = NULL;
+static enum WalSync sync_policy = WAL_SYNC_NONE;
+
+// Batches are appended with the lock held, and synced by sync_thread, which
+// covers every batch appended while the previous sync ran with a single one
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_appended = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_synced = PTHREAD_COND_INITIALIZER;
+static uint64_t end_position = 0;
+static uint64_t synced_position = 0;
+// Position the first byte of the file would have if the log had never been
+// compacted, positions stay the same across compactions
+static uint64_t file_start = 0;
+static int syncing = 0; // The sync thread syncs log_fd without the lock
+static int stopping = 0;
+static pthread_t sync_thread_id;
+
+/*AUXILIARY FUNCTIONS*/
+
+/// Writes the whole buffer to a file.
+/// @return 0 on success, 1 if writing failed.
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written <= 0) {
+      return 1;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+static void *sync_thread(void *arg) {
+  (void)arg;
+  safe_mutex_lock(&log_lock);
+  while (1) {
+    while (synced_position == end_position && !stopping) {
+      pthread_cond_wait(&log_appended, &log_lock);
+    }
+    if (synced_position == end_position) {
+      break; // Stopping, with everything synced
+    }
+    if (sync_policy == WAL_SYNC_PERIODIC && !stopping) {
+      // Let the batches of the interval pile up
+      struct timespec interval = {0, WAL_SYNC_INTERVAL_MS * 1000000};
+      safe_mutex_unlock(&log_lock);
+      nanosleep(&interval, NULL);
+      safe_mutex_lock(&log_lock);
+    }
+
+    uint64_t target = end_position;
+    int fd = log_fd;
+    syncing = 1;
+    safe_mutex_unlock(&log_lock);
+    if (fdatasync(fd) != 0) {
+      fprintf(stderr, "Failed to sync the write-ahead log\n");
+      exit(1);
+    }
+    safe_mutex_lock(&log_lock);
+    syncing = 0;
+    synced_position = target;
+    pthread_cond_broadcast(&log_synced);
+  }
+  safe_mutex_unlock(&log_lock);
+  return NULL;
+}
+
+/// Finds where the complete batches of the log end, and its latest
+/// checkpoint.
+/// @param log Contents of the log.
+/// @param checkpoint Output line of the latest checkpoint, empty if none.
+/// @return Length of the complete batches.
+static size_t scan_log(StringView log, StringView *checkpoint) {
+  size_t checkpoint_len = strlen(WAL_CHECKPOINT);
+  size_t valid = 0;
+  size_t pos = 0;
+  checkpoint->len = 0;
+  while (pos < log.len) {
+    const char *eol = memchr(log.data + pos, '\n', log.len - pos);
+    if (eol == NULL) {
+      break; // Cut short by a crash
+    }
+    StringView line = {log.data + pos, (size_t)(eol - log.data) - pos};
+    pos += line.len + 1;
+    if (line.len > 0 && line.data[0] == '#') {
+      valid = pos;
+      if (line.len > checkpoint_len &&
+          memcmp(line.data, WAL_CHECKPOINT, checkpoint_len) == 0) {
+        *checkpoint = line;
+      }
+    }
+  }
+  return valid;
+}
+
+/// Loads the backup of a checkpoint line.
+/// @param ht Hash table the backup is loaded into.
+/// @param line Checkpoint line, within the log.
+/// @param log Contents of the log.
+/// @param load_threads Maximum number of threads loading the backup.
+/// @param start Output position the log is replayed from, 0 if the backup
+/// could not be loaded but the whole log is there.
+/// @return 0 on success, 1 if the log was compacted into a backup that could
+/// not be loaded.
+static int load_checkpoint(HashTable *ht, StringView line, StringView log,
+                           size_t load_threads, size_t *start) {
+  *start = 0;
+  size_t pos = strlen(WAL_CHECKPOINT);
+  uint64_t position = 0;
+  while (pos < line.len && line.data[pos] >= '0' && line.data[pos] <= '9') {
+    position = position * 10 + (uint64_t)(line.data[pos++] - '0');
+  }
+  char path[PATH_MAX];
+  size_t path_len = line.len - pos - 1;
+  if (pos == line.len || line.data[pos] != ' ' || path_len == 0 ||
+      path_len >= sizeof(path) ||
+      position > (uint64_t)(line.data + line.len + 1 - log.data)) {
+    fprintf(stderr, "Malformed write-ahead log entry: %.*s\n", (int)line.len,
+            line.data);
+    return 0;
+  }
+  memcpy(path, line.data + pos + 1, path_len);
+  path[path_len] = '\0';
+
+  if (load_backup(ht, path, load_threads)) {
+    // A compacted log starts with the checkpoint it was compacted at, and
+    // only holds the batches after it
+    if (line.data == log.data && position > 0) {
+      fprintf(stderr, "Failed to load backup %s, which the write-ahead log "
+                      "was compacted into\n",
+              path);
+      return 1;
+    }
+    // The state of the backup is the one of the log up to the checkpoint,
+    // so replaying the whole log on top of it still ends in the right state
+    fprintf(stderr, "Failed to load backup %s, replaying the whole log\n",
+            path);
+    return 0;
+  }
+  *start = (size_t)position;
+  return 0;
+}
+
+/// Rewrites the log from a checkpoint on, behind a checkpoint line at its
+/// start, and switches to the new file. Called with the lock held.
+/// @param backup_path Resolved path of the backup of the checkpoint.
+/// @param offset Offset of the checkpoint in the current file.
+/// @return 0 on success, 1 if the log was left as it was.
+static int compact_log(const char *backup_path, uint64_t offset) {
+  // The new file is synced whole, the sync thread must not be using the old
+  while (syncing) {
+    pthread_cond_wait(&log_synced, &log_lock);
+  }
+
+  // The line starts the replay right after itself, its length includes the
+  // digits of its own length
+  char header[PATH_MAX + 32];
+  int header_len = 0;
+  int len;
+  while ((len = snprintf(header, sizeof(header), "%s%d %s\n", WAL_CHECKPOINT,
+                         header_len, backup_path)) != header_len) {
+    header_len = len;
+  }
+
+  char temp_path[PATH_MAX];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", log_path);
+  int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to compact the write-ahead log\n");
+    return 1;
+  }
+  int result = write_all(fd, header, (size_t)header_len);
+  uint64_t end = end_position - file_start;
+  char buf[1 << 16];
+  for (uint64_t pos = offset; pos < end && !result;) {
+    size_t size = end - pos < sizeof(buf) ? (size_t)(end - pos) : sizeof(buf);
+    ssize_t num_read = pread(log_fd, buf, size, (off_t)pos);
+    result = num_read <= 0 || write_all(fd, buf, (size_t)num_read);
+    pos += num_read > 0 ? (uint64_t)num_read : 0;
+  }
+  if (result || fsync(fd) != 0 || rename(temp_path, log_path) != 0) {
+    fprintf(stderr, "Failed to compact the write-ahead log\n");
+    close(fd);
+    unlink(temp_path);
+    return 1;
+  }
+  if (sync_parent_dir(log_path)) {
+    // The old file may come back after a crash, which is still a valid log
+    fprintf(stderr, "Failed to sync the directory of the write-ahead log\n");
+  }
+
+  close(log_fd);
+  log_fd = fd;
+  file_start = file_start + offset - (uint64_t)header_len;
+  synced_position = end_position;
+  pthread_cond_broadcast(&log_synced);
+  return 0;
+}
+
+/// Replays the complete batches of the log, and discards the rest.
+/// @return 0 on success, 1 if the log could not be read or is malformed.
+static int replay_log(HashTable *ht, const char *path,
+                      size_t load_threads) {
+  struct stat st;
+  if (fstat(log_fd, &st) != 0) {
+    fprintf(stderr, "Failed to read write-ahead log: %s\n", path);
+    return 1;
+  }
+  StringView log = {NULL, (size_t)st.st_size};
+  if (log.len == 0) {
+    return 0;
+  }
+  void *map = mmap(NULL, log.len, PROT_READ, MAP_PRIVATE, log_fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to read write-ahead log: %s\n", path);
+    return 1;
+  }
+  posix_madvise(map, log.len, POSIX_MADV_SEQUENTIAL);
+  log.data = map;
+
+  StringView checkpoint;
+  size_t valid = scan_log(log, &checkpoint);
+  size_t start = 0;
+  if (checkpoint.len > 0 &&
+      load_checkpoint(ht, checkpoint, log, load_threads, &start)) {
+    munmap(map, log.len);
+    return 1;
+  }
+  StringView tail = {log.data + start, valid - start};
+  int result = apply_log(ht, tail);
+  munmap(map, log.len);
+
+  if (!result && valid < log.len) {
+    fprintf(stderr, "Discarded an incomplete batch of the write-ahead log\n");
+    if (ftruncate(log_fd, (off_t)valid) != 0) {
+      fprintf(stderr, "Failed to truncate write-ahead log: %s\n", path);
+      result = 1;
+    }
+  }
+  end_position = valid;
+  synced_position = valid;
+  return result;
+}
+
+/*END OF AUXILIARY FUNCTIONS*/
+
+int wal_parse_sync(const char *name, enum WalSync *sync) {
+  if (strcmp(name, "commit") == 0) {
+    *sync = WAL_SYNC_COMMIT;
+  } else if (strcmp(name, "periodic") == 0) {
+    *sync = WAL_SYNC_PERIODIC;
+  } else if (strcmp(name, "none") == 0) {
+    *sync = WAL_SYNC_NONE;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+int wal_open(HashTable *ht, const char *path, enum WalSync sync,
+             size_t load_threads) {
+  if (log_open) {
+    fprintf(stderr, "Write-ahead log is already open\n");
+    return 1;
+  }
+  log_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (log_fd < 0) {
+    fprintf(stderr, "Failed to open write-ahead log: %s\n", path);
+    return 1;
+  }
+  file_start = 0;
+  if (replay_log(ht, path, load_threads)) {
+    close(log_fd);
+    log_fd = -1;
+    return 1;
+  }
+
+  sync_policy = sync;
+  stopping = 0;
+  if (sync_policy != WAL_SYNC_NONE &&
+      pthread_create(&sync_thread_id, NULL, sync_thread, NULL) != 0) {
+    fprintf(stderr, "Failed to start the write-ahead log sync thread\n");
+    close(log_fd);
+    log_fd = -1;
+    sync_policy = WAL_SYNC_NONE;
+    return 1;
+  }
+  log_path = strdup(path);
+  log_open = 1;
+  return 0;
+}
+
+uint64_t wal_append(const StringView *keys, const StringView *values,
+                    const int *order, size_t count) {
+  if (!log_open || count == 0) {
+    return 0;
+  }
+
+  // Formatted before taking the lock, so batches are only serialized by the
+  // write itself
+  char batch[WAL_MAX_BATCH];
+  size_t len = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t index = order != NULL ? (size_t)order[i] : i;
+    batch[len++] = '(';
+    memcpy(batch + len, keys[index].data, keys[index].len);
+    len += keys[index].len;
+    if (values != NULL) {
+      batch[len++] = ',';
+      batch[len++] = ' ';
+      memcpy(batch + len, values[index].data, values[index].len);
+      len += values[index].len;
+    }
+    batch[len++] = ')';
+    batch[len++] = '\n';
+  }
+  memcpy(batch + len, WAL_BATCH_END, sizeof(WAL_BATCH_END) - 1);
+  len += sizeof(WAL_BATCH_END) - 1;
+
+  safe_mutex_lock(&log_lock);
+  // The batch can't be acknowledged, and what was written of it would be
+  // adopted by the next #commit
+  if (write_all(log_fd, batch, len)) {
+    fprintf(stderr, "Failed to write to the write-ahead log\n");
+    exit(1);
+  }
+  end_position += len;
+  uint64_t position = end_position;
+  if (sync_policy != WAL_SYNC_NONE) {
+    pthread_cond_signal(&log_appended);
+  }
+  safe_mutex_unlock(&log_lock);
+  return position;
+}
+
+void wal_commit(uint64_t position) {
+  if (sync_policy != WAL_SYNC_COMMIT || position == 0) {
+    return;
+  }
+  safe_mutex_lock(&log_lock);
+  while (synced_position < position) {
+    pthread_cond_wait(&log_synced, &log_lock);
+  }
+  safe_mutex_unlock(&log_lock);
+}
+
+uint64_t wal_position() {
+  safe_mutex_lock(&log_lock);
+  uint64_t position = end_position;
+  safe_mutex_unlock(&log_lock);
+  return position;
+}
+
+void wal_checkpoint(const char *backup_path, uint64_t position) {
+  // The log may be replayed from another working directory
+  char resolved[PATH_MAX];
+  if (realpath(backup_path, resolved) == NULL) {
+    fprintf(stderr, "Failed to resolve backup path: %s\n", backup_path);
+    return;
+  }
+
+  safe_mutex_lock(&log_lock);
+  uint64_t offset = position - file_start;
+  if (log_open &&
+      (offset < WAL_COMPACT_SIZE || compact_log(resolved, offset) != 0)) {
+    char line[PATH_MAX + 32];
+    int len = snprintf(line, sizeof(line), "%s%lu %s\n", WAL_CHECKPOINT,
+                       (unsigned long)offset, resolved);
+    // Batches appended after a partial line would be lost in it
+    if (write_all(log_fd, line, (size_t)len)) {
+      fprintf(stderr, "Failed to write to the write-ahead log\n");
+      exit(1);
+    }
+    end_position += (size_t)len;
+    if (sync_policy != WAL_SYNC_NONE) {
+      pthread_cond_signal(&log_appended);
+    }
+  }
+  safe_mutex_unlock(&log_lock);
+}
+
+void wal_close() {
+  if (!log_open) {
+    return;
+  }
+  if (sync_policy != WAL_SYNC_NONE) {
+    safe_mutex_lock(&log_lock);
+    stopping = 1;
+    pthread_cond_signal(&log_appended);
+    safe_mutex_unlock(&log_lock);
+    pthread_join(sync_thread_id, NULL);
+  }
+  if (close(log_fd) == -1) {
+    fprintf(stderr, "Failed to close write-ahead log\n");
+  }
+  log_fd = -1;
+  log_open = 0;
+  free(log_path);
+  log_path = NULL;
+  sync_policy = WAL_SYNC_NONE;
+  end_position = 0;
+  synced_position = 0;
+  file_start = 0;
+}
@@ -0,0 +1,89 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+// Line ending every batch in the write-ahead log. Entries after the last one
+// belong to a batch that was cut short by a crash, and are discarded.
+#define WAL_BATCH_END "#commit\n"
+// Line recording a backup of the state at a position of the log, followed by
+// the position and the path of the backup.
+#define WAL_CHECKPOINT "#checkpoint "
+// Checkpoints with at least this many bytes of the log before them compact
+// it: the log is rewritten from the checkpoint on, so it doesn't grow without
+// bound.
+#define WAL_COMPACT_SIZE (1 << 20)
+// Interval between the syncs of the log with the periodic policy.
+#define WAL_SYNC_INTERVAL_MS 10
+// Longest batch of entries, a WRITE of MAX_WRITE_SIZE pairs.
+#define WAL_MAX_BATCH                                                          \
+  (MAX_WRITE_SIZE * (2 * MAX_STRING_SIZE + 5) + sizeof(WAL_BATCH_END))
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "kvs.h"
+
+// The log holds the WRITE and DELETE batches in the order they were applied,
+// with the entries of the backup files (see backup.h), and the checkpoint
+// lines of the backups taken. Its state is always the one of the table.
+
+// When the log is synced to disk.
+enum WalSync {
+  WAL_SYNC_COMMIT,   // Before a batch completes, concurrent batches share syncs
+  WAL_SYNC_PERIODIC, // Every WAL_SYNC_INTERVAL_MS, batches don't wait for it
+  WAL_SYNC_NONE,     // Left to the OS, survives the process but not the system
+};
+
+/// Parses the name of a sync policy: "commit", "periodic" or "none".
+/// @param name Name of the policy.
+/// @param sync Output policy.
+/// @return 0 on success, 1 if the name is unknown.
+int wal_parse_sync(const char *name, enum WalSync *sync);
+
+/// Replays the log into the table, from the latest backup it holds a
+/// checkpoint of, and opens it for appending. A missing log is created. The
+/// caller must have exclusive access to the table.
+/// @param ht Hash table the log is replayed into.
+/// @param path Path of the log.
+/// @param sync Sync policy of the batches appended.
+/// @param load_threads Maximum number of threads loading the backup of the
+/// checkpoint, see load_backup.
+/// @return 0 on success, 1 if the log could not be read or is malformed.
+int wal_open(HashTable *ht, const char *path, enum WalSync sync,
+             size_t load_threads);
+
+/// Appends a batch to the log. The keys must be locked, so that batches
+/// changing the same keys are logged in the order they were applied. Does
+/// nothing if the log isn't open.
+/// @param keys Keys of the batch.
+/// @param values Values written, NULL for a batch of deletions.
+/// @param order Order the entries are logged in, NULL for the given one.
+/// @param count Number of entries of the batch.
+/// @return Position of the end of the batch, to be passed to wal_commit.
+uint64_t wal_append(const StringView *keys, const StringView *values,
+                    const int *order, size_t count);
+
+/// Waits for the log to be synced up to the given position, if the policy
+/// requires it. Called once the keys are unlocked.
+/// @param position Position returned by wal_append.
+void wal_commit(uint64_t position);
+
+/// Current end of the log, where the state of a backup taken with the table
+/// locked ends.
+/// @return Position of the end of the log.
+uint64_t wal_position();
+
+/// Records that a backup holds the state up to the given position of the log.
+/// The backup must already be synced to disk, and checkpoints must be recorded
+/// in the order of their positions. If the log before the position is at
+/// least WAL_COMPACT_SIZE bytes, it is dropped: the rest of the log is copied
+/// to a new file, which starts with the checkpoint and replaces the log.
+/// Appends wait meanwhile.
+/// @param backup_path Path of the backup file.
+/// @param position Position returned by wal_position.
+void wal_checkpoint(const char *backup_path, uint64_t position);
+
+/// Syncs and closes the log.
+void wal_close();
+
+#endif // KVS_WAL_H